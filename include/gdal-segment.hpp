@@ -33,25 +33,227 @@ typedef struct LINE {
   unsigned int eY;
 } LINE;
 
+typedef struct ADJACENCY {
+  unsigned int lA;
+  unsigned int lB;
+  unsigned int length;
+} ADJACENCY;
+
+// raster grid georeference
+typedef struct GEOREF {
+  double transform[6];
+  std::string projection;
+} GEOREF;
+
+// stripe of rows with its label window
+typedef struct STRIPE {
+  int y0, y1;  // pixel rows
+  int lo, hi;  // label range incl. halo rows
+} STRIPE;
+
+// horizontal run of one label, ends where the next run starts
+typedef struct RUN {
+  int x;
+  int label;
+} RUN;
+
+// row-wise run-length labels, each row ends with a sentinel at cols
+typedef struct LABELRUNS {
+  int cols, rows;
+  std::vector< size_t > offset;  // row start in runs
+  std::vector< RUN > runs;
+} LABELRUNS;
+
+// shape descriptor columns
+enum { SHAPE_PERIMETER = 0, SHAPE_CX, SHAPE_CY,
+       SHAPE_COMPACT, SHAPE_ELONG, SHAPE_HOLES, SHAPE_COUNT };
+
+// boundary arc between two labels, -1 is outside
+typedef struct ARC {
+  int left, right;                  // labels on each side
+  unsigned int length;              // unit pixel edges
+  unsigned char first, last;        // end steps: east, south, west, north
+  bool closed;                      // ring without node
+  std::vector< cv::Point > points;  // corners, open arcs end on nodes
+} ARC;
+
+// arc-node topology with arcs per label
+typedef struct TOPOLOGY {
+  std::vector< ARC > arcs;
+  std::vector< int > offset;  // label range in refs
+  std::vector< int > refs;    // arc + 1, negative when label is left
+} TOPOLOGY;
+
+// polygon output options
+typedef struct VECTOROPTS {
+  bool stair;    // remove pixel staircase
+  double dptol;  // douglas-peucker tolerance in pixels
+  bool hilbert;  // write features in hilbert order
+  bool shapes;   // write shape descriptors
+  int shards;    // parallel output files
+} VECTOROPTS;
+
+// memory plan of a segmentation
+typedef struct PLAN {
+  double pixels;  // target grid size
+  double shared;  // bytes shared by all runs
+  double run;     // peak bytes of one run
+  int runs;       // concurrent runs
+  int threads;    // worker threads
+  double cache;   // gdal block cache bytes
+  double window;  // zonal read window bytes
+} PLAN;
+
 // raster operation
 void LoadRaster( const std::vector< std::string > InFilenames,
-                 std::vector< cv::Mat >& raster );
+                 std::vector< cv::Mat >& raster, GEOREF& georef,
+                 cv::Mat& mask, const double tres, const char *Resample,
+                 const bool interleave );
+
+// previous labels onto the raster grid
+void LoadLabels( const char *InitFilename, const GEOREF& georef,
+                 const int cols, const int rows, cv::Mat& initlabels );
 
-// raster statistics
-void ComputeStats( const cv::Mat klabels,
+// raster statistics, pixel extents unless traced by contours
+void ComputeStats( const LABELRUNS& runs,
                    const std::vector< cv::Mat > raster,
-                   cv::Mat& labelpixels, cv::Mat& avgCH, cv::Mat& stdCH );
+                   cv::Mat& labelpixels, cv::Mat& avgCH, cv::Mat& stdCH,
+                   cv::Mat *shapes = NULL, cv::Mat *bboxes = NULL );
+
+// zonal statistics from other rasters
+void ComputeZonalStats( const cv::Mat klabels, const GEOREF& georef,
+                        const std::vector< std::string > StatFilenames,
+                        const char *Resample, const size_t m_labels,
+                        std::vector< std::string >& names,
+                        cv::Mat& avgZS, cv::Mat& stdZS,
+                        const double window = 0.0f );
+
+// grow superpixels with the selected engine, invalid pixels get -1
+void GrowSuperpixels( const std::vector< cv::Mat > raster, const cv::Mat mask,
+                      const char *algo, const int regionsize, const int niter,
+                      const double scale, const cv::Mat initlabels,
+                      cv::Mat& klabels, std::vector< int >& ids, size_t& m_labels );
+
+// graph based segmentation
+void FelzenszwalbSegment( const std::vector< cv::Mat > raster, const cv::Mat mask,
+                          const double scale, cv::Mat& klabels, size_t& m_labels );
+
+// superpixels seeded from previous labels
+void SeededSegment( const std::vector< cv::Mat > raster, const cv::Mat mask,
+                    const cv::Mat initlabels, const int regionsize, const int niter,
+                    const double compactness, cv::Mat& klabels,
+                    std::vector< int >& ids, size_t& m_labels );
+
+// seed cells by local texture, sparse where uniform
+void AdaptiveSeeds( const std::vector< cv::Mat > raster, const cv::Mat mask,
+                    const int minregion, const int maxregion, cv::Mat& seeds );
+
+// label stripes
+void LabelStripes( const cv::Mat klabels, std::vector< STRIPE >& stripes );
+void RunStripes( const LABELRUNS& runs, std::vector< STRIPE >& stripes );
+
+// run-length labels
+void EncodeRuns( const cv::Mat klabels, LABELRUNS& runs );
+
+// label connectivity
+void EnforceConnectivity( cv::Mat& klabels, const int minsize, size_t& m_labels,
+                          std::vector< int > *ids = NULL );
 
 // vector contours
-void LabelContours( const cv::Mat klabels, std::vector< std::vector< LINE > >& linelists);
+void LabelContours( const LABELRUNS& runs,
+                    std::vector< std::vector< LINE > >& linelists,
+                    cv::Mat& bboxes,
+                    std::vector< ADJACENCY > *adjacency = NULL,
+                    cv::Mat *shapes = NULL );
+
+// polygon rings
+void BuildPolygons( std::vector< LINE >& lines,
+                    std::vector< std::vector< std::vector< cv::Point > > >& polygons );
+
+void SimplifyRing( std::vector< cv::Point >& ring, const bool stair, const double tolerance );
+
+// outer rings with their holes, by orientation
+void NestRings( std::vector< std::vector< cv::Point > >& rings,
+                std::vector< std::vector< std::vector< cv::Point > > >& polygons );
 
-// vactor dump
-void SavePolygons( const std::vector< std::string > InFilenames,
+// shared boundary arcs, each traced and simplified once
+void BuildTopology( const cv::Mat klabels, const size_t m_labels,
+                    const double tolerance, TOPOLOGY& topology,
+                    std::vector< ADJACENCY > *adjacency = NULL );
+
+// label polygons assembled from its arcs
+void ArcPolygons( const TOPOLOGY& topology, const int label,
+                  std::vector< std::vector< std::vector< cv::Point > > >& polygons );
+
+// spatial order by bbox (minX, minY, maxX, maxY)
+void HilbertOrder( const cv::Mat bboxes, std::vector< int >& order );
+
+// vactor dump, exits when the driver or output is unusable
+void SavePolygons( const GEOREF& georef,
                    const char *OutFilename, const char *OutFormat,
                    const cv::Mat klabels,
                    const std::vector< cv::Mat > raster,
                    const cv::Mat labelpixels,
+                   const std::vector< int >& labelids,
                    const cv::Mat avgCH, const cv::Mat stdCH,
-                   std::vector< std::vector< LINE > >& linelists );
+                   const std::vector< std::string > zsnames,
+                   const cv::Mat avgZS, const cv::Mat stdZS,
+                   std::vector< std::vector< LINE > >& linelists,
+                   const cv::Mat bboxes, const cv::Mat shapes,
+                   const std::vector< ADJACENCY >& adjacency,
+                   const VECTOROPTS& opts,
+                   const TOPOLOGY *topology = NULL );
+
+// boundary arcs with left and right labels
+void SaveArcs( const GEOREF& georef,
+               const char *OutFilename, const char *OutFormat,
+               const TOPOLOGY& topology,
+               const std::vector< int >& labelids );
+
+// statistics in chunked, compressed hdf5 datasets
+void SaveStats( const char *H5Filename, const cv::Mat klabels,
+                const cv::Mat labelpixels, const std::vector< int >& labelids,
+                const cv::Mat avgCH, const cv::Mat stdCH,
+                const cv::Mat avgZS, const cv::Mat stdZS,
+                const cv::Mat bboxes, const cv::Mat shapes,
+                const std::vector< ADJACENCY >& adjacency,
+                const int compress, const bool withlabels );
+
+// vector tile pyramid from labels, directory or .mbtiles
+void SaveTiles( const GEOREF& georef, const char *OutFilename,
+                const cv::Mat klabels, const cv::Mat labelpixels,
+                const std::vector< int >& labelids,
+                const cv::Mat avgCH, const cv::Mat stdCH,
+                const std::vector< std::string > zsnames,
+                const cv::Mat avgZS, const cv::Mat stdZS,
+                const VECTOROPTS& opts );
+
+// tiled label raster with a per label index
+void SaveLabelStore( const char *StoreFilename, const GEOREF& georef,
+                     const cv::Mat klabels, const cv::Mat labelpixels,
+                     const std::vector< int >& labelids,
+                     const cv::Mat avgCH, const cv::Mat stdCH, const cv::Mat bboxes );
+
+// polygons of selected labels from a store, by ids or map bbox
+int ExtractSegments( const char *StoreFilename, const char *mode, const char *list,
+                     const char *OutFilename, const char *OutFormat,
+                     const VECTOROPTS& opts );
+
+// memory size with K, M, G or T suffix
+double ParseMemory( const char *value );
+
+// estimate stage footprints, fit runs, cache and windows into budget
+bool PlanMemory( const std::vector< std::string > InFilenames,
+                 const std::vector< std::string > StatFilenames,
+                 const std::vector< std::string > algos,
+                 const std::vector< int > regions,
+                 const double tres, const bool labcol, const bool warmstart,
+                 const double memlimit, PLAN& plan );
+
+// one segmentation from command line arguments
+int Segment( int argc, char ** argv );
+
+// serve json job files from a spool directory
+int RunSpool( const char *SpoolDir, const int workers, const double memlimit );
 
 #endif
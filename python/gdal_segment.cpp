@@ -0,0 +1,309 @@
+/*
+ *  Copyright (c) 2015  Balint Cristian (cristian.balint@gmail.com)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+/* gdal_segment.cpp */
+/* Python bindings */
+
+#include <stdint.h>
+#include <stdexcept>
+
+#include <pybind11/pybind11.h>
+#include <pybind11/numpy.h>
+#include <pybind11/stl.h>
+
+#include "gdal.h"
+#include "gdal_priv.h"
+#include "ogrsf_frmts.h"
+#include "cpl_string.h"
+
+#include <opencv2/opencv.hpp>
+
+#include "gdal-segment.hpp"
+
+namespace py = pybind11;
+
+
+// opencv depth of a numpy dtype
+static int MatDepth( const py::dtype& dtype )
+{
+  if ( dtype.is( py::dtype::of< uint8_t >() ) ) return CV_8U;
+  if ( dtype.is( py::dtype::of< int8_t >() ) ) return CV_8S;
+  if ( dtype.is( py::dtype::of< uint16_t >() ) ) return CV_16U;
+  if ( dtype.is( py::dtype::of< int16_t >() ) ) return CV_16S;
+  if ( dtype.is( py::dtype::of< int32_t >() ) ) return CV_32S;
+  if ( dtype.is( py::dtype::of< float >() ) ) return CV_32F;
+  if ( dtype.is( py::dtype::of< double >() ) ) return CV_64F;
+  throw std::invalid_argument( "unsupported dtype, use uint8, int8, uint16, int16, int32, float32 or float64" );
+}
+
+// wrap a (rows, cols) or (rows, cols, bands) array without copy
+static cv::Mat AsMat( const py::array& array )
+{
+  if ( ( array.ndim() != 2 ) && ( array.ndim() != 3 ) )
+    throw std::invalid_argument( "arrays must be (rows, cols) or (rows, cols, bands)" );
+  const int cn = ( array.ndim() == 3 ) ? (int) array.shape(2) : 1;
+  if ( cn > CV_CN_MAX )
+    throw std::invalid_argument( CPLSPrintf( "at most %i bands per pixel interleaved array", CV_CN_MAX ) );
+  // pixels of a row must be packed, rows may be strided
+  const ssize_t item = array.itemsize();
+  if ( ( ( array.ndim() == 3 ) && ( array.strides(2) != item ) ) || ( array.strides(1) != item * cn ) )
+    throw std::invalid_argument( "array rows must be packed, use numpy.ascontiguousarray" );
+  return cv::Mat( (int) array.shape(0), (int) array.shape(1),
+                  CV_MAKETYPE( MatDepth( array.dtype() ), cn ),
+                  (void*) array.data(), (size_t) array.strides(0) );
+}
+
+// bands from one array or a sequence of arrays, arrays stay referenced
+static std::vector< cv::Mat > AsRaster( const py::object& bands, std::vector< py::array >& keep )
+{
+  if ( py::isinstance< py::array >( bands ) )
+    keep.push_back( bands.cast< py::array >() );
+  else
+    for ( py::handle band : bands )
+      keep.push_back( py::array::ensure( band ) );
+
+  std::vector< cv::Mat > raster;
+  for ( size_t r = 0; r < keep.size(); r++ )
+  {
+    raster.push_back( AsMat( keep[r] ) );
+    if ( raster[r].size() != raster[0].size() )
+      throw std::invalid_argument( "all bands must have the same shape" );
+  }
+  if ( raster.empty() )
+    throw std::invalid_argument( "no bands given" );
+  return raster;
+}
+
+// hand a matrix to numpy, the array owns it
+static py::array FromMat( const cv::Mat& mat )
+{
+  cv::Mat *owner = new cv::Mat( mat );
+  py::capsule release( owner, []( void *p ) { delete (cv::Mat*) p; } );
+  const py::dtype dtype = ( mat.depth() == CV_32S ) ? py::dtype::of< int32_t >()
+                                                    : py::dtype::of< double >();
+  return py::array( dtype, { (ssize_t) mat.rows, (ssize_t) mat.cols },
+                    { (ssize_t) mat.step[0], (ssize_t) mat.elemSize() },
+                    owner->data, release );
+}
+
+// label count of a label raster
+static size_t LabelCount( const cv::Mat& klabels )
+{
+  if ( klabels.type() != CV_32S )
+    throw std::invalid_argument( "labels must be int32" );
+  double lo, hi;
+  cv::minMaxLoc( klabels, &lo, &hi );
+  return ( hi < 0.0f ) ? 0 : (size_t) hi + 1;
+}
+
+static py::tuple PySegment( const py::object& bands, const std::string& algo,
+                          const int region, int niter, const double scale,
+                          const py::object& mask, const py::object& init,
+                          const bool merge )
+{
+  std::vector< py::array > keep;
+  const std::vector< cv::Mat > raster = AsRaster( bands, keep );
+  const int rows = raster[0].rows, cols = raster[0].cols;
+
+  const char *name = algo.c_str();
+  if ( !EQUAL( name, "SLIC" ) && !EQUAL( name, "SLICO" ) && !EQUAL( name, "MSLIC" )
+    && !EQUAL( name, "LSC" ) && !EQUAL( name, "SEEDS" ) && !EQUAL( name, "FH" ) )
+    throw std::invalid_argument( "algo must be LSC, SLICO, SLIC, SEEDS, MSLIC or FH" );
+  if ( region < 1 )
+    throw std::invalid_argument( "region must be positive" );
+
+  cv::Mat valid, initlabels;
+  py::array maskarray, initarray;
+  if ( !mask.is_none() )
+  {
+    maskarray = py::array_t< uint8_t, py::array::c_style | py::array::forcecast >::ensure( mask );
+    valid = AsMat( maskarray );
+    if ( valid.size() != raster[0].size() )
+      throw std::invalid_argument( "mask must match the band shape" );
+  }
+  if ( !init.is_none() )
+  {
+    if ( !EQUAL( name, "SLIC" ) )
+      throw std::invalid_argument( "init works with SLIC only" );
+    initarray = py::array_t< int32_t, py::array::c_style | py::array::forcecast >::ensure( init );
+    initlabels = AsMat( initarray );
+    if ( ( initlabels.rows != rows ) || ( initlabels.cols != cols ) )
+      throw std::invalid_argument( "init must match the band shape" );
+  }
+  if ( EQUAL( name, "SEEDS" ) && ( raster[0].depth() != CV_8U ) )
+    throw std::invalid_argument( "SEEDS needs uint8 bands" );
+
+  // defaults as the command line
+  if ( !niter )
+    niter = !initlabels.empty() ? 3 : ( EQUAL( name, "SEEDS" ) || EQUAL( name, "LSC" ) ) ? 20 : 10;
+
+  cv::Mat klabels;
+  std::vector< int > ids;
+  size_t m_labels = 0;
+  {
+    py::gil_scoped_release release;
+    GrowSuperpixels( raster, valid, name, region, niter, scale, initlabels,
+                     klabels, ids, m_labels );
+    if ( merge || EQUAL( name, "FH" ) || !initlabels.empty() )
+      EnforceConnectivity( klabels, merge ? ( region * region ) / 4 : 0, m_labels,
+                           initlabels.empty() ? NULL : &ids );
+  }
+
+  if ( ids.empty() )
+    return py::make_tuple( FromMat( klabels ), py::none() );
+  return py::make_tuple( FromMat( klabels ), py::array_t< int32_t >( ids.size(), &ids[0] ) );
+}
+
+static py::dict PyStats( const py::array_t< int32_t, py::array::c_style | py::array::forcecast >& labels,
+                       const py::object& bands, const bool withshapes )
+{
+  std::vector< py::array > keep;
+  const std::vector< cv::Mat > raster = AsRaster( bands, keep );
+  const cv::Mat klabels = AsMat( labels );
+  if ( klabels.size() != raster[0].size() )
+    throw std::invalid_argument( "labels must match the band shape" );
+
+  size_t m_bands = 0;
+  for ( size_t r = 0; r < raster.size(); r++ )
+    m_bands += raster[r].channels();
+  const size_t m_labels = LabelCount( klabels );
+
+  cv::Mat labelpixels( m_labels, 1, CV_32S );
+  cv::Mat avgCH( m_bands, m_labels, CV_64F );
+  cv::Mat stdCH( m_bands, m_labels, CV_64F );
+  cv::Mat bboxes, shapes;
+  {
+    py::gil_scoped_release release;
+    LABELRUNS runs;
+    EncodeRuns( klabels, runs );
+    if ( withshapes )
+    {
+      // perimeters come from the contours
+      std::vector< std::vector< LINE > > linelists( m_labels );
+      LabelContours( runs, linelists, bboxes, NULL, &shapes );
+    }
+    ComputeStats( runs, raster, labelpixels, avgCH, stdCH,
+                  withshapes ? &shapes : NULL );
+  }
+
+  py::dict stats;
+  stats["pixarea"] = FromMat( labelpixels );
+  stats["average"] = FromMat( avgCH );
+  stats["stddevs"] = FromMat( stdCH );
+  if ( withshapes )
+  {
+    stats["shapes"] = FromMat( shapes );
+    stats["bboxes"] = FromMat( bboxes );
+  }
+  return stats;
+}
+
+static void PySave( const std::string& filename,
+                  const py::array_t< int32_t, py::array::c_style | py::array::forcecast >& labels,
+                  const py::object& bands, const std::vector< double >& transform,
+                  const std::string& projection, const std::string& format,
+                  const py::object& ids, const bool stair, const double simplify,
+                  const std::string& sort, const bool withshapes, const bool neighbours )
+{
+  std::vector< py::array > keep;
+  const std::vector< cv::Mat > raster = AsRaster( bands, keep );
+  const cv::Mat klabels = AsMat( labels );
+  if ( klabels.size() != raster[0].size() )
+    throw std::invalid_argument( "labels must match the band shape" );
+  if ( transform.size() != 6 )
+    throw std::invalid_argument( "transform must hold 6 geotransform values" );
+
+  // the writer exits on a missing driver
+#if GDALVER >= 2
+  if ( GetGDALDriverManager()->GetDriverByName( format.c_str() ) == NULL )
+#else
+  if ( OGRSFDriverRegistrar::GetRegistrar()->GetDriverByName( format.c_str() ) == NULL )
+#endif
+    throw std::invalid_argument( "no OGR driver named " + format );
+
+  GEOREF georef;
+  std::copy( transform.begin(), transform.end(), georef.transform );
+  georef.projection = projection;
+
+  VECTOROPTS vopts;
+  vopts.stair = stair;
+  vopts.dptol = simplify;
+  vopts.hilbert = ( sort == "hilbert" );
+  vopts.shapes = withshapes;
+  vopts.shards = 1;
+
+  size_t m_bands = 0;
+  for ( size_t r = 0; r < raster.size(); r++ )
+    m_bands += raster[r].channels();
+  const size_t m_labels = LabelCount( klabels );
+
+  std::vector< int > labelids;
+  if ( !ids.is_none() )
+    labelids = ids.cast< std::vector< int > >();
+  if ( !labelids.empty() && ( labelids.size() != m_labels ) )
+    throw std::invalid_argument( "ids must hold one id per label" );
+
+  py::gil_scoped_release release;
+
+  LABELRUNS runs;
+  EncodeRuns( klabels, runs );
+
+  std::vector< std::vector< LINE > > linelists( m_labels );
+  std::vector< ADJACENCY > adjacency;
+  cv::Mat bboxes, shapes;
+  LabelContours( runs, linelists, bboxes, neighbours ? &adjacency : NULL,
+                 withshapes ? &shapes : NULL );
+
+  cv::Mat labelpixels( m_labels, 1, CV_32S );
+  cv::Mat avgCH( m_bands, m_labels, CV_64F );
+  cv::Mat stdCH( m_bands, m_labels, CV_64F );
+  ComputeStats( runs, raster, labelpixels, avgCH, stdCH,
+                withshapes ? &shapes : NULL );
+
+  const std::vector< std::string > zsnames;
+  SavePolygons( georef, filename.c_str(), format.c_str(), klabels,
+                raster, labelpixels, labelids, avgCH, stdCH,
+                zsnames, cv::Mat(), cv::Mat(), linelists, bboxes,
+                shapes, adjacency, vopts );
+}
+
+PYBIND11_MODULE( gdal_segment, m )
+{
+  m.doc() = "Segment in memory rasters, bands are numpy arrays shared without copy";
+
+  // drivers for vector output
+  GDALAllRegister();
+  OGRRegisterAll();
+
+  m.def( "segment", &PySegment,
+         "Segment bands, returns (labels, ids). ids holds stable object ids with init, else None.",
+         py::arg( "bands" ), py::arg( "algo" ) = "SLIC", py::arg( "region" ) = 10,
+         py::arg( "niter" ) = 0, py::arg( "scale" ) = 300.0f, py::arg( "mask" ) = py::none(),
+         py::arg( "init" ) = py::none(), py::arg( "merge" ) = true );
+
+  m.def( "compute_stats", &PyStats,
+         "Per label pixarea, average and stddevs (bands x labels), optional shapes and bboxes.",
+         py::arg( "labels" ), py::arg( "bands" ), py::arg( "shapes" ) = false );
+
+  m.def( "save_polygons", &PySave,
+         "Vectorize labels with their statistics through any OGR driver.\n"
+         "An output the driver cannot create ends the process, as in the tool.",
+         py::arg( "filename" ), py::arg( "labels" ), py::arg( "bands" ),
+         py::arg( "transform" ) = std::vector< double >{ 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, -1.0f },
+         py::arg( "projection" ) = "", py::arg( "format" ) = "ESRI Shapefile",
+         py::arg( "ids" ) = py::none(), py::arg( "stair" ) = false,
+         py::arg( "simplify" ) = 0.0f, py::arg( "sort" ) = "label",
+         py::arg( "shapes" ) = false, py::arg( "adjacency" ) = false );
+}
@@ -0,0 +1,87 @@
+#!/usr/bin/env python3
+#
+# Submit a job to a running spool service and wait for its result.
+#
+#   ../bin/gdal-segment -spool /tmp/spool -workers 2 -spoolmem 4096 &
+#   ./spool-client.py /tmp/spool job1 25cm_orto0.jpg -algo SLIC -region 10 -out output-slic.shp
+#   touch /tmp/spool/STOP
+#
+
+import json
+import os
+import sys
+import time
+
+
+def job_description(argv):
+    # inputs first; options become keys, several values an array,
+    # flags true, repeated options an array of value arrays
+    job = {"inputs": []}
+    uses = {}
+    i = 0
+    while i < len(argv):
+        arg = argv[i]
+        if not arg.startswith("-"):
+            job["inputs"].append(arg)
+            i += 1
+            continue
+        key = arg[1:]
+        values = []
+        i += 1
+        while i < len(argv) and not argv[i].startswith("-"):
+            values.append(argv[i])
+            i += 1
+        uses.setdefault(key, []).append(values)
+    for key, values in uses.items():
+        if not values[0]:
+            job[key] = True
+        elif len(values) > 1:
+            job[key] = values
+        else:
+            job[key] = values[0][0] if len(values[0]) == 1 else values[0]
+    return job
+
+
+def absolute(value):
+    # nested value arrays of repeated options
+    if isinstance(value, list):
+        return [absolute(v) for v in value]
+    return os.path.abspath(value)
+
+
+def main():
+    if len(sys.argv) < 4:
+        print("Usage: spool-client.py <spool dir> <job name> <gdal-segment arguments>")
+        return 1
+
+    spool, name = sys.argv[1], sys.argv[2]
+    job = job_description(sys.argv[3:])
+
+    # inputs relative to the caller
+    job["inputs"] = [os.path.abspath(f) for f in job["inputs"]]
+    for key in ("out", "h5stat", "init", "statraster", "labelstore"):
+        if key in job:
+            job[key] = absolute(job[key])
+
+    # appear atomically to the service
+    path = os.path.join(spool, name + ".json")
+    with open(path + ".tmp", "w") as f:
+        json.dump(job, f, indent=2)
+    os.rename(path + ".tmp", path)
+
+    result = os.path.join(spool, name + ".result.json")
+    start = time.time()
+    while not os.path.exists(result):
+        time.sleep(0.2)
+
+    with open(result) as f:
+        status = json.load(f)
+    os.remove(result)
+
+    print("job %s %s in %.3f sec (service %.3f sec)"
+          % (name, status["status"], time.time() - start, status["seconds"]))
+    return status["code"]
+
+
+if __name__ == "__main__":
+    sys.exit(main())
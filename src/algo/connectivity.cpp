@@ -0,0 +1,348 @@
+/*
+ *  Copyright (c) 2015  Balint Cristian (cristian.balint@gmail.com)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+/* connectivity.cpp */
+/* Label connectivity */
+
+#include <omp.h>
+#include <climits>
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+
+#include "gdal.h"
+
+#include <opencv2/opencv.hpp>
+
+#include "gdal-segment.hpp"
+
+using namespace std;
+using namespace cv;
+
+
+// find root (read only)
+template< typename IDX >
+static inline IDX FindRoot( const IDX *parent, IDX i )
+{
+  while ( parent[i] != i )
+    i = parent[i];
+  return i;
+}
+
+// find root with path halving
+template< typename IDX >
+static inline IDX FindHalve( IDX *parent, IDX i )
+{
+  while ( parent[i] != i )
+  {
+    parent[i] = parent[parent[i]];
+    i = parent[i];
+  }
+  return i;
+}
+
+// link roots, lowest index wins
+template< typename IDX >
+static inline void Unite( IDX *parent, IDX a, IDX b )
+{
+  a = FindHalve( parent, a );
+  b = FindHalve( parent, b );
+  if ( a < b ) parent[b] = a;
+  else if ( b < a ) parent[a] = b;
+}
+
+// split labels into connected components, dense ids in raster scan order
+template< typename IDX >
+static int64 SplitComponents( int *labels, const int cols, const int rows,
+                              std::vector< int > *complabel )
+{
+  const IDX npix = (IDX) cols * rows;
+
+  // pixel index maps, left uninitialized so the stripe
+  // threads touch their own pages first
+  std::unique_ptr< IDX[] > parents( new IDX[npix] );
+  std::unique_ptr< IDX[] > rootmap( new IDX[npix] );
+  IDX *parent = parents.get();
+  IDX *roots = rootmap.get();
+
+  // split in horizontal stripes
+  const int nstripes = std::max( 1, std::min( rows, omp_get_max_threads() ) );
+  const int srows = ( rows + nstripes - 1 ) / nstripes;
+  std::vector< IDX > offsets( nstripes + 1, 0 );
+
+  // label each stripe independently
+  #pragma omp parallel for schedule(static)
+  for ( int s = 0; s < nstripes; s++ )
+  {
+    const int y0 = s * srows;
+    const int y1 = std::min( rows, y0 + srows );
+    for ( int y = y0; y < y1; y++ )
+    {
+      const IDX yoff = (IDX) y * cols;
+      for ( int x = 0; x < cols; x++ )
+      {
+        const IDX i = yoff + x;
+        const int l = labels[i];
+        parent[i] = i;
+        if ( l < 0 ) continue;
+        // left and top neighbours
+        if ( ( x > 0 ) && ( labels[i - 1] == l ) )
+          Unite( parent, i, i - 1 );
+        if ( ( y > y0 ) && ( labels[i - cols] == l ) )
+          Unite( parent, i, i - cols );
+      }
+    }
+  }
+  GDALTermProgress( 0.25f, NULL, NULL );
+
+  // merge stripe borders
+  for ( int s = 1; s < nstripes; s++ )
+  {
+    const int y0 = s * srows;
+    if ( y0 >= rows ) break;
+    const IDX yoff = (IDX) y0 * cols;
+    for ( int x = 0; x < cols; x++ )
+    {
+      const IDX i = yoff + x;
+      if ( ( labels[i] >= 0 ) && ( labels[i] == labels[i - cols] ) )
+        Unite( parent, i, i - cols );
+    }
+  }
+
+  // flatten and count roots
+  #pragma omp parallel for schedule(static)
+  for ( int s = 0; s < nstripes; s++ )
+  {
+    const IDX i0 = std::min( npix, (IDX) s * srows * cols );
+    const IDX i1 = std::min( npix, (IDX) ( s + 1 ) * srows * cols );
+    IDX count = 0;
+    for ( IDX i = i0; i < i1; i++ )
+    {
+      roots[i] = FindRoot( parent, i );
+      if ( ( roots[i] == i ) && ( labels[i] >= 0 ) ) count++;
+    }
+    offsets[s + 1] = count;
+  }
+  for ( int s = 0; s < nstripes; s++ )
+    offsets[s + 1] += offsets[s];
+  GDALTermProgress( 0.50f, NULL, NULL );
+
+  // labels stay 32 bit
+  const int64 ncomps = offsets[nstripes];
+  if ( ncomps > INT_MAX )
+    return ncomps;
+
+  // dense ids in raster scan order
+  #pragma omp parallel for schedule(static)
+  for ( int s = 0; s < nstripes; s++ )
+  {
+    const IDX i0 = std::min( npix, (IDX) s * srows * cols );
+    const IDX i1 = std::min( npix, (IDX) ( s + 1 ) * srows * cols );
+    IDX id = offsets[s];
+    for ( IDX i = i0; i < i1; i++ )
+      if ( ( roots[i] == i ) && ( labels[i] >= 0 ) )
+        parent[i] = id++;
+  }
+
+  // input label of each component
+  if ( complabel )
+  {
+    complabel->resize( ncomps );
+    #pragma omp parallel for schedule(static)
+    for ( IDX i = 0; i < npix; i++ )
+      if ( ( roots[i] == i ) && ( labels[i] >= 0 ) )
+        (*complabel)[parent[i]] = labels[i];
+  }
+
+  #pragma omp parallel for schedule(static)
+  for ( IDX i = 0; i < npix; i++ )
+    if ( labels[i] >= 0 )
+      labels[i] = (int) parent[roots[i]];
+
+  return ncomps;
+}
+
+void EnforceConnectivity( cv::Mat& klabels, const int minsize, size_t& m_labels,
+                          std::vector< int > *ids )
+{
+  CV_Assert( klabels.type() == CV_32S && klabels.isContinuous() );
+
+  const int cols = klabels.cols;
+  const int rows = klabels.rows;
+  const int64 npix = (int64) cols * rows;
+
+  int *labels = klabels.ptr<int>();
+
+  printf ("Enforce label connectivity\n");
+  printf ("       ");
+
+  // 32 bit pixel indices while they fit
+  std::vector< int > complabel;
+  const int64 found = ( npix <= INT_MAX )
+                    ? SplitComponents< int >( labels, cols, rows, ids ? &complabel : NULL )
+                    : SplitComponents< int64 >( labels, cols, rows, ids ? &complabel : NULL );
+  if ( found > INT_MAX )
+  {
+    printf( "\nERROR: %lli connected components exceed 32 bit labels.\n", (long long) found );
+    exit( 1 );
+  }
+  int ncomps = (int) found;
+  GDALTermProgress( 0.75f, NULL, NULL );
+
+  // component sizes
+  std::vector< int > sizes;
+  if ( ( minsize > 1 ) || ids )
+  {
+    // per stripe counts over its label window
+    std::vector< STRIPE > stripes;
+    LabelStripes( klabels, stripes );
+    const int nstripes = (int) stripes.size();
+    std::vector< std::vector< int > > stripecount( nstripes );
+    #pragma omp parallel for schedule(static)
+    for ( int s = 0; s < nstripes; s++ )
+    {
+      const STRIPE& stripe = stripes[s];
+      if ( stripe.hi < stripe.lo ) continue;
+      std::vector< int >& count = stripecount[s];
+      count.assign( stripe.hi - stripe.lo + 1, 0 );
+      for ( int y = stripe.y0; y < stripe.y1; y++ )
+      {
+        const int *row = klabels.ptr<int>(y);
+        for ( int x = 0; x < cols; x++ )
+          if ( row[x] >= 0 ) count[row[x] - stripe.lo]++;
+      }
+    }
+    sizes.assign( ncomps, 0 );
+    #pragma omp parallel for schedule(dynamic, 4096)
+    for ( int c = 0; c < ncomps; c++ )
+      for ( int s = 0; s < nstripes; s++ )
+        if ( ( c >= stripes[s].lo ) && ( c <= stripes[s].hi ) )
+          sizes[c] += stripecount[s][c - stripes[s].lo];
+  }
+
+  // largest piece keeps the label id, other pieces get new ones
+  std::vector< int > compid;
+  if ( ids )
+  {
+    int next = 0;
+    for ( size_t l = 0; l < ids->size(); l++ )
+      next = std::max( next, (*ids)[l] + 1 );
+    std::vector< int > keeper( ids->size(), -1 );
+    for ( int c = 0; c < ncomps; c++ )
+    {
+      int& k = keeper[complabel[c]];
+      if ( ( k < 0 ) || ( sizes[c] > sizes[k] ) ) k = c;
+    }
+    compid.resize( ncomps );
+    for ( int c = 0; c < ncomps; c++ )
+      compid[c] = ( keeper[complabel[c]] == c ) ? (*ids)[complabel[c]] : next++;
+    *ids = compid;
+  }
+
+  if ( minsize > 1 )
+  {
+    // shared border length of small fragments
+    const int nthreads = omp_get_max_threads();
+    std::vector< std::unordered_map< unsigned long long, int > > borders( nthreads );
+    #pragma omp parallel for schedule(static)
+    for ( int y = 0; y < rows; y++ )
+    {
+      std::unordered_map< unsigned long long, int >& border = borders[omp_get_thread_num()];
+      const int64 yoff = (int64) y * cols;
+      for ( int x = 0; x < cols; x++ )
+      {
+        const int64 i = yoff + x;
+        const int c = labels[i];
+        if ( ( c < 0 ) || ( sizes[c] >= minsize ) ) continue;
+        int n[4] = { -1, -1, -1, -1 };
+        if ( x > 0 ) n[0] = labels[i - 1];
+        if ( x < cols - 1 ) n[1] = labels[i + 1];
+        if ( y > 0 ) n[2] = labels[i - cols];
+        if ( y < rows - 1 ) n[3] = labels[i + cols];
+        for ( int k = 0; k < 4; k++ )
+          if ( ( n[k] >= 0 ) && ( n[k] != c ) )
+            border[ ( (unsigned long long) c << 32 ) | (unsigned int) n[k] ]++;
+      }
+    }
+    for ( int t = 1; t < nthreads; t++ )
+    {
+      for ( auto it = borders[t].begin(); it != borders[t].end(); ++it )
+        borders[0][it->first] += it->second;
+      borders[t].clear();
+    }
+
+    // best neighbour by longest border, then by size
+    std::vector< int > best( ncomps, -1 );
+    std::vector< int > bestlen( ncomps, 0 );
+    for ( auto it = borders[0].begin(); it != borders[0].end(); ++it )
+    {
+      const int c = (int) ( it->first >> 32 );
+      const int n = (int) ( it->first & 0xffffffffULL );
+      if ( ( it->second > bestlen[c] )
+         ||( ( it->second == bestlen[c] )
+           &&( ( sizes[n] > sizes[best[c]] )
+             ||( ( sizes[n] == sizes[best[c]] ) && ( n < best[c] ) ) ) ) )
+      {
+        best[c] = n;
+        bestlen[c] = it->second;
+      }
+    }
+    borders.clear();
+
+    // absorb fragments, biggest component wins
+    std::vector< int > cparent( ncomps );
+    std::vector< int > csizes( sizes );
+    for ( int c = 0; c < ncomps; c++ )
+      cparent[c] = c;
+    for ( int c = 0; c < ncomps; c++ )
+    {
+      if ( ( sizes[c] >= minsize ) || ( best[c] < 0 ) ) continue;
+      int a = FindHalve( &cparent[0], c );
+      int b = FindHalve( &cparent[0], best[c] );
+      if ( a == b ) continue;
+      if ( ( csizes[a] > csizes[b] )
+         ||( ( csizes[a] == csizes[b] ) && ( a < b ) ) )
+        std::swap( a, b );
+      cparent[a] = b;
+      csizes[b] += csizes[a];
+    }
+
+    // compact surviving components
+    std::vector< int > newid( ncomps, -1 );
+    int nfinal = 0;
+    for ( int c = 0; c < ncomps; c++ )
+      if ( FindHalve( &cparent[0], c ) == c )
+        newid[c] = nfinal++;
+    if ( ids )
+    {
+      ids->resize( nfinal );
+      for ( int c = 0; c < ncomps; c++ )
+        if ( newid[c] >= 0 ) (*ids)[newid[c]] = compid[c];
+    }
+    for ( int c = 0; c < ncomps; c++ )
+      newid[c] = newid[FindRoot( &cparent[0], c )];
+
+    #pragma omp parallel for schedule(static)
+    for ( int64 i = 0; i < npix; i++ )
+      if ( labels[i] >= 0 )
+        labels[i] = newid[labels[i]];
+
+    ncomps = nfinal;
+  }
+  GDALTermProgress( 1.0f, NULL, NULL );
+
+  m_labels = (size_t) ncomps;
+}
@@ -0,0 +1,279 @@
+/*
+ *  Copyright (c) 2015  Balint Cristian (cristian.balint@gmail.com)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+/* felzenszwalb.cpp */
+/* Graph based segmentation */
+
+#include <omp.h>
+#include <math.h>
+#include <string.h>
+#include <climits>
+#include <vector>
+#include <algorithm>
+
+#include "gdal.h"
+
+#include <opencv2/opencv.hpp>
+
+#include "gdal-segment.hpp"
+
+using namespace std;
+using namespace cv;
+
+
+// find root (read only)
+static inline int FindRoot( const int *parent, int i )
+{
+  while ( parent[i] != i )
+    i = parent[i];
+  return i;
+}
+
+// find root with path halving
+static inline int FindHalve( int *parent, int i )
+{
+  while ( parent[i] != i )
+  {
+    parent[i] = parent[parent[i]];
+    i = parent[i];
+  }
+  return i;
+}
+
+// edge endpoints, low bit selects right or down neighbour
+static inline void EdgeEnds( const unsigned int e, const int cols, int& p, int& q )
+{
+  p = (int) ( e >> 1 );
+  q = ( e & 1 ) ? p + cols : p + 1;
+}
+
+// accumulate squared band differences along edges
+template< typename T >
+static void EdgeDiff( const cv::Mat& band, const std::vector< unsigned int >& edges,
+                      float *weight )
+{
+  const int cols = band.cols;
+  const int cn = band.channels();
+  const T *pixel = band.ptr<T>();
+  for ( size_t n = 0; n < edges.size(); n++ )
+  {
+    int p, q;
+    EdgeEnds( edges[n], cols, p, q );
+    float sum = 0.0f;
+    for ( int c = 0; c < cn; c++ )
+    {
+      const float d = (float) pixel[p * cn + c] - (float) pixel[q * cn + c];
+      sum += d * d;
+    }
+    weight[n] += sum;
+  }
+}
+
+// euclidean edge weights over all bands
+static void EdgeWeights( const std::vector< cv::Mat >& raster,
+                         const std::vector< unsigned int >& edges,
+                         std::vector< float >& weight )
+{
+  weight.assign( edges.size(), 0.0f );
+  if ( edges.empty() ) return;
+  for ( size_t r = 0; r < raster.size(); r++ )
+  {
+    switch ( raster[r].depth() )
+    {
+      case CV_8U:  EdgeDiff< uchar >( raster[r], edges, &weight[0] ); break;
+      case CV_8S:  EdgeDiff< schar >( raster[r], edges, &weight[0] ); break;
+      case CV_16U: EdgeDiff< ushort >( raster[r], edges, &weight[0] ); break;
+      case CV_16S: EdgeDiff< short >( raster[r], edges, &weight[0] ); break;
+      case CV_32S: EdgeDiff< int >( raster[r], edges, &weight[0] ); break;
+      case CV_32F: EdgeDiff< float >( raster[r], edges, &weight[0] ); break;
+      case CV_64F: EdgeDiff< double >( raster[r], edges, &weight[0] ); break;
+      default:
+        CV_Error( Error::StsInternal, "\nERROR: Invalid raster depth" );
+        break;
+    }
+  }
+  for ( size_t n = 0; n < weight.size(); n++ )
+    weight[n] = sqrtf( weight[n] );
+}
+
+// lsd radix sort of non negative float keys with payload
+static void RadixSort( std::vector< float >& weight, std::vector< unsigned int >& edges )
+{
+  const size_t n = weight.size();
+  std::vector< unsigned int > keys( n ), tkeys( n ), tvals( n );
+  // ordering of non negative floats equals their bit patterns
+  memcpy( &keys[0], &weight[0], n * sizeof( float ) );
+
+  for ( int shift = 0; shift < 32; shift += 8 )
+  {
+    size_t count[257] = { 0 };
+    for ( size_t i = 0; i < n; i++ )
+      count[ ( ( keys[i] >> shift ) & 0xff ) + 1 ]++;
+    // pass not needed if all share the digit
+    if ( *std::max_element( count + 1, count + 257 ) == n ) continue;
+    for ( int d = 0; d < 256; d++ )
+      count[d + 1] += count[d];
+    for ( size_t i = 0; i < n; i++ )
+    {
+      const size_t pos = count[ ( keys[i] >> shift ) & 0xff ]++;
+      tkeys[pos] = keys[i];
+      tvals[pos] = edges[i];
+    }
+    keys.swap( tkeys );
+    edges.swap( tvals );
+  }
+  memcpy( &weight[0], &keys[0], n * sizeof( float ) );
+}
+
+// merge two components if edge is below both internal thresholds
+static inline void MergeEdge( int *parent, int *sizes, float *thresh,
+                              int p, int q, const float w, const float k )
+{
+  p = FindHalve( parent, p );
+  q = FindHalve( parent, q );
+  if ( p == q ) return;
+  if ( ( w > thresh[p] ) || ( w > thresh[q] ) ) return;
+  // lowest index wins
+  if ( q < p ) std::swap( p, q );
+  parent[q] = p;
+  sizes[p] += sizes[q];
+  thresh[p] = w + k / sizes[p];
+}
+
+void FelzenszwalbSegment( const std::vector< cv::Mat > raster, const cv::Mat mask,
+                          const double scale, cv::Mat& klabels, size_t& m_labels )
+{
+  const int cols = raster[0].cols;
+  const int rows = raster[0].rows;
+  const int npix = cols * rows;
+  const float k = (float) scale;
+
+  for ( size_t r = 0; r < raster.size(); r++ )
+    CV_Assert( raster[r].isContinuous() );
+  CV_Assert( mask.empty() || mask.isContinuous() );
+
+  // edge ids carry one direction bit
+  if ( npix > INT_MAX / 2 )
+  {
+    printf ("\nERROR: Raster too large for graph segmentation.\n");
+    exit ( 1 );
+  }
+
+  klabels.create( rows, cols, CV_32S );
+  int *labels = klabels.ptr<int>();
+
+  // first written by the tile threads
+  cv::Mat parents( rows, cols, CV_32S );
+  cv::Mat sizemap( rows, cols, CV_32S );
+  cv::Mat threshmap( rows, cols, CV_32F );
+  int *parent = parents.ptr<int>();
+  int *sizes = sizemap.ptr<int>();
+  float *thresh = threshmap.ptr<float>();
+
+  // one tile of rows per thread
+  const int ntiles = std::max( 1, std::min( rows, omp_get_max_threads() ) );
+  const int trows = ( rows + ntiles - 1 ) / ntiles;
+
+  printf ("Graph segmentation (k = %.2f)\n", scale);
+  printf ("       ");
+
+  #pragma omp parallel for schedule(static)
+  for ( int t = 0; t < ntiles; t++ )
+  {
+    const int y0 = t * trows;
+    const int y1 = std::min( rows, y0 + trows );
+    if ( y0 >= y1 ) continue;
+
+    // edges within the tile
+    std::vector< unsigned int > edges;
+    edges.reserve( (size_t) 2 * ( y1 - y0 ) * cols );
+    for ( int y = y0; y < y1; y++ )
+    {
+      const uchar *valid = mask.empty() ? NULL : mask.ptr<uchar>(y);
+      const uchar *below = ( mask.empty() || ( y + 1 >= y1 ) ) ? NULL : mask.ptr<uchar>(y+1);
+      for ( int x = 0; x < cols; x++ )
+      {
+        const unsigned int i = y * cols + x;
+        parent[i] = i;
+        sizes[i] = 1;
+        thresh[i] = k;
+        if ( valid && !valid[x] ) continue;
+        if ( ( x + 1 < cols ) && ( !valid || valid[x+1] ) )
+          edges.push_back( i << 1 );
+        if ( ( y + 1 < y1 ) && ( !below || below[x] ) )
+          edges.push_back( ( i << 1 ) | 1 );
+      }
+    }
+
+    // euclidean distance over all bands
+    std::vector< float > weight;
+    EdgeWeights( raster, edges, weight );
+
+    if ( edges.empty() ) continue;
+    RadixSort( weight, edges );
+
+    // union within the tile
+    for ( size_t n = 0; n < edges.size(); n++ )
+    {
+      int p, q;
+      EdgeEnds( edges[n], cols, p, q );
+      MergeEdge( parent, sizes, thresh, p, q, weight[n], k );
+    }
+  }
+  GDALTermProgress( 0.50f, NULL, NULL );
+
+  // tile boundary edges, merged in weight order
+  std::vector< unsigned int > edges;
+  for ( int t = 1; t < ntiles; t++ )
+  {
+    const int y = t * trows - 1;
+    if ( y + 1 >= rows ) break;
+    const uchar *valid = mask.empty() ? NULL : mask.ptr<uchar>(y);
+    const uchar *below = mask.empty() ? NULL : mask.ptr<uchar>(y+1);
+    for ( int x = 0; x < cols; x++ )
+      if ( !valid || ( valid[x] && below[x] ) )
+        edges.push_back( ( (unsigned int) ( y * cols + x ) << 1 ) | 1 );
+  }
+  if ( !edges.empty() )
+  {
+    std::vector< float > weight;
+    EdgeWeights( raster, edges, weight );
+    RadixSort( weight, edges );
+    for ( size_t n = 0; n < edges.size(); n++ )
+    {
+      int p, q;
+      EdgeEnds( edges[n], cols, p, q );
+      MergeEdge( parent, sizes, thresh, p, q, weight[n], k );
+    }
+  }
+  GDALTermProgress( 0.75f, NULL, NULL );
+
+  // component roots as labels
+  size_t ncomps = 0;
+  #pragma omp parallel for schedule(static) reduction(+:ncomps)
+  for ( int i = 0; i < npix; i++ )
+  {
+    if ( !mask.empty() && !mask.ptr<uchar>()[i] )
+    {
+      labels[i] = -1;
+      continue;
+    }
+    labels[i] = FindRoot( parent, i );
+    if ( labels[i] == i ) ncomps++;
+  }
+  GDALTermProgress( 1.0f, NULL, NULL );
+
+  m_labels = ncomps;
+}
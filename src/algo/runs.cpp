@@ -0,0 +1,84 @@
+/*
+ *  Copyright (c) 2015  Balint Cristian (cristian.balint@gmail.com)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+/* runs.cpp */
+/* Run-length labels */
+
+#include <omp.h>
+#include <climits>
+#include <algorithm>
+
+#include <opencv2/opencv.hpp>
+
+#include "gdal-segment.hpp"
+
+using namespace std;
+using namespace cv;
+
+
+void EncodeRuns( const cv::Mat klabels, LABELRUNS& runs )
+{
+  const int rows = klabels.rows;
+  const int cols = klabels.cols;
+
+  runs.cols = cols;
+  runs.rows = rows;
+  runs.offset.assign( rows + 1, 0 );
+
+  // runs per row, plus the sentinel
+  #pragma omp parallel for schedule(static)
+  for ( int y = 0; y < rows; y++ )
+  {
+    const int *label = klabels.ptr<int>(y);
+    size_t n = 1;
+    int prev = INT_MIN;
+    for ( int x = 0; x < cols; x++ )
+    {
+      // any negative label is invalid
+      const int k = std::max( -1, label[x] );
+      if ( k != prev ) n++;
+      prev = k;
+    }
+    runs.offset[y + 1] = n;
+  }
+  for ( int y = 0; y < rows; y++ )
+    runs.offset[y + 1] += runs.offset[y];
+
+  runs.runs.resize( runs.offset[rows] );
+  #pragma omp parallel for schedule(static)
+  for ( int y = 0; y < rows; y++ )
+  {
+    const int *label = klabels.ptr<int>(y);
+    RUN *run = &runs.runs[ runs.offset[y] ];
+    int prev = INT_MIN;
+    for ( int x = 0; x < cols; x++ )
+    {
+      const int k = std::max( -1, label[x] );
+      if ( k != prev )
+      {
+        run->x = x;
+        run->label = k;
+        run++;
+      }
+      prev = k;
+    }
+    run->x = cols;
+    run->label = -1;
+  }
+
+  printf( "Label runs: %lu (%.1f MB, dense %.1f MB)\n", runs.runs.size(),
+          runs.runs.size() * sizeof( RUN ) / ( 1024.0f * 1024.0f ),
+          (double) rows * cols * sizeof( int ) / ( 1024.0f * 1024.0f ) );
+}
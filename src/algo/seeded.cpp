@@ -0,0 +1,481 @@
+/*
+ *  Copyright (c) 2015  Balint Cristian (cristian.balint@gmail.com)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+/* seeded.cpp */
+/* Superpixels seeded from previous labels */
+
+#include <omp.h>
+#include <math.h>
+#include <float.h>
+#include <climits>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+
+#include "gdal.h"
+
+#include <opencv2/opencv.hpp>
+
+#include "gdal-segment.hpp"
+
+using namespace std;
+using namespace cv;
+
+
+// seed accumulator columns, band sums follow
+enum { SEED_CNT = 0, SEED_X, SEED_Y, SEED_MINX, SEED_MINY,
+       SEED_MAXX, SEED_MAXY, SEED_COUNT };
+
+// seed center columns, band means follow
+enum { CENTER_X = 0, CENTER_Y, CENTER_SCALE, CENTER_COUNT };
+
+// band values of one row as float
+template< typename T >
+static void RowValues( const cv::Mat& band, const int y, const int stride, float *values )
+{
+  const int cn = band.channels();
+  const T *pixel = band.ptr<T>(y);
+  for ( int x = 0; x < band.cols; x++ )
+    for ( int c = 0; c < cn; c++ )
+      values[x * stride + c] = (float) pixel[x * cn + c];
+}
+
+// all band values of one row, pixel interleaved
+static void LoadRow( const std::vector< cv::Mat >& raster, const int y,
+                     const int stride, float *values )
+{
+  for ( size_t r = 0, b = 0; r < raster.size(); b += raster[r].channels(), r++ )
+  {
+    switch ( raster[r].depth() )
+    {
+      case CV_8U:  RowValues< uchar >( raster[r], y, stride, values + b ); break;
+      case CV_8S:  RowValues< schar >( raster[r], y, stride, values + b ); break;
+      case CV_16U: RowValues< ushort >( raster[r], y, stride, values + b ); break;
+      case CV_16S: RowValues< short >( raster[r], y, stride, values + b ); break;
+      case CV_32S: RowValues< int >( raster[r], y, stride, values + b ); break;
+      case CV_32F: RowValues< float >( raster[r], y, stride, values + b ); break;
+      case CV_64F: RowValues< double >( raster[r], y, stride, values + b ); break;
+      default:
+        CV_Error( Error::StsInternal, "\nERROR: Invalid raster depth" );
+        break;
+    }
+  }
+}
+
+// per seed pixel count, moments, bbox and band sums
+static void Accumulate( const std::vector< cv::Mat >& raster, const cv::Mat& klabels,
+                        const int nbands, const int nseeds, std::vector< double >& acc )
+{
+  const int stride = SEED_COUNT + nbands;
+  const int cols = klabels.cols;
+
+  acc.assign( (size_t) nseeds * stride, 0.0f );
+  for ( int k = 0; k < nseeds; k++ )
+  {
+    acc[k * stride + SEED_MINX] = DBL_MAX;
+    acc[k * stride + SEED_MINY] = DBL_MAX;
+    acc[k * stride + SEED_MAXX] = -1.0f;
+    acc[k * stride + SEED_MAXY] = -1.0f;
+  }
+
+  // per thread label windows
+  std::vector< STRIPE > stripes;
+  LabelStripes( klabels, stripes );
+  const int nstripes = (int) stripes.size();
+  std::vector< std::vector< double > > local( nstripes );
+
+  #pragma omp parallel for schedule(static)
+  for ( int s = 0; s < nstripes; s++ )
+  {
+    const STRIPE& stripe = stripes[s];
+    if ( stripe.hi < stripe.lo ) continue;
+    std::vector< double >& sum = local[s];
+    sum.assign( (size_t) ( stripe.hi - stripe.lo + 1 ) * stride, 0.0f );
+    for ( size_t w = 0; w < sum.size(); w += stride )
+    {
+      sum[w + SEED_MINX] = DBL_MAX; sum[w + SEED_MINY] = DBL_MAX;
+      sum[w + SEED_MAXX] = -1.0f;   sum[w + SEED_MAXY] = -1.0f;
+    }
+    std::vector< float > values( (size_t) cols * nbands );
+    for ( int y = stripe.y0; y < stripe.y1; y++ )
+    {
+      const int *label = klabels.ptr<int>(y);
+      LoadRow( raster, y, nbands, &values[0] );
+      for ( int x = 0; x < cols; x++ )
+      {
+        if ( label[x] < 0 ) continue;
+        double *a = &sum[ (size_t) ( label[x] - stripe.lo ) * stride ];
+        a[SEED_CNT] += 1.0f;
+        a[SEED_X] += x; a[SEED_Y] += y;
+        a[SEED_MINX] = std::min( a[SEED_MINX], (double) x );
+        a[SEED_MINY] = std::min( a[SEED_MINY], (double) y );
+        a[SEED_MAXX] = std::max( a[SEED_MAXX], (double) x );
+        a[SEED_MAXY] = std::max( a[SEED_MAXY], (double) y );
+        const float *v = &values[x * nbands];
+        for ( int b = 0; b < nbands; b++ )
+          a[SEED_COUNT + b] += v[b];
+      }
+    }
+  }
+
+  // merge stripe windows
+  for ( int s = 0; s < nstripes; s++ )
+  {
+    if ( stripes[s].hi < stripes[s].lo ) continue;
+    const int lo = stripes[s].lo;
+    const int nwin = std::min( stripes[s].hi, nseeds - 1 ) - lo + 1;
+    #pragma omp parallel for schedule(static)
+    for ( int w = 0; w < nwin; w++ )
+    {
+      const double *l = &local[s][ (size_t) w * stride ];
+      double *a = &acc[ (size_t) ( lo + w ) * stride ];
+      a[SEED_MINX] = std::min( a[SEED_MINX], l[SEED_MINX] );
+      a[SEED_MINY] = std::min( a[SEED_MINY], l[SEED_MINY] );
+      a[SEED_MAXX] = std::max( a[SEED_MAXX], l[SEED_MAXX] );
+      a[SEED_MAXY] = std::max( a[SEED_MAXY], l[SEED_MAXY] );
+      a[SEED_CNT] += l[SEED_CNT];
+      a[SEED_X] += l[SEED_X];
+      a[SEED_Y] += l[SEED_Y];
+      for ( int b = 0; b < nbands; b++ )
+        a[SEED_COUNT + b] += l[SEED_COUNT + b];
+    }
+  }
+}
+
+// centers and search windows from accumulators
+static void UpdateCenters( const std::vector< double >& acc, const int nbands,
+                           const int nseeds, const int step,
+                           std::vector< float >& centers, std::vector< int >& boxes )
+{
+  const int stride = SEED_COUNT + nbands;
+  const int cstride = CENTER_COUNT + nbands;
+  centers.assign( (size_t) nseeds * cstride, 0.0f );
+  boxes.assign( (size_t) nseeds * 4, -1 );
+
+  #pragma omp parallel for schedule(static)
+  for ( int k = 0; k < nseeds; k++ )
+  {
+    const double *a = &acc[ (size_t) k * stride ];
+    // seed lost all pixels
+    if ( a[SEED_CNT] == 0.0f ) continue;
+    float *c = &centers[ (size_t) k * cstride ];
+    c[CENTER_X] = (float) ( a[SEED_X] / a[SEED_CNT] );
+    c[CENTER_Y] = (float) ( a[SEED_Y] / a[SEED_CNT] );
+    // large persisting objects keep their extent
+    c[CENTER_SCALE] = (float) std::max( (double) step, sqrt( a[SEED_CNT] ) );
+    for ( int b = 0; b < nbands; b++ )
+      c[CENTER_COUNT + b] = (float) ( a[SEED_COUNT + b] / a[SEED_CNT] );
+    int *box = &boxes[ (size_t) k * 4 ];
+    box[0] = (int) a[SEED_MINX] - step;
+    box[1] = (int) a[SEED_MINY] - step;
+    box[2] = (int) a[SEED_MAXX] + step;
+    box[3] = (int) a[SEED_MAXY] + step;
+  }
+}
+
+void SeededSegment( const std::vector< cv::Mat > raster, const cv::Mat mask,
+                    const cv::Mat initlabels, const int regionsize, const int niter,
+                    const double compactness, cv::Mat& klabels,
+                    std::vector< int >& ids, size_t& m_labels )
+{
+  const int cols = raster[0].cols;
+  const int rows = raster[0].rows;
+  const int step = std::max( 1, regionsize );
+  const float ruler = (float) ( compactness * compactness );
+
+  int nbands = 0;
+  for ( size_t r = 0; r < raster.size(); r++ )
+    nbands += raster[r].channels();
+
+  CV_Assert( initlabels.type() == CV_32S );
+  CV_Assert( ( initlabels.rows == rows ) && ( initlabels.cols == cols ) );
+
+  printf ("Seeded superpixels (region = %i, niter = %i)\n", regionsize, niter);
+  printf ("       ");
+
+  klabels.create( rows, cols, CV_32S );
+
+  // previous ids to seeds in raster scan order
+  ids.clear();
+  int maxid = -1;
+  std::unordered_map< int, int > seedof;
+  for ( int y = 0; y < rows; y++ )
+  {
+    const int *prev = initlabels.ptr<int>(y);
+    const uchar *valid = mask.empty() ? NULL : mask.ptr<uchar>(y);
+    int *label = klabels.ptr<int>(y);
+    for ( int x = 0; x < cols; x++ )
+    {
+      label[x] = -1;
+      if ( ( prev[x] < 0 ) || ( valid && !valid[x] ) ) continue;
+      std::unordered_map< int, int >::iterator it = seedof.find( prev[x] );
+      if ( it == seedof.end() )
+      {
+        it = seedof.insert( std::make_pair( prev[x], (int) ids.size() ) ).first;
+        ids.push_back( prev[x] );
+        maxid = std::max( maxid, prev[x] );
+      }
+      label[x] = it->second;
+    }
+  }
+  const int nprev = (int) ids.size();
+  seedof.clear();
+
+  // grid seeds where no previous object covers
+  for ( int y = step / 2; y < rows; y += step )
+  {
+    const uchar *valid = mask.empty() ? NULL : mask.ptr<uchar>(y);
+    int *label = klabels.ptr<int>(y);
+    for ( int x = step / 2; x < cols; x += step )
+    {
+      if ( ( label[x] >= 0 ) || ( valid && !valid[x] ) ) continue;
+      label[x] = (int) ids.size();
+      ids.push_back( ++maxid );
+    }
+  }
+  const int nseeds = (int) ids.size();
+  printf ("%i persisting, %i new seeds\n", nprev, nseeds - nprev);
+  printf ("       ");
+
+  // pixels out of any window get a catch-all label
+  const int orphan = nseeds;
+  ids.push_back( ++maxid );
+
+  std::vector< double > acc;
+  std::vector< float > centers;
+  std::vector< int > boxes;
+  Accumulate( raster, klabels, nbands, nseeds, acc );
+  UpdateCenters( acc, nbands, nseeds, step, centers, boxes );
+
+  // seed buckets on a coarse grid
+  const int gcols = ( cols + step - 1 ) / step;
+  const int grows = ( rows + step - 1 ) / step;
+  const int cstride = CENTER_COUNT + nbands;
+
+  for ( int it = 0; it < niter; it++ )
+  {
+    std::vector< std::vector< int > > buckets( (size_t) gcols * grows );
+    for ( int k = 0; k < nseeds; k++ )
+    {
+      const int *box = &boxes[ (size_t) k * 4 ];
+      if ( box[2] < 0 ) continue;
+      const int gx0 = std::max( 0, box[0] / step ), gx1 = std::min( gcols - 1, box[2] / step );
+      const int gy0 = std::max( 0, box[1] / step ), gy1 = std::min( grows - 1, box[3] / step );
+      for ( int gy = gy0; gy <= gy1; gy++ )
+        for ( int gx = gx0; gx <= gx1; gx++ )
+          buckets[ (size_t) gy * gcols + gx ].push_back( k );
+    }
+
+    // nearest center by spectral and scaled spatial distance
+    #pragma omp parallel
+    {
+      std::vector< float > values( (size_t) cols * nbands );
+      #pragma omp for schedule(static)
+      for ( int y = 0; y < rows; y++ )
+      {
+        const uchar *valid = mask.empty() ? NULL : mask.ptr<uchar>(y);
+        int *label = klabels.ptr<int>(y);
+        LoadRow( raster, y, nbands, &values[0] );
+        for ( int x = 0; x < cols; x++ )
+        {
+          if ( valid && !valid[x] ) { label[x] = -1; continue; }
+          const std::vector< int >& bucket = buckets[ (size_t) ( y / step ) * gcols + x / step ];
+          const float *v = &values[x * nbands];
+          int best = orphan;
+          float bestd = FLT_MAX;
+          for ( size_t n = 0; n < bucket.size(); n++ )
+          {
+            const int k = bucket[n];
+            const int *box = &boxes[ (size_t) k * 4 ];
+            if ( ( x < box[0] ) || ( x > box[2] ) || ( y < box[1] ) || ( y > box[3] ) )
+              continue;
+            const float *c = &centers[ (size_t) k * cstride ];
+            const float dx = x - c[CENTER_X];
+            const float dy = y - c[CENTER_Y];
+            float d = ( dx * dx + dy * dy ) * ruler / ( c[CENTER_SCALE] * c[CENTER_SCALE] );
+            for ( int b = 0; b < nbands && d < bestd; b++ )
+            {
+              const float diff = v[b] - c[CENTER_COUNT + b];
+              d += diff * diff;
+            }
+            if ( d < bestd )
+            {
+              bestd = d;
+              best = k;
+            }
+          }
+          label[x] = best;
+        }
+      }
+    }
+
+    Accumulate( raster, klabels, nbands, nseeds, acc );
+    UpdateCenters( acc, nbands, nseeds, step, centers, boxes );
+    GDALTermProgress( (float)(it + 1) / (float)niter, NULL, NULL );
+  }
+  GDALTermProgress( 1.0f, NULL, NULL );
+
+  m_labels = ids.size();
+}
+
+// mean band deviation of pixel count, band sums and squares
+static double CellDeviation( const double *cell, const int nbands )
+{
+  if ( cell[0] == 0.0f ) return 0.0f;
+  double dev = 0.0f;
+  for ( int b = 0; b < nbands; b++ )
+  {
+    const double mean = cell[1 + b] / cell[0];
+    dev += sqrt( std::max( 0.0, cell[1 + nbands + b] / cell[0] - mean * mean ) );
+  }
+  return dev / nbands;
+}
+
+void AdaptiveSeeds( const std::vector< cv::Mat > raster, const cv::Mat mask,
+                    const int minregion, const int maxregion, cv::Mat& seeds )
+{
+  const int cols = raster[0].cols;
+  const int rows = raster[0].rows;
+  const int step = std::max( 1, minregion );
+
+  int nbands = 0;
+  for ( size_t r = 0; r < raster.size(); r++ )
+    nbands += raster[r].channels();
+
+  // cells double in size up to the max region, shifts stay in range
+  int levels = 0;
+  while ( ( levels < 30 ) && ( step <= ( maxregion >> ( levels + 1 ) ) ) ) levels++;
+
+  printf ("Adaptive seeds (region = %i..%i)\n", step, step << levels);
+  printf ("       ");
+
+  // pixel count, band sums and squares per block of min region
+  const int cstride = 1 + 2 * nbands;
+  std::vector< int > gcols( levels + 1 ), grows( levels + 1 );
+  gcols[0] = ( cols + step - 1 ) / step;
+  grows[0] = ( rows + step - 1 ) / step;
+  std::vector< std::vector< double > > pyramid( levels + 1 );
+  pyramid[0].assign( (size_t) gcols[0] * grows[0] * cstride, 0.0f );
+
+  #pragma omp parallel
+  {
+    std::vector< float > values( (size_t) cols * nbands );
+    #pragma omp for schedule(static)
+    for ( int gy = 0; gy < grows[0]; gy++ )
+    {
+      double *line = &pyramid[0][ (size_t) gy * gcols[0] * cstride ];
+      for ( int y = gy * step; y < std::min( rows, ( gy + 1 ) * step ); y++ )
+      {
+        const uchar *valid = mask.empty() ? NULL : mask.ptr<uchar>(y);
+        LoadRow( raster, y, nbands, &values[0] );
+        for ( int x = 0; x < cols; x++ )
+        {
+          if ( valid && !valid[x] ) continue;
+          double *cell = &line[ (size_t) ( x / step ) * cstride ];
+          const float *v = &values[ (size_t) x * nbands ];
+          cell[0] += 1.0f;
+          for ( int b = 0; b < nbands; b++ )
+          {
+            cell[1 + b] += v[b];
+            cell[1 + nbands + b] += (double) v[b] * v[b];
+          }
+        }
+      }
+    }
+  }
+
+  // coarser levels sum 2x2 cells
+  for ( int l = 1; l <= levels; l++ )
+  {
+    gcols[l] = ( gcols[l - 1] + 1 ) / 2;
+    grows[l] = ( grows[l - 1] + 1 ) / 2;
+    pyramid[l].assign( (size_t) gcols[l] * grows[l] * cstride, 0.0f );
+    #pragma omp parallel for schedule(static)
+    for ( int gy = 0; gy < grows[l]; gy++ )
+      for ( int gx = 0; gx < gcols[l]; gx++ )
+      {
+        double *cell = &pyramid[l][ ( (size_t) gy * gcols[l] + gx ) * cstride ];
+        for ( int c = 0; c < 4; c++ )
+        {
+          const int cx = 2 * gx + ( c & 1 ), cy = 2 * gy + ( c >> 1 );
+          if ( ( cx >= gcols[l - 1] ) || ( cy >= grows[l - 1] ) ) continue;
+          const double *child = &pyramid[l - 1][ ( (size_t) cy * gcols[l - 1] + cx ) * cstride ];
+          for ( int i = 0; i < cstride; i++ )
+            cell[i] += child[i];
+        }
+      }
+  }
+
+  // typical block texture splits cells
+  std::vector< double > devs;
+  devs.reserve( (size_t) gcols[0] * grows[0] );
+  for ( size_t i = 0; i < pyramid[0].size(); i += cstride )
+    if ( pyramid[0][i] > 0.0f )
+      devs.push_back( CellDeviation( &pyramid[0][i], nbands ) );
+  double threshold = 0.0f;
+  if ( devs.size() > 0 )
+  {
+    std::nth_element( devs.begin(), devs.begin() + devs.size() / 2, devs.end() );
+    threshold = devs[ devs.size() / 2 ];
+  }
+
+  // split from the coarsest cells down, uniform cells stay
+  std::vector< cv::Vec3i > cells, stack;
+  for ( int gy = grows[levels] - 1; gy >= 0; gy-- )
+    for ( int gx = gcols[levels] - 1; gx >= 0; gx-- )
+      stack.push_back( cv::Vec3i( gx, gy, levels ) );
+  while ( stack.size() > 0 )
+  {
+    const cv::Vec3i c = stack.back();
+    stack.pop_back();
+    const int l = c[2];
+    const double *cell = &pyramid[l][ ( (size_t) c[1] * gcols[l] + c[0] ) * cstride ];
+    if ( cell[0] == 0.0f ) continue;
+    if ( ( l == 0 ) || ( CellDeviation( cell, nbands ) <= threshold ) )
+    {
+      cells.push_back( c );
+      continue;
+    }
+    for ( int q = 3; q >= 0; q-- )
+    {
+      const int cx = 2 * c[0] + ( q & 1 ), cy = 2 * c[1] + ( q >> 1 );
+      if ( ( cx < gcols[l - 1] ) && ( cy < grows[l - 1] ) )
+        stack.push_back( cv::Vec3i( cx, cy, l - 1 ) );
+    }
+  }
+  pyramid.clear();
+
+  // cells become the initial labels of the seeded engine
+  seeds.create( rows, cols, CV_32S );
+  seeds = Scalar::all( -1 );
+  #pragma omp parallel for schedule(dynamic, 256)
+  for ( int n = 0; n < (int) cells.size(); n++ )
+  {
+    const int size = step << cells[n][2];
+    const int x0 = cells[n][0] * size, y0 = cells[n][1] * size;
+    const int x1 = std::min( cols, x0 + size ), y1 = std::min( rows, y0 + size );
+    for ( int y = y0; y < y1; y++ )
+    {
+      const uchar *valid = mask.empty() ? NULL : mask.ptr<uchar>(y);
+      int *label = seeds.ptr<int>(y);
+      for ( int x = x0; x < x1; x++ )
+        if ( !valid || valid[x] ) label[x] = n;
+    }
+  }
+  GDALTermProgress( 1.0f, NULL, NULL );
+
+  printf ("       %lu cells, %.1f%% of fixed grid\n", cells.size(),
+          100.0f * cells.size() / std::max( 1.0, (double) gcols[0] * grows[0] ));
+}
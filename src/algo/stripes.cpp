@@ -0,0 +1,101 @@
+/*
+ *  Copyright (c) 2015  Balint Cristian (cristian.balint@gmail.com)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+/* stripes.cpp */
+/* Label stripes */
+
+#include <omp.h>
+#include <climits>
+#include <algorithm>
+
+#include <opencv2/opencv.hpp>
+
+#include "gdal-segment.hpp"
+
+using namespace std;
+using namespace cv;
+
+
+void LabelStripes( const cv::Mat klabels, std::vector< STRIPE >& stripes )
+{
+  const int rows = klabels.rows;
+  const int cols = klabels.cols;
+
+  // one stripe per thread
+  const int nstripes = std::max( 1, std::min( rows, omp_get_max_threads() ) );
+  const int srows = ( rows + nstripes - 1 ) / nstripes;
+
+  stripes.resize( nstripes );
+
+  #pragma omp parallel for schedule(static)
+  for ( int s = 0; s < nstripes; s++ )
+  {
+    STRIPE& stripe = stripes[s];
+    stripe.y0 = std::min( rows, s * srows );
+    stripe.y1 = std::min( rows, stripe.y0 + srows );
+
+    // labels seen by stripe rows and their halo
+    int lo = INT_MAX, hi = -1;
+    const int h0 = std::max( 0, stripe.y0 - 1 );
+    const int h1 = std::min( rows, stripe.y1 + 1 );
+    for ( int y = h0; y < h1; y++ )
+    {
+      const int *row = klabels.ptr<int>(y);
+      for ( int x = 0; x < cols; x++ )
+      {
+        if ( row[x] < 0 ) continue;
+        lo = std::min( lo, row[x] );
+        hi = std::max( hi, row[x] );
+      }
+    }
+    if ( hi < 0 ) lo = 0;
+    stripe.lo = lo;
+    stripe.hi = hi;
+  }
+}
+
+void RunStripes( const LABELRUNS& runs, std::vector< STRIPE >& stripes )
+{
+  const int rows = runs.rows;
+
+  // same split as for dense labels
+  const int nstripes = std::max( 1, std::min( rows, omp_get_max_threads() ) );
+  const int srows = ( rows + nstripes - 1 ) / nstripes;
+
+  stripes.resize( nstripes );
+
+  #pragma omp parallel for schedule(static)
+  for ( int s = 0; s < nstripes; s++ )
+  {
+    STRIPE& stripe = stripes[s];
+    stripe.y0 = std::min( rows, s * srows );
+    stripe.y1 = std::min( rows, stripe.y0 + srows );
+
+    // labels seen by stripe rows and their halo
+    int lo = INT_MAX, hi = -1;
+    const int h0 = std::max( 0, stripe.y0 - 1 );
+    const int h1 = std::min( rows, stripe.y1 + 1 );
+    for ( size_t i = runs.offset[h0]; i < runs.offset[h1]; i++ )
+    {
+      const int k = runs.runs[i].label;
+      if ( k < 0 ) continue;
+      lo = std::min( lo, k );
+      hi = std::max( hi, k );
+    }
+    if ( hi < 0 ) lo = 0;
+    stripe.lo = lo;
+    stripe.hi = hi;
+  }
+}
@@ -0,0 +1,163 @@
+/*
+ *  Copyright (c) 2015  Balint Cristian (cristian.balint@gmail.com)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+/* superpixels.cpp */
+/* Superpixel engines */
+
+#include "gdal.h"
+#include "cpl_string.h"
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/ximgproc.hpp>
+
+#include "gdal-segment.hpp"
+
+using namespace std;
+using namespace cv;
+using namespace cv::ximgproc;
+
+
+void GrowSuperpixels( const std::vector< cv::Mat > raster, const cv::Mat mask,
+                      const char *algo, const int regionsize, const int niter,
+                      const double scale, const cv::Mat initlabels,
+                      cv::Mat& klabels, std::vector< int >& ids, size_t& m_labels )
+{
+  // warm start replaces SLIC, callers reject the other engines
+  const bool seeded = !initlabels.empty();
+
+  /*
+   * init segments
+   */
+
+  printf( "Init Superpixels (%s region=%i niter=%i)\n", algo, regionsize, niter );
+  Ptr<SuperpixelSLIC> slic;
+  Ptr<SuperpixelSEEDS> seed;
+  Ptr<SuperpixelLSC> lsc;
+
+  // interleaved layout is one multichannel matrix
+  size_t m_bands = 0;
+  for ( size_t r = 0; r < raster.size(); r++ )
+    m_bands += raster[r].channels();
+  const cv::_InputArray image = ( raster.size() == 1 ) ? cv::_InputArray( raster[0] )
+                                                        : cv::_InputArray( raster );
+
+  if ( seeded )
+  {
+    // seeds come from previous labels
+  }
+  else if ( EQUAL ( algo, "SLIC" ) )
+    slic = createSuperpixelSLIC( image, SLIC, regionsize, 10.0f );
+  else if ( EQUAL( algo, "SLICO" ) )
+    slic = createSuperpixelSLIC( image, SLICO, regionsize, 10.0f );
+  else if ( EQUAL( algo, "MSLIC" ) )
+    slic = createSuperpixelSLIC( image, MSLIC, regionsize, 10.0f );
+  else if ( EQUAL( algo, "LSC" ) )
+    lsc = createSuperpixelLSC( image, regionsize, 0.075f );
+  else if ( EQUAL( algo, "SEEDS" ) )
+  {
+    // only few datatype is supported
+    if ( ( raster[0].depth() != CV_8U )
+       &&( m_bands != 3 ) )
+    {
+      printf( "\nERROR: Input datatype is not supported by SEED. Use RGB or Gray with Byte types.\n" );
+      exit( 1 );
+    }
+
+    int clusters = int(((float)raster[0].cols / (float)regionsize)
+                     * ((float)raster[0].rows / (float)regionsize));
+    seed = createSuperpixelSEEDS( raster[0].cols, raster[0].rows, m_bands, clusters, 1, 2, 5, true );
+  }
+  else if ( EQUAL( algo, "FH" ) )
+  {
+    // graph is built while growing
+  }
+  else
+  {
+    printf( "\nERROR: No such algorithm: [%s].\n", algo );
+    exit( 1 );
+  }
+
+  m_labels = 0;
+  if ( seeded )
+  {
+    // count known after seeding
+  }
+  else if ( EQUAL( algo, "SLIC" )
+    || EQUAL( algo, "SLICO" )
+    || EQUAL( algo, "MSLIC" ) )
+    m_labels = slic->getNumberOfSuperpixels();
+  else if ( EQUAL( algo, "SEEDS" ) )
+    m_labels = seed->getNumberOfSuperpixels();
+  else if ( EQUAL( algo, "LSC" ) )
+    m_labels = lsc->getNumberOfSuperpixels();
+
+  printf( "Grow Superpixels: #%i iterations\n", niter );
+  printf( "           inits: %lu superpixels\n", m_labels );
+
+  /*
+   * start compute segments
+   */
+
+  ids.clear();
+  if ( seeded )
+    SeededSegment( raster, mask, initlabels, regionsize, niter, 10.0f,
+                   klabels, ids, m_labels );
+  else if ( EQUAL( algo, "SLIC" )
+    || EQUAL( algo, "SLICO" )
+    || EQUAL( algo, "MSLIC" ) )
+    slic->iterate( niter );
+  else if ( EQUAL( algo, "FH" ) )
+    FelzenszwalbSegment( raster, mask, scale, klabels, m_labels );
+  else if ( EQUAL( algo, "LSC" ) )
+    lsc->iterate( niter );
+  else if ( EQUAL( algo, "SEEDS" ) )
+  {
+    // interleaved layout needs no merge copy
+    if ( raster.size() == 1 )
+      seed->iterate( raster[0], niter );
+    else
+    {
+      cv::Mat whole;
+      cv::merge(raster,whole);
+      seed->iterate( whole, niter );
+    }
+  }
+
+  if ( seeded )
+  {
+    // labels and count already set
+  }
+  else if( EQUAL( algo, "SLIC" )
+   || EQUAL( algo, "SLICO" )
+   || EQUAL( algo, "MSLIC" ) )
+  {
+    m_labels = slic->getNumberOfSuperpixels();
+    slic->getLabels( klabels );
+  }
+  else if ( EQUAL( algo, "SEEDS" ) )
+  {
+    m_labels = seed->getNumberOfSuperpixels();
+    seed->getLabels( klabels );
+  }
+  else if ( EQUAL( algo, "LSC" ) )
+  {
+    m_labels = lsc->getNumberOfSuperpixels();
+    lsc->getLabels( klabels );
+  }
+
+  // invalid pixels belong to no segment
+  if ( !mask.empty() )
+    klabels.setTo( -1, mask == 0 );
+}
@@ -47,49 +47,492 @@
 #include "ogrsf_frmts.h"
 #include "cpl_string.h"
 #include "cpl_csv.h"
+#include "cpl_vsi.h"
 
 #include "gdal-segment.hpp"
 
 #include <opencv2/core/core.hpp>
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
-#include <opencv2/ximgproc.hpp>
-#include <opencv2/hdf/hdf5.hpp>
 
 using namespace std;
 using namespace cv;
-using namespace cv::ximgproc;
 
 
+// per run stage timers
+enum { STAGE_GROW = 0, STAGE_MERGE, STAGE_CONTOUR, STAGE_STATS, STAGE_SAVE, STAGE_COUNT };
+
+// boundary output as shared arcs
+enum { TOPO_NONE = 0, TOPO_LINES, TOPO_POLYGONS };
+
+// loaded data shared by all runs
+typedef struct SEGINPUT {
+  const std::vector< cv::Mat > *raster;
+  const std::vector< cv::Mat > *original;
+  cv::Mat mask;
+  cv::Mat initlabels;
+  GEOREF georef;
+  const char *OutFormat;
+  bool statsonly;
+  int h5compress;
+  bool h5labels;
+  bool enforce;
+  bool neighbours;
+  int topology;
+  int adaptive;
+  double scale;
+  VECTOROPTS vopts;
+  std::vector< std::string > StatFilenames;
+  const char *StatResample;
+  double window;
+  bool check;
+  bool store;
+} SEGINPUT;
+
+// one segmentation run
+typedef struct SEGJOB {
+  std::string algo;
+  int regionsize;
+  int niter;
+  std::string output;
+  std::string h5stat;
+  std::string store;
+  size_t labels;
+  double times[STAGE_COUNT];
+  unsigned long long digest;  // label raster fingerprint
+  double statsum;             // band totals over all labels
+} SEGJOB;
+
+// one thread budget for openmp, opencv and gdal driver pools
+static void SetThreads( const int threads )
+{
+  omp_set_num_threads( threads );
+  cv::setNumThreads( threads );
+  // readers divide cores by driver threads, only cap a greedy setting
+  const char *gdalthreads = CPLGetConfigOption( "GDAL_NUM_THREADS", NULL );
+  if ( gdalthreads && ( EQUAL( gdalthreads, "ALL_CPUS" ) || atoi( gdalthreads ) > threads ) )
+    CPLSetConfigOption( "GDAL_NUM_THREADS", CPLSPrintf( "%i", threads ) );
+}
 
-int main(int argc, char ** argv)
+// algorithm defaults, false if unknown
+static bool AlgoDefaults( const char *algo, int& niter, int& regionsize )
+{
+  if ( EQUAL( algo, "SLIC"  )
+    || EQUAL( algo, "SLICO" )
+    || EQUAL( algo, "MSLIC" ) )
+  {
+    if (!niter) niter = 10;
+  }
+  else if ( EQUAL( algo, "SEEDS" )
+         || EQUAL( algo, "LSC" ) )
+  {
+    if (!niter) niter = 20;
+  }
+  else if ( EQUAL( algo, "FH" ) )
+  {
+    // no iterations, region sets minimum size
+  }
+  else
+    return false;
+
+  if (!regionsize) regionsize = 10;
+  return true;
+}
+
+// parse "ALGO:r1,r2;ALGO:r" into runs
+static bool ParseSweep( const char *spec, const int niter, std::vector< SEGJOB >& jobs )
+{
+  char **groups = CSLTokenizeString2( spec, ";", 0 );
+  bool valid = ( CSLCount( groups ) > 0 );
+  for ( int g = 0; valid && groups[g] != NULL; g++ )
+  {
+    char **parts = CSLTokenizeString2( groups[g], ":", 0 );
+    if ( CSLCount( parts ) != 2 )
+    {
+      printf( "\nERROR: Invalid sweep entry: %s\n", groups[g] );
+      valid = false;
+    }
+    char **regions = valid ? CSLTokenizeString2( parts[1], ",", 0 ) : NULL;
+    for ( int r = 0; valid && regions[r] != NULL; r++ )
+    {
+      SEGJOB job;
+      job.algo = parts[0];
+      job.niter = niter;
+      job.regionsize = atoi( regions[r] );
+      job.labels = 0;
+      if ( ( job.regionsize <= 0 ) || !AlgoDefaults( parts[0], job.niter, job.regionsize ) )
+      {
+        printf( "\nERROR: Invalid sweep entry: %s\n", groups[g] );
+        valid = false;
+      }
+      else
+        jobs.push_back( job );
+    }
+    CSLDestroy( regions );
+    CSLDestroy( parts );
+  }
+  CSLDestroy( groups );
+  return valid;
+}
+
+// output name of one sweep run
+static std::string SweepName( const char *filename, const SEGJOB& job )
+{
+  const std::string base = CPLSPrintf( "%s_%s_%i", CPLGetBasename( filename ),
+                                       job.algo.c_str(), job.regionsize );
+  return CPLFormFilename( CPLGetPath( filename ), base.c_str(), CPLGetExtension( filename ) );
+}
+
+// fnv-1a over the label raster
+static unsigned long long LabelDigest( const cv::Mat klabels )
+{
+  unsigned long long hash = 14695981039346656037ULL;
+  for ( int y = 0; y < klabels.rows; y++ )
+  {
+    const unsigned char *p = klabels.ptr<unsigned char>(y);
+    const size_t n = klabels.cols * klabels.elemSize();
+    for ( size_t i = 0; i < n; i++ )
+    {
+      hash ^= p[i];
+      hash *= 1099511628211ULL;
+    }
+  }
+  return hash;
+}
+
+// compare runs with a baseline csv, written when missing
+static int CheckRuns( const char *CheckFilename, const std::vector< SEGJOB >& jobs,
+                      const double slack )
+{
+  VSIStatBufL sStat;
+  if ( VSIStatL( CheckFilename, &sStat ) != 0 )
+  {
+    FILE *csv = fopen( CheckFilename, "w" );
+    if ( !csv )
+    {
+      printf( "\nERROR: Cannot write %s\n", CheckFilename );
+      return 1;
+    }
+    fprintf( csv, "algo,region,niter,segments,digest,statsum,grow,merge,contour,stats,save\n" );
+    for ( size_t j = 0; j < jobs.size(); j++ )
+    {
+      const SEGJOB& job = jobs[j];
+      fprintf( csv, "%s,%i,%i,%lu,%016llx,%.17g,%.6f,%.6f,%.6f,%.6f,%.6f\n",
+               job.algo.c_str(), job.regionsize, job.niter, job.labels,
+               job.digest, job.statsum,
+               job.times[STAGE_GROW], job.times[STAGE_MERGE], job.times[STAGE_CONTOUR],
+               job.times[STAGE_STATS], job.times[STAGE_SAVE] );
+    }
+    fclose( csv );
+    printf( "Baseline written to %s\n\n", CheckFilename );
+    return 0;
+  }
+
+  VSILFILE *fp = VSIFOpenL( CheckFilename, "r" );
+  if ( !fp )
+  {
+    printf( "\nERROR: Cannot read %s\n", CheckFilename );
+    return 1;
+  }
+  if ( slack >= 0.0f )
+    printf( "Check against %s (slack %.0f%%)\n", CheckFilename, slack );
+  else
+    printf( "Check against %s (timings not checked)\n", CheckFilename );
+  printf( "  %-6s %6s %5s %10s %6s %10s %10s\n",
+          "algo", "region", "niter", "segments", "output", "baseline", "time" );
+
+  int failures = 0;
+  std::vector< char > found( jobs.size(), 0 );
+  // skip header
+  const char *line = CPLReadLineL( fp );
+  while ( line && ( ( line = CPLReadLineL( fp ) ) != NULL ) )
+  {
+    char **fields = CSLTokenizeString2( line, ",", 0 );
+    if ( CSLCount( fields ) < 6 + STAGE_COUNT )
+    {
+      CSLDestroy( fields );
+      continue;
+    }
+    for ( size_t j = 0; j < jobs.size(); j++ )
+    {
+      const SEGJOB& job = jobs[j];
+      if ( !EQUAL( job.algo.c_str(), fields[0] )
+        || ( job.regionsize != atoi( fields[1] ) )
+        || ( job.niter != atoi( fields[2] ) ) ) continue;
+      found[j] = 1;
+
+      // labels must match exactly, totals up to summation order
+      const double statsum = CPLAtof( fields[5] );
+      const bool same = ( job.labels == strtoul( fields[3], NULL, 10 ) )
+                     && ( job.digest == strtoull( fields[4], NULL, 16 ) )
+                     && ( fabs( job.statsum - statsum ) <= 1e-9 * std::max( 1.0, fabs( statsum ) ) );
+
+      // opt-in, short runs are timer noise
+      double was = 0.0f, now = 0.0f;
+      for ( int t = 0; t < STAGE_COUNT; t++ )
+      {
+        was += CPLAtof( fields[6 + t] );
+        now += job.times[t];
+      }
+      const bool slow = ( slack >= 0.0f )
+                     && ( now > was * ( 1.0f + slack / 100.0f ) ) && ( now - was > 0.05f );
+
+      printf( "  %-6s %6i %5i %10lu %6s %10.3f %10.3f%s\n",
+              job.algo.c_str(), job.regionsize, job.niter, job.labels,
+              same ? "same" : "DIFF", was, now, slow ? " SLOW" : "" );
+      if ( !same || slow ) failures++;
+    }
+    CSLDestroy( fields );
+  }
+  VSIFCloseL( fp );
+
+  for ( size_t j = 0; j < jobs.size(); j++ )
+    if ( !found[j] )
+    {
+      printf( "  %-6s %6i %5i not in baseline\n",
+              jobs[j].algo.c_str(), jobs[j].regionsize, jobs[j].niter );
+      failures++;
+    }
+  printf( "  %i of %lu runs failed\n\n", failures, jobs.size() );
+
+  return failures;
+}
+
+// segment, vectorize and dump stats for one run
+static void RunSegmentation( const SEGINPUT& in, SEGJOB& job )
+{
+  const char *algo = job.algo.c_str();
+  const int regionsize = job.regionsize;
+  const int niter = job.niter;
+  const std::vector< cv::Mat >& raster = *in.raster;
+  // warm start replaces the center based engines
+  const bool warm = !in.initlabels.empty();
+  // adaptive seeding runs the same engine from texture cells
+  const bool seeded = warm || ( in.adaptive > 0 );
+  // tiles trace their own clipped boundaries
+  const bool tiles = EQUAL( in.OutFormat, "MVT" );
+  // shared arcs replace per label contours
+  const bool arcs = ( in.topology != TOPO_NONE ) && !tiles && !in.statsonly;
+  // descriptors and neighbours still need the contour pass
+  const bool contours = ( !tiles && !in.statsonly && !arcs )
+                     || ( in.neighbours && !arcs ) || in.vopts.shapes;
+
+  int64 startTime, endTime;
+  int64 startSecond, endSecond;
+  double frequency = cv::getTickFrequency();
+
+  /*
+   * grow segments
+   */
+
+  // storage
+  cv::Mat klabels;
+  std::vector< int > ids;
+  size_t m_labels = 0;
+
+  startTime = cv::getTickCount();
+  cv::Mat seeds = in.initlabels;
+  if ( in.adaptive > 0 )
+    AdaptiveSeeds( raster, in.mask, regionsize, in.adaptive, seeds );
+  GrowSuperpixels( raster, in.mask, algo, regionsize, niter, in.scale,
+                   seeds, klabels, ids, m_labels );
+  seeds.release();
+  // cell ids carry no meaning
+  if ( !warm ) ids.clear();
+  endTime = cv::getTickCount();
+  job.times[STAGE_GROW] = ( endTime - startTime ) / frequency;
+  printf( "           count: %lu superpixels (growed in %.6f sec)\n",
+          m_labels, job.times[STAGE_GROW] );
+
+  // get smooth labels, graph and seeded labels need compaction
+  job.times[STAGE_MERGE] = 0.0f;
+  if ( ( in.enforce == true ) || EQUAL( algo, "FH" ) || seeded )
+  {
+    startSecond = cv::getTickCount();
+    EnforceConnectivity( klabels, in.enforce ? ( regionsize * regionsize ) / 4 : 0, m_labels,
+                         warm ? &ids : NULL );
+    endSecond = cv::getTickCount();
+    job.times[STAGE_MERGE] = ( endSecond - startSecond ) / frequency;
+    printf( "           final: %lu superpixels (merged in %.6f sec)\n",
+            m_labels, job.times[STAGE_MERGE] );
+  }
+  job.labels = m_labels;
+
+  // run-length labels feed stats and contours
+  startSecond = cv::getTickCount();
+  LABELRUNS runs;
+  EncodeRuns( klabels, runs );
+  endSecond = cv::getTickCount();
+  job.times[STAGE_MERGE] += ( endSecond - startSecond ) / frequency;
+
+  // dense labels only for stages still reading pixels
+  if ( !tiles && !arcs && !in.check && !in.h5labels && !in.store
+    && ( in.StatFilenames.size() == 0 ) )
+    klabels.release();
+  printf( "Time: %.6f sec\n\n", job.times[STAGE_GROW] + job.times[STAGE_MERGE] );
+
+  /*
+   * get segments contour
+   */
+
+  std::vector< std::vector< LINE > > linelists;
+  std::vector< ADJACENCY > adjacency;
+  cv::Mat bboxes;
+  cv::Mat shapes;
+  TOPOLOGY topology;
+
+  job.times[STAGE_CONTOUR] = 0.0f;
+  if ( contours )
+  {
+    linelists.resize( m_labels );
+    startTime = cv::getTickCount();
+    LabelContours( runs, linelists, bboxes, ( in.neighbours && !arcs ) ? &adjacency : NULL,
+                   in.vopts.shapes ? &shapes : NULL );
+    endTime = cv::getTickCount();
+    job.times[STAGE_CONTOUR] = ( endTime - startTime ) / frequency;
+    printf( "Time: %.6f sec\n\n", job.times[STAGE_CONTOUR] );
+  }
+  if ( arcs )
+  {
+    startTime = cv::getTickCount();
+    BuildTopology( klabels, m_labels, in.vopts.dptol, topology,
+                   in.neighbours ? &adjacency : NULL );
+    endTime = cv::getTickCount();
+    job.times[STAGE_CONTOUR] += ( endTime - startTime ) / frequency;
+    printf( "Time: %.6f sec\n\n", ( endTime - startTime ) / frequency );
+  }
+
+  /*
+   * statistics
+   */
+
+  startTime = cv::getTickCount();
+
+  // auxiliary rasters
+  vector< string > zsnames;
+  Mat avgZS, stdZS;
+  if ( in.StatFilenames.size() > 0 )
+    ComputeZonalStats( klabels, in.georef, in.StatFilenames, in.StatResample,
+                       m_labels, zsnames, avgZS, stdZS, in.window );
+
+  // colorspace converted runs report original values
+  const std::vector< cv::Mat >& values = in.original->empty() ? raster : *in.original;
+
+  // superpixels property
+  size_t m_bands = 0;
+  for ( size_t r = 0; r < values.size(); r++ )
+    m_bands += values[r].channels();
+
+  Mat labelpixels(m_labels, 1, CV_32S);
+  Mat avgCH(m_bands, m_labels, CV_64F);
+  Mat stdCH(m_bands, m_labels, CV_64F);
+
+  ComputeStats( runs, values, labelpixels, avgCH, stdCH,
+                in.vopts.shapes ? &shapes : NULL,
+                ( job.h5stat.empty() && !arcs && !in.store ) ? NULL : &bboxes );
+  endTime = cv::getTickCount();
+  job.times[STAGE_STATS] = ( endTime - startTime ) / frequency;
+  printf( "Time: %.6f sec\n\n", job.times[STAGE_STATS] );
+
+  // output fingerprint, outside of timed stages
+  job.digest = 0;
+  job.statsum = 0.0f;
+  if ( in.check )
+  {
+    job.digest = LabelDigest( klabels );
+    for ( int b = 0; b < avgCH.rows; b++ )
+      for ( size_t k = 0; k < m_labels; k++ )
+        job.statsum += avgCH.at<double>(b, k) * labelpixels.at<int>(k);
+  }
+
+
+ /*
+  * dump stats
+  */
+
+  // streamed before any vector output
+  startTime = cv::getTickCount();
+  if ( !job.h5stat.empty() )
+    SaveStats( job.h5stat.c_str(), klabels, labelpixels, ids, avgCH, stdCH,
+               avgZS, stdZS, bboxes, shapes, adjacency,
+               in.h5compress, in.h5labels );
+  if ( in.store )
+    SaveLabelStore( job.store.c_str(), in.georef, klabels, labelpixels, ids,
+                    avgCH, stdCH, bboxes );
+
+
+ /*
+  * dump vector
+  */
+
+  if ( in.statsonly )
+  {
+    // statistics are the product
+  }
+  else if ( tiles )
+    SaveTiles( in.georef, job.output.c_str(), klabels, labelpixels, ids,
+               avgCH, stdCH, zsnames, avgZS, stdZS, in.vopts );
+  else if ( in.topology == TOPO_LINES )
+    SaveArcs( in.georef, job.output.c_str(), in.OutFormat, topology, ids );
+  else
+    SavePolygons( in.georef, job.output.c_str(), in.OutFormat, klabels,
+                  values, labelpixels, ids, avgCH, stdCH,
+                  zsnames, avgZS, stdZS, linelists, bboxes,
+                  shapes, adjacency, in.vopts,
+                  arcs ? &topology : NULL );
+  endTime = cv::getTickCount();
+  job.times[STAGE_SAVE] = ( endTime - startTime ) / frequency;
+  printf( "Time: %.6f sec\n\n", job.times[STAGE_SAVE] );
+}
+
+
+int Segment( int argc, char ** argv )
 {
   const char *algo = "";
   vector< string > InFilenames;
+  vector< string > StatFilenames;
+  const char *StatResample = "bilinear";
+  const char *Resample = "bilinear";
+  double tres = 0.0f;
+  double memlimit = 0.0f;
   const char *OutFilename = NULL;
   const char *OutStatH5name = NULL;
   const char *OutFormat = "ESRI Shapefile";
+  const char *SweepSpec = NULL;
+  const char *InitFilename = NULL;
+  const char *CheckFilename = NULL;
+  const char *StoreFilename = NULL;
+  const char *ExtractMode = NULL;
+  const char *ExtractList = NULL;
+  double slack = -1.0f;
 
   // general defaults
   int niter = 0;
   bool blur = false;
   bool labcol = false;
   bool enforce = true;
+  bool neighbours = false;
+  int topology = TOPO_NONE;
+  int adaptive = 0;
+  bool interleave = false;
+  bool statsonly = false;
+  bool h5labels = false;
+  int h5compress = 4;
+  VECTOROPTS vopts;
+  vopts.stair = false;
+  vopts.dptol = 0.0f;
+  vopts.hilbert = false;
+  vopts.shapes = false;
+  vopts.shards = 1;
   int regionsize = 0;
+  double scale = 300.0f;
 
   // some counters
   int64 startTime, endTime;
-  int64 startSecond, endSecond;
   double frequency = cv::getTickFrequency();
 
-  // register
-  GDALAllRegister();
-  OGRRegisterAll();
-
-  argc = GDALGeneralCmdLineProcessor( argc, &argv, 0 );
-
-  if( argc < 1 )
-    exit( -argc );
+  // parameter sweep runs
+  std::vector< SEGJOB > jobs;
 
   // default help
   bool help = false;
@@ -115,6 +558,10 @@ int main(int argc, char ** argv)
         regionsize = atoi(argv[i+1]);
         i++; continue;
       }
+      if( EQUAL( argv[i],"-scale" ) ) {
+        scale = atof(argv[i+1]);
+        i++; continue;
+      }
       if( EQUAL( argv[i],"-niter" ) ) {
         niter = atoi(argv[i+1]);
         i++; continue;
@@ -127,6 +574,18 @@ int main(int argc, char ** argv)
         OutStatH5name = argv[i+1];
         i++; continue;
       }
+      if( EQUAL( argv[i],"-h5compress" ) ) {
+        h5compress = std::max( 0, std::min( 9, atoi(argv[i+1]) ) );
+        i++; continue;
+      }
+      if( EQUAL( argv[i],"-h5labels" ) ) {
+        h5labels = true;
+        continue;
+      }
+      if( EQUAL( argv[i],"-statsonly" ) ) {
+        statsonly = true;
+        continue;
+      }
       if( EQUAL( argv[i],"-of" ) ) {
         OutFormat = argv[i+1];
         i++; continue;
@@ -139,6 +598,107 @@ int main(int argc, char ** argv)
         labcol = true;
         continue;
       }
+      if( EQUAL( argv[i],"-adjacency" ) ) {
+        neighbours = true;
+        continue;
+      }
+      if( EQUAL( argv[i],"-topology" ) ) {
+        if( EQUAL( argv[i+1],"lines" ) )
+          topology = TOPO_LINES;
+        else if( EQUAL( argv[i+1],"polygons" ) )
+          topology = TOPO_POLYGONS;
+        else
+          help = true;
+        i++; continue;
+      }
+      if( EQUAL( argv[i],"-stair" ) ) {
+        vopts.stair = true;
+        continue;
+      }
+      if( EQUAL( argv[i],"-simplify" ) ) {
+        vopts.dptol = atof(argv[i+1]);
+        i++; continue;
+      }
+      if( EQUAL( argv[i],"-sort" ) ) {
+        if( EQUAL( argv[i+1],"hilbert" ) )
+          vopts.hilbert = true;
+        else if( EQUAL( argv[i+1],"label" ) )
+          vopts.hilbert = false;
+        else
+          help = true;
+        i++; continue;
+      }
+      if( EQUAL( argv[i],"-shards" ) ) {
+        vopts.shards = std::max( 1, atoi(argv[i+1]) );
+        i++; continue;
+      }
+      if( EQUAL( argv[i],"-shape" ) ) {
+        vopts.shapes = true;
+        continue;
+      }
+      if( EQUAL( argv[i],"-layout" ) ) {
+        if( EQUAL( argv[i+1],"bip" ) )
+          interleave = true;
+        else if( EQUAL( argv[i+1],"band" ) )
+          interleave = false;
+        else
+          help = true;
+        i++; continue;
+      }
+      if( EQUAL( argv[i],"-tr" ) ) {
+        tres = atof(argv[i+1]);
+        i++; continue;
+      }
+      if( EQUAL( argv[i],"-r" ) ) {
+        Resample = argv[i+1];
+        i++; continue;
+      }
+      if( EQUAL( argv[i],"-statraster" ) ) {
+        StatFilenames.push_back( argv[i+1] );
+        i++; continue;
+      }
+      if( EQUAL( argv[i],"-statresample" ) ) {
+        StatResample = argv[i+1];
+        i++; continue;
+      }
+      if( EQUAL( argv[i],"-threads" ) ) {
+        SetThreads( std::max( 1, atoi(argv[i+1]) ) );
+        i++; continue;
+      }
+      if( EQUAL( argv[i],"-mem" ) ) {
+        memlimit = ParseMemory( argv[i+1] );
+        i++; continue;
+      }
+      if( EQUAL( argv[i],"-adaptive" ) ) {
+        adaptive = std::max( 0, atoi(argv[i+1]) );
+        i++; continue;
+      }
+      if( EQUAL( argv[i],"-init" ) ) {
+        InitFilename = argv[i+1];
+        i++; continue;
+      }
+      if( EQUAL( argv[i],"-check" ) ) {
+        CheckFilename = argv[i+1];
+        i++; continue;
+      }
+      if( EQUAL( argv[i],"-slack" ) ) {
+        slack = std::max( 0.0, atof(argv[i+1]) );
+        i++; continue;
+      }
+      if( EQUAL( argv[i],"-labelstore" ) ) {
+        StoreFilename = argv[i+1];
+        i++; continue;
+      }
+      if( EQUAL( argv[i],"-extract" ) ) {
+        // a missing mode or list is reported with the usage
+        ExtractMode = ( i + 1 < argc ) ? argv[i+1] : "";
+        ExtractList = ( i + 2 < argc ) ? argv[i+2] : NULL;
+        i+=2; continue;
+      }
+      if( EQUAL( argv[i],"-sweep" ) ) {
+        SweepSpec = argv[i+1];
+        i++; continue;
+      }
       if( EQUAL( argv[i],"-merge" ) ) {
         if( EQUAL( argv[i+1],"true" ) )
           enforce = true;
@@ -158,27 +718,35 @@ int main(int argc, char ** argv)
     }
   }
 
-  if ( !askhelp )
+  if ( !askhelp && ExtractMode )
   {
-    // check parameters
-    if ( EQUAL( algo, "SLIC"  )
-      || EQUAL( algo, "SLICO" )
-      || EQUAL( algo, "MSLIC" ) )
+    // selected segments from a label store, no input raster
+    if ( !ExtractList || ( !EQUAL( ExtractMode, "ids" ) && !EQUAL( ExtractMode, "bbox" ) ) )
+    {
+      printf( "\nERROR: -extract needs ids or bbox and a list.\n" );
+      help = true;
+    }
+    if ( !StoreFilename )
     {
-        if (!niter) niter = 10;
-        if (!regionsize) regionsize = 10;
+      printf( "\nERROR: -extract needs -labelstore.\n" );
+      help = true;
     }
-    else if ( EQUAL( algo, "SEEDS" ) )
+    if ( !OutFilename || EQUAL( OutFormat, "MVT" ) )
     {
-        if (!niter) niter = 20;
-        if (!regionsize) regionsize = 10;
+      printf( "\nERROR: -extract needs a vector -out file.\n" );
+      help = true;
     }
-    else if ( EQUAL( algo, "LSC" ) )
+  }
+  else if ( !askhelp )
+  {
+    // check parameters, warm start needs few iterations
+    if ( InitFilename && !niter ) niter = 3;
+    if ( SweepSpec )
     {
-        if (!niter) niter = 20;
-        if (!regionsize) regionsize = 10;
+      if ( !ParseSweep( SweepSpec, niter, jobs ) )
+        help = true;
     }
-    else
+    else if ( !AlgoDefaults( algo, niter, regionsize ) )
     {
       if ( EQUAL(algo, "" ) )
         printf( "\nERROR: No algorithm specified.\n" );
@@ -186,12 +754,34 @@ int main(int argc, char ** argv)
         printf( "\nERROR: Invalid algorithm: %s\n", algo );
       help = true;
     }
+    for ( size_t j = 0; ( InitFilename || adaptive ) && ( j < std::max( (size_t) 1, jobs.size() ) ); j++ )
+    {
+      const char *name = jobs.empty() ? algo : jobs[j].algo.c_str();
+      // seeded engine has the fixed SLIC distance only
+      if ( !EQUAL( name, "SLIC" ) )
+      {
+        printf( "\nERROR: %s works with SLIC only, not %s.\n",
+                InitFilename ? "-init" : "-adaptive", name );
+        help = true;
+        break;
+      }
+    }
+    if ( InitFilename && adaptive )
+    {
+      printf( "\nERROR: -adaptive and -init are exclusive.\n" );
+      help = true;
+    }
     if ( InFilenames.size() == 0 )
     {
       printf( "\nERROR: No input file specified.\n" );
       help = true;
     }
-    if (! OutFilename )
+    if ( statsonly && !OutStatH5name )
+    {
+      printf( "\nERROR: -statsonly needs -h5stat.\n" );
+      help = true;
+    }
+    else if ( !OutFilename && !statsonly )
     {
       printf( "\nERROR: No output file specified.\n" );
       help = true;
@@ -200,16 +790,37 @@ int main(int argc, char ** argv)
 
   if ( help || askhelp ) {
     printf( "\nUsage: gdal-segment [-help] src_raster1 src_raster2 .. src_rasterN -out dst_vector\n"
-            "    [-of <output_format> 'ESRI Shapefile' is default]\n"
-            "    [-h5stat <output hdf5 statfile>]\n"
-            "    [-b R B (B-th band from R-th raster)] [-algo <LSC, SLICO, SLIC, SEEDS, MSLIC>]\n"
+            "    [-of <output_format> 'ESRI Shapefile' is default, MVT for tile dir or .mbtiles]\n"
+            "    [-h5stat <output hdf5 statfile>] [-h5compress <0..9> (deflate, default 4)]\n"
+            "    [-h5labels (store label raster in hdf5)] [-statsonly (hdf5 only, no vector)]\n"
+            "    [-b R B (B-th band from R-th raster)] [-algo <LSC, SLICO, SLIC, SEEDS, MSLIC, FH>]\n"
             "    [-blur (apply 3x3 gaussian blur)] [-lab (convert rgb ro lab colorspace)]\n"
             "    [-merge <true|false (default true)>]\n"
-            "    [-niter <1..500>] [-region <pixels>]\n"
+            "    [-threads <N> (worker threads, default all cores)]\n"
+            "    [-mem <size[K|M|G|T]> (memory budget, plans cache, windows and runs)]\n"
+            "    [-init <label raster> (SLIC warm start, keeps ids of persisting segments)]\n"
+            "    [-adaptive <max region> (SLIC seeds from texture, -region up to max)]\n"
+            "    [-sweep \"ALGO:r1,r2;ALGO:r\" (runs on one loaded raster, replaces -algo/-region)]\n"
+            "    [-adjacency (export label neighbours table)]\n"
+            "    [-topology <lines|polygons> (shared boundary arcs, each edge written once)]\n"
+            "    [-stair (remove pixel staircase)] [-simplify <pixels> (douglas-peucker tolerance)]\n"
+            "    [-sort <label|hilbert (default label)>]\n"
+            "    [-shape (compute segment shape descriptors)]\n"
+            "    [-shards <N> (parallel output files, hilbert sort makes spatial shards, adds .vrt)]\n"
+            "    [-layout <band|bip (default band)>]\n"
+            "    [-tr <resolution> (target grid, default finest input)]\n"
+            "    [-r <near|bilinear|cubic|cubicspline|lanczos|average|mode|gauss (default bilinear)>]\n"
+            "    [-statraster <raster> (zonal statistics, repeatable)]\n"
+            "    [-statresample <near|bilinear|cubic|average|mode .. (default bilinear)>]\n"
+            "    [-niter <1..500>] [-region <pixels>] [-scale <k> (FH threshold, default 300)]\n"
+            "    [-labelstore <tif> (tiled label raster with .lbx segment index)]\n"
+            "    [-extract <ids|bbox> <id,id,..|minx,miny,maxx,maxy> (polygons from -labelstore)]\n"
+            "    [-check <csv> (compare labels, stats and timings, writes baseline if missing)]\n"
+            "    [-slack <percent> (also fail -check runs slower by more, off by default)]\n"
+            "    [-spool <dir> [-workers <N>] [-spoolmem <MB>] (serve json job files)]\n"
             "Default niter: 10 iterations\n\n" );
 
-    GDALDestroyDriverManager();
-    exit( 1 );
+    return 1;
   }
 
 #if GDALVER >= 2
@@ -220,8 +831,8 @@ int main(int argc, char ** argv)
   OGRSFDriver *poDriver = poR->GetDriverByName( OutFormat );
 #endif
 
-  // check drivers
-  if( poDriver == NULL )
+  // check drivers, tiles are written natively
+  if( ( poDriver == NULL ) && !EQUAL( OutFormat, "MVT" ) )
   {
     printf( "Unable to find driver `%s'.\n", OutFormat );
     printf( "The following drivers are available:\n" );
@@ -239,19 +850,63 @@ int main(int argc, char ** argv)
       printf( "  -> '%s'\n", poR->GetDriver(i)->GetName());
 #endif
     }
-    exit( 1 );
+    return 1;
   }
 
-  printf( "Segments raster using: %s\n", algo );
-  printf( "Process use parameter: region=%i niter=%i\n", regionsize, niter );
+  if ( ExtractMode )
+  {
+    startTime = cv::getTickCount();
+    const int failed = ExtractSegments( StoreFilename, ExtractMode, ExtractList,
+                                        OutFilename, OutFormat, vopts );
+    endTime = cv::getTickCount();
+    printf( "Time: %.6f sec\n\n", ( endTime - startTime ) / frequency );
+    printf( "Finish.\n" );
+    return failed;
+  }
+
+  if ( SweepSpec )
+    printf( "Segments raster using: %lu sweep runs (%s)\n", jobs.size(), SweepSpec );
+  else
+  {
+    printf( "Segments raster using: %s\n", algo );
+    printf( "Process use parameter: region=%i niter=%i\n", regionsize, niter );
+  }
+
+  /*
+   * plan memory
+   */
+
+  PLAN plan;
+  plan.runs = (int) std::max( (size_t) 1, jobs.size() );
+  plan.window = 0.0f;
+  if ( memlimit > 0.0f )
+  {
+    std::vector< std::string > algos;
+    std::vector< int > regions;
+    for ( size_t j = 0; j < jobs.size(); j++ )
+    {
+      algos.push_back( jobs[j].algo );
+      regions.push_back( jobs[j].regionsize );
+    }
+    if ( jobs.empty() )
+    {
+      algos.push_back( algo );
+      regions.push_back( regionsize );
+    }
+    if ( !PlanMemory( InFilenames, StatFilenames, algos, regions, tres,
+                      labcol, ( InitFilename != NULL ) || adaptive, memlimit, plan ) )
+      return 1;
+  }
 
   /*
    * load raster image
    */
 
   startTime = cv::getTickCount();
+  GEOREF georef;
+  cv::Mat mask;
   std::vector< cv::Mat > raster;
-  LoadRaster( InFilenames, raster );
+  LoadRaster( InFilenames, raster, georef, mask, tres, Resample, interleave );
   endTime = cv::getTickCount();
   printf( "Time: %.6f sec\n\n", ( endTime - startTime ) / frequency );
 
@@ -285,6 +940,8 @@ int main(int argc, char ** argv)
   if ( labcol )
   {
     Mat lab;
+    if ( raster.size() == 1 )
+      split( raster[0], raster );
     raster.resize(3);
     printf( "Convert to LAB colorspace.\n" );
     merge( raster, rgb );
@@ -293,206 +950,158 @@ int main(int argc, char ** argv)
   }
 
   /*
-   * init segments
+   * run segmentations
    */
 
-  printf( "Init Superpixels\n" );
-  Ptr<SuperpixelSLIC> slic;
-  Ptr<SuperpixelSEEDS> seed;
-  Ptr<SuperpixelLSC> lsc;
-
-  startTime = cv::getTickCount();
-  if ( EQUAL ( algo, "SLIC" ) )
-    slic = createSuperpixelSLIC( raster, SLIC, regionsize, 10.0f );
-  else if ( EQUAL( algo, "SLICO" ) )
-    slic = createSuperpixelSLIC( raster, SLICO, regionsize, 10.0f );
-  else if ( EQUAL( algo, "MSLIC" ) )
-    slic = createSuperpixelSLIC( raster, MSLIC, regionsize, 10.0f );
-  else if ( EQUAL( algo, "LSC" ) )
-    lsc = createSuperpixelLSC( raster, regionsize, 0.075f );
-  else if ( EQUAL( algo, "SEEDS" ) )
+  SEGINPUT input;
+  input.raster = &raster;
+  input.original = &original;
+  input.mask = mask;
+  if ( InitFilename )
   {
-    // only few datatype is supported
-    if ( ( raster[0].depth() != CV_8U )
-       &&( raster.size() != 3 ) )
-    {
-      printf( "\nERROR: Input datatype is not supported by SEED. Use RGB or Gray with Byte types.\n" );
-      exit( 0 );
-    }
-
-    int clusters = int(((float)raster[0].cols / (float)regionsize)
-                     * ((float)raster[0].rows / (float)regionsize));
-    seed = createSuperpixelSEEDS( raster[0].cols, raster[0].rows, raster.size(), clusters, 1, 2, 5, true );
+    startTime = cv::getTickCount();
+    LoadLabels( InitFilename, georef, raster[0].cols, raster[0].rows, input.initlabels );
+    endTime = cv::getTickCount();
+    printf( "Time: %.6f sec\n\n", ( endTime - startTime ) / frequency );
   }
-  else
+  input.georef = georef;
+  input.OutFormat = OutFormat;
+  input.statsonly = statsonly;
+  input.h5compress = h5compress;
+  input.h5labels = h5labels;
+  input.enforce = enforce;
+  input.neighbours = neighbours;
+  input.topology = topology;
+  // coarsest cell never needs to exceed the raster
+  input.adaptive = std::min( adaptive, std::max( raster[0].cols, raster[0].rows ) );
+  input.scale = scale;
+  input.vopts = vopts;
+  input.StatFilenames = StatFilenames;
+  input.StatResample = StatResample;
+  input.window = plan.window;
+  input.check = ( CheckFilename != NULL );
+  input.store = ( StoreFilename != NULL );
+  mask.release();
+
+  if ( !SweepSpec )
   {
-    printf( "\nERROR: No such algorithm: [%s].\n", algo );
-    exit( 1 );
+    SEGJOB job;
+    job.algo = algo;
+    job.regionsize = regionsize;
+    job.niter = niter;
+    job.labels = 0;
+    jobs.push_back( job );
   }
-  endTime = cv::getTickCount();
-  printf( "Time: %.6f sec\n\n", ( endTime - startTime ) / frequency );
-
-  size_t m_labels = 0;
-  if ( EQUAL( algo, "SLIC" )
-    || EQUAL( algo, "SLICO" )
-    || EQUAL( algo, "MSLIC" ) )
-    m_labels = slic->getNumberOfSuperpixels();
-  else if ( EQUAL( algo, "SEEDS" ) )
-    m_labels = seed->getNumberOfSuperpixels();
-  else if ( EQUAL( algo, "LSC" ) )
-    m_labels = lsc->getNumberOfSuperpixels();
-
-  startTime = cv::getTickCount();
-  printf( "Grow Superpixels: #%i iterations\n", niter );
-  printf( "           inits: %lu superpixels\n", m_labels );
-
-  /*
-   * start compute segments
-   */
-
-  startSecond = cv::getTickCount();
-  if ( EQUAL( algo, "SLIC" )
-    || EQUAL( algo, "SLICO" )
-    || EQUAL( algo, "MSLIC" ) )
-    slic->iterate( niter );
-  else if ( EQUAL( algo, "LSC" ) )
-    lsc->iterate( niter );
-  else if ( EQUAL( algo, "SEEDS" ) )
+  for ( size_t j = 0; j < jobs.size(); j++ )
   {
-    cv::Mat whole;
-    cv::merge(raster,whole);
-    seed->iterate( whole, niter );
+    if ( OutFilename )
+      jobs[j].output = SweepSpec ? SweepName( OutFilename, jobs[j] ) : OutFilename;
+    if ( OutStatH5name )
+      jobs[j].h5stat = SweepSpec ? SweepName( OutStatH5name, jobs[j] ) : OutStatH5name;
+    if ( StoreFilename )
+      jobs[j].store = SweepSpec ? SweepName( StoreFilename, jobs[j] ) : StoreFilename;
   }
-  endSecond = cv::getTickCount();
-
-
-  if( EQUAL( algo, "SLIC" )
-   || EQUAL( algo, "SLICO" )
-   || EQUAL( algo, "MSLIC" ) )
-    m_labels = slic->getNumberOfSuperpixels();
-  else if ( EQUAL( algo, "SEEDS" ) )
-    m_labels = seed->getNumberOfSuperpixels();
-  else if ( EQUAL( algo, "LSC" ) )
-    m_labels = lsc->getNumberOfSuperpixels();
 
-  printf( "           count: %lu superpixels (growed in %.6f sec)\n",
-          m_labels, ( endSecond - startSecond ) / frequency );
-
-  // get smooth labels
-  startSecond = cv::getTickCount();
-  if ( EQUAL( algo, "SLIC" )
-    || EQUAL( algo, "SLICO" )
-    || EQUAL( algo, "MSLIC" ) )
+  // disjoint thread groups, one run per group
+  const int nthreads = omp_get_max_threads();
+  const int ngroups = std::max( 1, std::min( std::min( (int) jobs.size(), nthreads ), plan.runs ) );
+  const int gthreads = std::max( 1, nthreads / ngroups );
+  if ( ngroups > 1 )
   {
-    if ( enforce == true )
-      slic->enforceLabelConnectivity();
+    omp_set_max_active_levels( 2 );
+    printf( "Sweep %lu runs in %i groups of %i threads\n\n", jobs.size(), ngroups, gthreads );
   }
-  else if ( EQUAL( algo, "LSC" ) )
-  {
-    if ( enforce == true)
-      lsc->enforceLabelConnectivity();
-  }
-  endSecond = cv::getTickCount();
 
-  if ( EQUAL( algo, "SLIC" )
-    || EQUAL( algo, "MSLIC" )
-    || EQUAL( algo, "SLICO" ) )
-    m_labels = slic->getNumberOfSuperpixels();
-  else if ( EQUAL( algo, "SEEDS" ) )
-    m_labels = seed->getNumberOfSuperpixels();
-  else if ( EQUAL( algo, "LSC" ) )
-    m_labels = lsc->getNumberOfSuperpixels();
-
-  if ( ! EQUAL( algo, "SEEDS" ) )
+  startTime = cv::getTickCount();
+  #pragma omp parallel for num_threads(ngroups) schedule(dynamic,1)
+  for ( int j = 0; j < (int) jobs.size(); j++ )
   {
-    printf( "           final: %lu superpixels (merged in %.6f sec)\n",
-            m_labels, ( endSecond - startSecond ) / frequency );
-    endTime = cv::getTickCount();
-    printf( "Time: %.6f sec\n\n", ( endTime - startTime ) / frequency );
+    omp_set_num_threads( gthreads );
+    RunSegmentation( input, jobs[j] );
   }
-
-
-  // storage
-  cv::Mat klabels;
-  if( EQUAL( algo, "SLIC" )
-   || EQUAL( algo, "MSLIC" )
-   || EQUAL( algo, "SLICO" ) )
-    slic->getLabels( klabels );
-  else if( EQUAL( algo, "SEEDS" ) )
-    seed->getLabels( klabels );
-  else if( EQUAL( algo, "LSC" ) )
-    lsc->getLabels( klabels );
-
-  // release mem
-  slic.release();
-  seed.release();
-  lsc.release();
-
-  /*
-   * get segments contour
-   */
-
-  std::vector< std::vector< LINE > > linelists( m_labels );
-
-  startTime = cv::getTickCount();
-  LabelContours( klabels, linelists );
   endTime = cv::getTickCount();
-  printf( "Time: %.6f sec\n\n", ( endTime - startTime ) / frequency );
-
 
-  /*
-   * statistics
-   */
-
-  startTime = cv::getTickCount();
-
-  if ( labcol )
+  if ( SweepSpec )
   {
-    raster = original;
+    const char *BaseFilename = OutFilename ? OutFilename : OutStatH5name;
+    const std::string csvname = CPLFormFilename( CPLGetPath( BaseFilename ),
+      CPLSPrintf( "%s_sweep", CPLGetBasename( BaseFilename ) ), "csv" );
+    FILE *csv = fopen( csvname.c_str(), "w" );
+    if ( csv )
+      fprintf( csv, "algo,region,niter,segments,grow,merge,contour,stats,save,output\n" );
+    printf( "Sweep summary (%.6f sec total)\n", ( endTime - startTime ) / frequency );
+    printf( "  %-6s %6s %5s %10s %10s %10s %10s %10s %10s\n",
+            "algo", "region", "niter", "segments", "grow", "merge", "contour", "stats", "save" );
+    for ( size_t j = 0; j < jobs.size(); j++ )
+    {
+      const SEGJOB& job = jobs[j];
+      printf( "  %-6s %6i %5i %10lu %10.3f %10.3f %10.3f %10.3f %10.3f\n",
+              job.algo.c_str(), job.regionsize, job.niter, job.labels,
+              job.times[STAGE_GROW], job.times[STAGE_MERGE], job.times[STAGE_CONTOUR],
+              job.times[STAGE_STATS], job.times[STAGE_SAVE] );
+      if ( csv )
+        fprintf( csv, "%s,%i,%i,%lu,%.6f,%.6f,%.6f,%.6f,%.6f,%s\n",
+                 job.algo.c_str(), job.regionsize, job.niter, job.labels,
+                 job.times[STAGE_GROW], job.times[STAGE_MERGE], job.times[STAGE_CONTOUR],
+                 job.times[STAGE_STATS], job.times[STAGE_SAVE],
+                 ( job.output.empty() ? job.h5stat : job.output ).c_str() );
+    }
+    if ( csv )
+    {
+      fclose( csv );
+      printf( "  written to %s\n", csvname.c_str() );
+    }
+    printf( "\n" );
   }
 
-  // superpixels property
-  size_t m_bands = raster.size();
+  // golden output and timing regression
+  const int failures = CheckFilename ? CheckRuns( CheckFilename, jobs, slack ) : 0;
 
-  Mat labelpixels(m_labels, 1, CV_32S);
-  Mat avgCH(m_bands, m_labels, CV_64F);
-  Mat stdCH(m_bands, m_labels, CV_64F);
+ /*
+  * END
+  */
 
-  ComputeStats( klabels, raster, labelpixels, avgCH, stdCH );
-  endTime = cv::getTickCount();
-  printf( "Time: %.6f sec\n\n", ( endTime - startTime ) / frequency );
+  printf( "Finish.\n" );
 
+  return failures ? 1 : 0;
 
- /*
-  * dump vector
-  */
+}
 
-  startTime = cv::getTickCount();
-  SavePolygons( InFilenames, OutFilename, OutFormat, klabels,
-                raster, labelpixels, avgCH, stdCH, linelists );
-  endTime = cv::getTickCount();
-  printf( "Time: %.6f sec\n\n", ( endTime - startTime ) / frequency );
+int main(int argc, char ** argv)
+{
+  // register
+  GDALAllRegister();
+  OGRRegisterAll();
 
+  argc = GDALGeneralCmdLineProcessor( argc, &argv, 0 );
 
- /*
-  * dump stats
-  */
+  if( argc < 1 )
+    exit( -argc );
 
-  if ( OutStatH5name )
+  // daemon mode keeps drivers, caches and threads warm
+  const char *SpoolDir = NULL;
+  int workers = 1;
+  double spoolmem = 0.0f;
+  for( int i = 1; i < argc - 1; i++ )
   {
-    cv::Ptr<cv::hdf::HDF5> h5io = cv::hdf::open( OutStatH5name );
-    h5io->dswrite( avgCH, "average" );
-    h5io->dswrite( stdCH, "stddevs" );
-    h5io->dswrite( labelpixels, "pixarea" );
-    h5io->close();
+    if( EQUAL( argv[i],"-spool" ) )
+      SpoolDir = argv[++i];
+    else if( EQUAL( argv[i],"-workers" ) )
+      workers = std::max( 1, atoi( argv[++i] ) );
+    else if( EQUAL( argv[i],"-threads" ) )
+      SetThreads( std::max( 1, atoi( argv[++i] ) ) );
+    else if( EQUAL( argv[i],"-spoolmem" ) )
+      spoolmem = atof( argv[++i] ) * 1024.0f * 1024.0f;
   }
 
- /*
-  * END
-  */
-
-  printf( "Finish.\n" );
+  int ret;
+  if ( SpoolDir )
+    ret = RunSpool( SpoolDir, workers, spoolmem );
+  else
+    ret = Segment( argc, argv );
 
-  return 0;
+  CSLDestroy( argv );
+  GDALDestroyDriverManager();
 
+  return ret;
 }
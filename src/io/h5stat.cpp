@@ -0,0 +1,112 @@
+/*
+ *  Copyright (c) 2015  Balint Cristian (cristian.balint@gmail.com)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+/* h5stat.cpp */
+/* HDF5 statistics output */
+
+#include <algorithm>
+
+#include "gdal.h"
+#include "cpl_string.h"
+#include "cpl_vsi.h"
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/hdf/hdf5.hpp>
+
+#include "gdal-segment.hpp"
+
+using namespace std;
+using namespace cv;
+
+
+// labels per chunk of per label tables
+static const int LABEL_CHUNK = 65536;
+
+// chunked dataset written in hyperslabs along rows or columns
+static void WriteChunked( const cv::Ptr< cv::hdf::HDF5 >& h5io, const cv::Mat data,
+                          const std::string& name, const int compress,
+                          const int chunkrows, const int chunkcols, const bool columns )
+{
+  if ( data.empty() ) return;
+
+  int chunks[2] = { std::min( data.rows, chunkrows ), std::min( data.cols, chunkcols ) };
+  h5io->dscreate( data.rows, data.cols, data.type(), name,
+                  ( compress > 0 ) ? compress : (int) cv::hdf::HDF5::H5_NONE, chunks );
+
+  // one chunk row or column at a time
+  const int n = columns ? data.cols : data.rows;
+  const int step = columns ? chunks[1] : chunks[0];
+  for ( int o = 0; o < n; o += step )
+  {
+    const int c = std::min( step, n - o );
+    int offset[2] = { columns ? 0 : o, columns ? o : 0 };
+    int counts[2] = { columns ? data.rows : c, columns ? c : data.cols };
+    cv::Mat part = columns ? data.colRange( o, o + c ) : data.rowRange( o, o + c );
+    if ( !part.isContinuous() ) part = part.clone();
+    h5io->dswrite( part, name, offset, counts );
+  }
+}
+
+void SaveStats( const char *H5Filename, const cv::Mat klabels,
+                const cv::Mat labelpixels, const std::vector< int >& labelids,
+                const cv::Mat avgCH, const cv::Mat stdCH,
+                const cv::Mat avgZS, const cv::Mat stdZS,
+                const cv::Mat bboxes, const cv::Mat shapes,
+                const std::vector< ADJACENCY >& adjacency,
+                const int compress, const bool withlabels )
+{
+  const int m_labels = labelpixels.rows;
+  const int block = LABEL_CHUNK;
+
+  // identity when not seeded
+  cv::Mat labelid( m_labels, 1, CV_32S );
+  for ( int k = 0; k < m_labels; k++ )
+    labelid.at<int>(k) = labelids.empty() ? k : labelids[k];
+
+  printf( "Write File: %s (hdf5, %s)\n", H5Filename,
+          ( compress > 0 ) ? CPLSPrintf( "deflate %i", compress ) : "uncompressed" );
+
+  // hdf5 library is not thread safe
+  #pragma omp critical (h5io)
+  {
+    // datasets are recreated with new shapes
+    VSIUnlink( H5Filename );
+    cv::Ptr< cv::hdf::HDF5 > h5io = cv::hdf::open( H5Filename );
+
+    // bands x labels
+    WriteChunked( h5io, avgCH, "average", compress, avgCH.rows, block, true );
+    WriteChunked( h5io, stdCH, "stddevs", compress, stdCH.rows, block, true );
+    // labels x columns
+    WriteChunked( h5io, labelpixels, "pixarea", compress, block, 1, false );
+    WriteChunked( h5io, labelid, "labelid", compress, block, 1, false );
+    // minX, minY, maxX, maxY in pixels, max exclusive
+    WriteChunked( h5io, bboxes, "bboxes", compress, block, 4, false );
+    // rows follow -statraster bands in order
+    WriteChunked( h5io, avgZS, "zonalavg", compress, avgZS.rows, block, true );
+    WriteChunked( h5io, stdZS, "zonalstd", compress, stdZS.rows, block, true );
+    // perimeter, cx, cy, compactness, elongation, holes
+    WriteChunked( h5io, shapes, "shapes", compress, block, SHAPE_COUNT, false );
+    if ( adjacency.size() > 0 )
+    {
+      // label A, label B, shared length
+      cv::Mat neighbour( (int) adjacency.size(), 3, CV_32S, (void*) &adjacency[0] );
+      WriteChunked( h5io, neighbour, "adjacency", compress, block, 3, false );
+    }
+    // label raster in square chunks, written by row blocks
+    if ( withlabels )
+      WriteChunked( h5io, klabels, "klabels", compress, 256, 256, false );
+    h5io->close();
+  }
+}
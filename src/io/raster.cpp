@@ -16,12 +16,25 @@
 /* raster.cpp */
 /* Raster I/O */
 
+#include <omp.h>
 #include <math.h>
+#include <cmath>
+#include <climits>
+#include <sstream>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
 
 #include "gdal.h"
 #include "gdal_priv.h"
 #include "cpl_string.h"
 #include "cpl_csv.h"
+#if GDALVER >= 2
+#include "gdal_utils.h"
+#endif
 
 #include <opencv2/opencv.hpp>
 
@@ -31,15 +44,451 @@ using namespace cv;
 
 
 
+// fill invalid pixels with per channel valid mean
+template< typename T >
+static void FillInvalid( cv::Mat& band, const cv::Mat& mask )
+{
+  const int cn = band.channels();
+  std::vector< double > mean( cn, 0.0f );
+  double count = 0.0f;
+  for ( int y = 0; y < band.rows; y++ )
+  {
+    const T *pixel = band.ptr<T>(y);
+    const uchar *valid = mask.ptr<uchar>(y);
+    for ( int x = 0; x < band.cols; x++ )
+    {
+      if ( !valid[x] ) continue;
+      for ( int c = 0; c < cn; c++ )
+        mean[c] += (double) pixel[x * cn + c];
+      count++;
+    }
+  }
+  std::vector< T > fill( cn );
+  for ( int c = 0; c < cn; c++ )
+    fill[c] = cv::saturate_cast< T >( mean[c] / count );
+
+  #pragma omp parallel for schedule(static)
+  for ( int y = 0; y < band.rows; y++ )
+  {
+    T *pixel = band.ptr<T>(y);
+    const uchar *valid = mask.ptr<uchar>(y);
+    for ( int x = 0; x < band.cols; x++ )
+    {
+      if ( valid[x] ) continue;
+      for ( int c = 0; c < cn; c++ )
+        pixel[x * cn + c] = fill[c];
+    }
+  }
+}
+
+// crop to valid data and neutralize invalid pixels
+static void CropValid( std::vector< cv::Mat >& raster, cv::Mat& mask, GEOREF& georef )
+{
+  const int rows = mask.rows;
+
+  // valid extent per row
+  std::vector< int > minX( rows, INT_MAX ), maxX( rows, -1 );
+  #pragma omp parallel for schedule(static)
+  for ( int y = 0; y < rows; y++ )
+  {
+    const uchar *valid = mask.ptr<uchar>(y);
+    for ( int x = 0; x < mask.cols; x++ )
+    {
+      if ( !valid[x] ) continue;
+      if ( minX[y] == INT_MAX ) minX[y] = x;
+      maxX[y] = x;
+    }
+  }
+
+  int x0 = INT_MAX, x1 = -1, y0 = -1, y1 = -1;
+  for ( int y = 0; y < rows; y++ )
+  {
+    if ( maxX[y] < 0 ) continue;
+    if ( y0 < 0 ) y0 = y;
+    y1 = y;
+    x0 = std::min( x0, minX[y] );
+    x1 = std::max( x1, maxX[y] );
+  }
+
+  if ( y0 < 0 )
+  {
+    printf ("\nERROR: Input has no valid pixels.\n");
+    exit ( 1 );
+  }
+
+  const cv::Rect box( x0, y0, x1 - x0 + 1, y1 - y0 + 1 );
+  const size_t valid = cv::countNonZero( mask );
+  printf ("\nValid Data: (%lu of %lu) pixels\n", valid, mask.total());
+
+  if ( ( box.width != mask.cols ) || ( box.height != mask.rows ) )
+  {
+    printf ("  Crop to: (%i Pixels x %i Lines) at (%i,%i)\n",
+             box.width, box.height, x0, y0);
+    for ( size_t b = 0; b < raster.size(); b++ )
+      raster[b] = raster[b]( box ).clone();
+    mask = mask( box ).clone();
+
+    // shift grid origin
+    double *gt = georef.transform;
+    gt[0] += x0 * gt[1] + y0 * gt[2];
+    gt[3] += x0 * gt[4] + y0 * gt[5];
+  }
+
+  if ( valid == mask.total() )
+  {
+    mask.release();
+    return;
+  }
+
+  // fill with valid mean to keep clusters away from fill values
+  for ( size_t b = 0; b < raster.size(); b++ )
+  {
+    switch ( raster[b].depth() )
+    {
+      case CV_8U:  FillInvalid< uchar >( raster[b], mask ); break;
+      case CV_16U: FillInvalid< ushort >( raster[b], mask ); break;
+      case CV_16S: FillInvalid< short >( raster[b], mask ); break;
+      case CV_32S: FillInvalid< int >( raster[b], mask ); break;
+      case CV_32F: FillInvalid< float >( raster[b], mask ); break;
+      case CV_64F: FillInvalid< double >( raster[b], mask ); break;
+    }
+  }
+}
+
+// fill rows in the static row partition of later passes, so on
+// numa nodes pages land next to the thread that processes them
+static void FirstTouch( cv::Mat& m, const int value )
+{
+  const size_t rowbytes = m.cols * m.elemSize();
+  #pragma omp parallel for schedule(static)
+  for ( int y = 0; y < m.rows; y++ )
+    memset( m.ptr(y), value, rowbytes );
+}
+
+#if GDALVER >= 2
+// resampling method by name
+static GDALRIOResampleAlg ResampleAlg( const char *Resample )
+{
+  if ( EQUAL( Resample, "near" ) ) return GRIORA_NearestNeighbour;
+  if ( EQUAL( Resample, "bilinear" ) ) return GRIORA_Bilinear;
+  if ( EQUAL( Resample, "cubic" ) ) return GRIORA_Cubic;
+  if ( EQUAL( Resample, "cubicspline" ) ) return GRIORA_CubicSpline;
+  if ( EQUAL( Resample, "lanczos" ) ) return GRIORA_Lanczos;
+  if ( EQUAL( Resample, "average" ) ) return GRIORA_Average;
+  if ( EQUAL( Resample, "mode" ) ) return GRIORA_Mode;
+  if ( EQUAL( Resample, "gauss" ) ) return GRIORA_Gauss;
+
+  printf ("\nERROR: Invalid resampling method [%s].\n", Resample);
+  exit ( 1 );
+}
+#endif
+
+// band streamed onto the target grid
+typedef struct BANDREAD {
+  int file, band;       // input index, band number
+  int mat, ch;          // target raster item, channel
+  GDALDataType rType;
+  bool native;          // already on target grid
+  bool masked;          // has nodata or mask band
+  double sgt[6];        // source geotransform
+  int srcW, srcH;       // source size
+  int bW, bH;           // source block size
+} BANDREAD;
+
+// rows of one band decoded by one task
+typedef struct ROWTASK {
+  int band;
+  int y0, nrows;
+} ROWTASK;
+
+// decoded rows handed to the consumer
+typedef struct ROWDONE {
+  int y0;
+  int skipped;
+  cv::Mat valid;
+  std::string error;    // decoder failure, reported by the consumer
+} ROWDONE;
+
+// bounded hand-off between decoders and consumer
+class RowQueue
+{
+  public:
+    explicit RowQueue( const size_t capacity ) : capacity( capacity ) {}
+
+    void push( const ROWDONE& done )
+    {
+      std::unique_lock< std::mutex > lock( mtx );
+      notfull.wait( lock, [this] { return items.size() < capacity; } );
+      items.push_back( done );
+      notempty.notify_one();
+    }
+
+    ROWDONE pop()
+    {
+      std::unique_lock< std::mutex > lock( mtx );
+      notempty.wait( lock, [this] { return !items.empty(); } );
+      ROWDONE done = items.front();
+      items.pop_front();
+      notfull.notify_one();
+      return done;
+    }
+
+  private:
+    size_t capacity;
+    std::deque< ROWDONE > items;
+    std::mutex mtx;
+    std::condition_variable notfull, notempty;
+};
+
+// state shared by decoder threads
+typedef struct READER {
+  const std::vector< std::string > *files;
+  const std::vector< BANDREAD > *bands;
+  const std::vector< ROWTASK > *tasks;
+  std::vector< cv::Mat > *raster;
+  const GEOREF *georef;
+  const char *Resample;
+  std::atomic< size_t > next;
+  std::atomic< bool > failed;   // remaining tasks are only acknowledged
+  RowQueue *queue;
+} READER;
+
+// decode block row of a band already on the target grid
+static void ReadBlockRow( GDALRasterBand *piBand, const BANDREAD& br,
+                          cv::Mat& rows, ROWDONE& done )
+{
+  const int nrows = rows.rows;
+  const size_t elem = rows.elemSize();
+  uchar *first = rows.data + br.ch * rows.elemSize1();
+  const int nXBlocks = ( br.srcW + br.bW - 1 ) / br.bW;
+
+  for ( int iXBlock = 0; iXBlock < nXBlocks; iXBlock++ )
+  {
+    // portion of the block that is valid
+    const int x0 = iXBlock * br.bW;
+    const int nXValid = std::min( br.bW, br.srcW - x0 );
+    const cv::Rect area( x0, 0, nXValid, nrows );
+
+    if ( br.masked )
+    {
+      bool empty = false;
+#if GDAL_VERSION_NUM >= GDAL_COMPUTE_VERSION(2,2,0)
+      // sparse block holds no data at all
+      const int status = piBand->GetDataCoverageStatus( x0, done.y0, nXValid, nrows );
+      empty = ( status & GDAL_DATA_COVERAGE_STATUS_EMPTY )
+           && !( status & GDAL_DATA_COVERAGE_STATUS_DATA );
+#endif
+      cv::Mat valid = done.valid( area );
+      if ( !empty )
+      {
+        CPLErr error = piBand->GetMaskBand()->RasterIO( GF_Read, x0, done.y0, nXValid, nrows,
+                                                        valid.data, nXValid, nrows, GDT_Byte,
+                                                        1, valid.step );
+        if ( error != CE_None )
+        {
+          done.error = CPLSPrintf( "GetMaskBand() at line %i: %s", done.y0, CPLGetLastErrorMsg() );
+          return;
+        }
+        empty = ( cv::countNonZero( valid ) == 0 );
+      }
+      // fully invalid block, filled after crop
+      if ( empty )
+      {
+        valid = Scalar::all( 0 );
+        done.skipped++;
+        continue;
+      }
+    }
+
+    CPLErr error = piBand->RasterIO( GF_Read, x0, done.y0, nXValid, nrows,
+                                     first + x0 * elem, nXValid, nrows, br.rType,
+                                     elem, rows.step );
+    if ( error != CE_None )
+    {
+      done.error = CPLSPrintf( "RasterIO() at line %i: %s", done.y0, CPLGetLastErrorMsg() );
+      return;
+    }
+  }
+}
+
+#if GDALVER >= 2
+// decode rows of a band through resampled RasterIO
+static void ResampleRows( GDALRasterBand *piBand, const BANDREAD& br, const GEOREF& georef,
+                          const GDALRIOResampleAlg alg, cv::Mat& rows, ROWDONE& done )
+{
+  const double *t = georef.transform;
+  const double *sg = br.sgt;
+  const int cols = rows.cols;
+  const int nrows = rows.rows;
+
+  // target grid in source pixels
+  const double fx = t[1] / sg[1];
+  const double fy = t[5] / sg[5];
+  const double sx0 = ( t[0] - sg[0] ) / sg[1];
+  const double sy0 = ( t[3] - sg[3] ) / sg[5];
+
+  // fractional source window
+  GDALRasterIOExtraArg sExtraArg;
+  INIT_RASTERIO_EXTRA_ARG( sExtraArg );
+  sExtraArg.bFloatingPointWindowValidity = TRUE;
+  sExtraArg.dfXOff = std::max( 0.0, sx0 );
+  sExtraArg.dfYOff = std::max( 0.0, sy0 + done.y0 * fy );
+  sExtraArg.dfXSize = std::min( cols * fx, br.srcW - sExtraArg.dfXOff );
+  sExtraArg.dfYSize = std::min( nrows * fy, br.srcH - sExtraArg.dfYOff );
+
+  const int nXOff = (int) floor( sExtraArg.dfXOff );
+  const int nYOff = (int) floor( sExtraArg.dfYOff );
+  const int nXSize = std::min( br.srcW, (int) ceil( sExtraArg.dfXOff + sExtraArg.dfXSize ) ) - nXOff;
+  const int nYSize = std::min( br.srcH, (int) ceil( sExtraArg.dfYOff + sExtraArg.dfYSize ) ) - nYOff;
+
+  sExtraArg.eResampleAlg = alg;
+  CPLErr error = piBand->RasterIO( GF_Read, nXOff, nYOff, nXSize, nYSize,
+                                   rows.data + br.ch * rows.elemSize1(), cols, nrows,
+                                   br.rType, rows.elemSize(), rows.step, &sExtraArg );
+  if ( error != CE_None )
+  {
+    done.error = CPLSPrintf( "RasterIO() at line %i: %s", done.y0, CPLGetLastErrorMsg() );
+    return;
+  }
+
+  if ( br.masked )
+  {
+    // validity never interpolated
+    sExtraArg.eResampleAlg = GRIORA_NearestNeighbour;
+    error = piBand->GetMaskBand()->RasterIO( GF_Read, nXOff, nYOff, nXSize, nYSize,
+                                             done.valid.data, cols, nrows, GDT_Byte,
+                                             0, 0, &sExtraArg );
+    if ( error != CE_None )
+      done.error = CPLSPrintf( "GetMaskBand() at line %i: %s", done.y0, CPLGetLastErrorMsg() );
+  }
+}
+#endif
+
+// decoder thread, own dataset handles, failures go back through the queue
+static void ReadRows( READER *reader )
+{
+  std::vector< GDALDataset* > handles( reader->files->size(), (GDALDataset*) NULL );
+#if GDALVER >= 2
+  const GDALRIOResampleAlg alg = ResampleAlg( reader->Resample );
+#endif
+
+  for (;;)
+  {
+    const size_t t = reader->next++;
+    if ( t >= reader->tasks->size() ) break;
+
+    const ROWTASK& task = (*reader->tasks)[t];
+    const BANDREAD& br = (*reader->bands)[task.band];
+
+    ROWDONE done;
+    done.y0 = task.y0;
+    done.skipped = 0;
+
+    // consumer counts one hand-off per task
+    if ( reader->failed )
+    {
+      reader->queue->push( done );
+      continue;
+    }
+
+    GDALDataset*& piDataset = handles[br.file];
+    if ( piDataset == NULL )
+    {
+      piDataset = (GDALDataset*) GDALOpen( (*reader->files)[br.file].c_str(), GA_ReadOnly );
+      if( piDataset == NULL )
+      {
+        done.error = std::string( "Couldn't open dataset " ) + (*reader->files)[br.file];
+        reader->failed = true;
+        reader->queue->push( done );
+        continue;
+      }
+    }
+    GDALRasterBand *piBand = piDataset->GetRasterBand( br.band );
+
+    // decode straight into the band
+    cv::Mat rows = (*reader->raster)[br.mat].rowRange( task.y0, task.y0 + task.nrows );
+
+    if ( br.masked )
+      done.valid.create( task.nrows, rows.cols, CV_8U );
+
+    if ( br.native )
+      ReadBlockRow( piBand, br, rows, done );
+#if GDALVER >= 2
+    else
+      ResampleRows( piBand, br, *reader->georef, alg, rows, done );
+#endif
+
+    if ( !done.error.empty() )
+      reader->failed = true;
+    reader->queue->push( done );
+  }
+
+  for ( size_t f = 0; f < handles.size(); f++ )
+    if ( handles[f] ) GDALClose( (GDALDatasetH) handles[f] );
+}
+
 void LoadRaster( const std::vector< std::string > InFilenames,
-                 std::vector< cv::Mat >& raster )
+                 std::vector< cv::Mat >& raster, GEOREF& georef,
+                 cv::Mat& mask, const double tres, const char *Resample,
+                 const bool interleave )
 {
   int rasters = 0;
   int channel = 0;
 
   std::string prev_dType = "";
-  int prev_XSize = 0, prev_YSize = 0;
 
+  // target grid: first scene extent at finest or requested resolution
+  int tXSize = 0, tYSize = 0;
+  double resX = tres, resY = tres;
+  for ( size_t i = 0; i < InFilenames.size(); i++ )
+  {
+    GDALDataset* piDataset;
+    piDataset = (GDALDataset*) GDALOpen(InFilenames[i].c_str(), GA_ReadOnly);
+
+    if( piDataset == NULL )
+    {
+      printf("\nERROR: Couldn't open dataset %s\n", InFilenames[i].c_str());
+      exit( 1 );
+    }
+
+    double gt[6] = { 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, -1.0f };
+    if( piDataset->GetGeoTransform( gt ) != CE_None )
+    {
+      gt[0] = 0.0f; gt[1] = 1.0f; gt[2] = 0.0f;
+      gt[3] = 0.0f; gt[4] = 0.0f; gt[5] = -1.0f;
+    }
+    if ( i == 0 )
+    {
+      memcpy( georef.transform, gt, sizeof( gt ) );
+      georef.projection = piDataset->GetProjectionRef();
+      tXSize = piDataset->GetRasterXSize();
+      tYSize = piDataset->GetRasterYSize();
+    }
+    if ( tres <= 0.0f )
+    {
+      if ( i == 0 ) { resX = fabs( gt[1] ); resY = fabs( gt[5] ); }
+      resX = std::min( resX, fabs( gt[1] ) );
+      resY = std::min( resY, fabs( gt[5] ) );
+    }
+    GDALClose( (GDALDatasetH) piDataset );
+  }
+
+  {
+    double *t = georef.transform;
+    if ( ( fabs( resX - fabs( t[1] ) ) > 1e-9f * resX )
+      || ( fabs( resY - fabs( t[5] ) ) > 1e-9f * resY ) )
+    {
+      tXSize = (int) floor( tXSize * fabs( t[1] ) / resX + 0.5f );
+      tYSize = (int) floor( tYSize * fabs( t[5] ) / resY + 0.5f );
+      t[1] = ( t[1] < 0.0f ) ? -resX : resX;
+      t[5] = ( t[5] < 0.0f ) ? -resY : resY;
+    }
+    printf ("\nTarget Grid: (%i Pixels x %i Lines) at (%g x %g) resolution\n",
+            tXSize, tYSize, fabs( t[1] ), fabs( t[5] ));
+  }
+
+  // describe every band, allocate target channels
+  std::vector< BANDREAD > bands;
   for ( size_t i = 0; i < InFilenames.size(); i++ )
   {
 
@@ -60,6 +509,13 @@ void LoadRaster( const std::vector< std::string > InFilenames,
       exit( 1 );
     }
 
+    double sgt[6];
+    if( piDataset->GetGeoTransform( sgt ) != CE_None )
+    {
+      sgt[0] = 0.0f; sgt[1] = 1.0f; sgt[2] = 0.0f;
+      sgt[3] = 0.0f; sgt[4] = 0.0f; sgt[5] = -1.0f;
+    }
+
     rasters++;
     printf ("\nLoad Raster #%i (#%lu): %s\n", rasters,
               InFilenames.size(), InFilenames[i].c_str());
@@ -73,20 +529,27 @@ void LoadRaster( const std::vector< std::string > InFilenames,
     for ( int iB = 0; iB < nBands; iB++ )
     {
 
-      int iX, iY;
-      int iXBlock, iYBlock;
       int nXBlockSize, nYBlockSize;
 
-      cv::Mat Channel;
-      cv::Mat pabyData;
+      int depth = CV_8U;
       GDALDataType rType;
 
       // get parameters from input dataset
-      const int nXSize = piDataset->GetRasterBand(iB+1)->GetXSize();
-      const int nYSize = piDataset->GetRasterBand(iB+1)->GetYSize();
-      piDataset->GetRasterBand(iB+1)->GetBlockSize( &nXBlockSize, &nYBlockSize );
+      GDALRasterBand *piBand = piDataset->GetRasterBand(iB+1);
+      const int nXSize = piBand->GetXSize();
+      const int nYSize = piBand->GetYSize();
+      piBand->GetBlockSize( &nXBlockSize, &nYBlockSize );
+
+      rType = piBand->GetRasterDataType();
 
-      rType = piDataset->GetRasterBand(iB+1)->GetRasterDataType();
+      // band already lies on the target grid
+      bool native = ( nXSize == tXSize ) && ( nYSize == tYSize );
+      for ( int g = 0; g < 6; g++ )
+        native = native && ( fabs( sgt[g] - georef.transform[g] )
+                             <= 1e-3f * fabs( georef.transform[1] ) );
+
+      // nodata or mask band present
+      const bool masked = !( piBand->GetMaskFlags() & GMF_ALL_VALID );
 
       int nXBlocks = (nXSize + nXBlockSize - 1) / nXBlockSize;
       int nYBlocks = (nYSize + nYBlockSize - 1) / nYBlockSize;
@@ -97,38 +560,32 @@ void LoadRaster( const std::vector< std::string > InFilenames,
       {
         case GDT_Byte:
           dType = "Byte";
-          Channel = cv::Mat( nYSize, nXSize, CV_8U);
-          pabyData = cv::Mat( nYBlockSize, nXBlockSize, CV_8U);
+          depth = CV_8U;
           break;
 
         case GDT_UInt16:
           dType = "UInt16";
-          Channel = cv::Mat( nYSize, nXSize, CV_16U);
-          pabyData = cv::Mat( nYBlockSize, nXBlockSize, CV_16U);
+          depth = CV_16U;
           break;
 
         case GDT_Int16:
           dType = "Int16";
-          Channel = cv::Mat( nYSize, nXSize, CV_16S);
-          pabyData = cv::Mat( nYBlockSize, nXBlockSize, CV_16S);
+          depth = CV_16S;
           break;
 
         case GDT_Int32:
           dType = "Int32";
-          Channel = cv::Mat( nYSize, nXSize, CV_32S);
-          pabyData = cv::Mat( nYBlockSize, nXBlockSize, CV_32S);
+          depth = CV_32S;
           break;
 
         case GDT_Float32:
           dType = "Float32";
-          Channel = cv::Mat( nYSize, nXSize, CV_32F);
-          pabyData = cv::Mat( nYBlockSize, nXBlockSize, CV_32F);
+          depth = CV_32F;
           break;
 
         case GDT_Float64:
           dType = "Float64";
-          Channel = cv::Mat( nYSize, nXSize, CV_64F);
-          pabyData = cv::Mat( nYBlockSize, nXBlockSize, CV_64F);
+          depth = CV_64F;
           break;
 
         default:
@@ -139,260 +596,821 @@ void LoadRaster( const std::vector< std::string > InFilenames,
       channel++;
 
       // consistency
-      if ( channel > 1 )
+      if ( ( channel > 1 ) && ( prev_dType != dType ) )
       {
-        if ( ( prev_XSize != nXSize )
-           ||( prev_YSize != nYSize ) )
-        {
-          printf ("\nERROR: CH #%i has different size: (%iP x %iL) than previous (%iP x %iL).\n",
-                  channel, nXSize, nYSize, prev_XSize, prev_YSize);
-          exit ( 1 );
-        }
-        if ( prev_dType != dType )
-        {
-          printf ("\nERROR: CH #%i has different data type [%s] then previous [%s]\n",
-                 channel, dType.c_str(), prev_dType.c_str());
-          exit ( 1 );
-        }
+        printf ("\nERROR: CH #%i has different data type [%s] then previous [%s]\n",
+               channel, dType.c_str(), prev_dType.c_str());
+        exit ( 1 );
       }
 
       // store previous
       prev_dType = dType;
-      prev_XSize = nXSize;
-      prev_YSize = nYSize;
 
       printf ("  CH: #%03i chann: (#%i Band | [%s])\n", channel, iB+1, dType.c_str());
       printf ("           areas: (%i Pixels x %i Lines) pixels\n", nXSize, nYSize);
       printf ("           tiles: (%i Columns x %i Rows) blocks\n", nXBlocks, nYBlocks);
       printf ("           block: (%i Pixels x %i Lines) pixels / tile\n", nXBlockSize, nYBlockSize);
-      printf ("           ");
-
-      CPLErr error;
+      if ( masked )
+        printf ("           valid: (%s)\n",
+                ( piBand->GetMaskFlags() & GMF_NODATA ) ? "nodata value" : "mask band");
+      if ( !native )
+      {
+#if GDALVER >= 2
+        if ( ( georef.transform[2] != 0.0f ) || ( georef.transform[4] != 0.0f )
+          || ( sgt[2] != 0.0f ) || ( sgt[4] != 0.0f ) )
+        {
+          printf ("\nERROR: Cannot resample rotated grids.\n");
+          exit ( 1 );
+        }
+        // tolerate half a source pixel
+        const double *t = georef.transform;
+        const double sx0 = ( t[0] - sgt[0] ) / sgt[1];
+        const double sy0 = ( t[3] - sgt[3] ) / sgt[5];
+        if ( ( sx0 < -0.5f ) || ( sy0 < -0.5f )
+          || ( sx0 + tXSize * t[1] / sgt[1] > nXSize + 0.5f )
+          || ( sy0 + tYSize * t[5] / sgt[5] > nYSize + 0.5f ) )
+        {
+          printf ("\nERROR: CH #%i does not cover the target grid.\n", channel);
+          exit ( 1 );
+        }
+        printf ("        resample: (%i Pixels x %i Lines) [%s]\n", tXSize, tYSize, Resample);
+#else
+        printf ("\nERROR: CH #%i is off the target grid, resampling needs GDAL >= 2.\n", channel);
+        exit ( 1 );
+#endif
+      }
 
-      for( iYBlock = 0; iYBlock < nYBlocks; iYBlock++ )
+      // valid pixels over all bands
+      if ( masked && mask.empty() )
       {
-          for( iXBlock = 0; iXBlock < nXBlocks; iXBlock++ )
-          {
-               int nXValid, nYValid;
-
-               // compute the portion of the block that is valid
-               // for partial edge blocks.
-               if( (iXBlock+1) * nXBlockSize > nXSize )
-                 nXValid = nXSize - iXBlock * nXBlockSize;
-               else
-                 nXValid = nXBlockSize;
-
-               if( (iYBlock+1) * nYBlockSize > nYSize )
-                 nYValid = nYSize - iYBlock * nYBlockSize;
-               else
-                 nYValid = nYBlockSize;
-
-               error = piDataset->GetRasterBand(iB+1)->ReadBlock( iXBlock, iYBlock, pabyData.data );
-
-               if ( error != CE_None )
-                 printf("ERROR: GetRasterBand()\n");
-
-               // cache some computations
-               const int iXAllBlocks = iXBlock * nXBlockSize;
-               const int iYAllBlocks = iYBlock * nYBlockSize;
-
-               for (iY = 0; iY < nYValid; iY++)
-               {
-                    // cache some computations
-                    const int iYOffset = iY * nXBlockSize;
-                    const int iYShifts = iY + iYAllBlocks;
-
-                    for (iX = 0; iX < nXValid; iX++)
-                    {
-                         switch( rType )
-                         {
-                           case GDT_Byte:
-                             Channel.at<uchar>( iYShifts, iX + iXAllBlocks )
-                                       = pabyData.at<uchar>( iYOffset + iX );
-                             break;
-
-                           case GDT_UInt16:
-                             Channel.at<ushort>( iYShifts, iX + iXAllBlocks )
-                                       = pabyData.at<ushort>( iYOffset + iX );
-                             break;
-
-                           case GDT_Int16:
-                             Channel.at<short>( iYShifts, iX + iXAllBlocks )
-                                       = pabyData.at<short>( iYOffset + iX );
-                             break;
-
-                           case GDT_Int32:
-                             Channel.at<u_int32_t>( iYShifts, iX + iXAllBlocks )
-                                       = pabyData.at<u_int32_t>( iYOffset + iX );
-                             break;
-
-                           case GDT_Float32:
-                             Channel.at<float>( iYShifts, iX + iXAllBlocks )
-                                       = pabyData.at<float>( iYOffset + iX );
-                             break;
-
-                           case GDT_Float64:
-                             Channel.at<double>( iYShifts, iX + iXAllBlocks )
-                                       = pabyData.at<double>( iYOffset + iX );
-                             break;
-
-                           default:
-                             printf ("\nERROR: Unsupported raster data type.\n");
-                             exit ( 1 );
-                         }
-                    }
-               }
-          }
-          GDALTermProgress( (float)((iYBlock+1) / (float)nYBlocks), NULL, NULL);
+        mask.create( tYSize, tXSize, CV_8U );
+        FirstTouch( mask, 255 );
       }
-      pabyData.empty();
-      raster.push_back(Channel);
-      GDALTermProgress( 1.0f, NULL, NULL );
+
+      BANDREAD br;
+      br.file = (int) i;
+      br.band = iB+1;
+      br.rType = rType;
+      br.native = native;
+      br.masked = masked;
+      memcpy( br.sgt, sgt, sizeof( sgt ) );
+      br.srcW = nXSize; br.srcH = nYSize;
+      br.bW = nXBlockSize; br.bH = nYBlockSize;
+      br.mat = interleave ? 0 : (int) bands.size();
+      br.ch = interleave ? (int) bands.size() : 0;
+      bands.push_back( br );
+
+      // interleaved channels are allocated once all bands are known
+      if ( !interleave || raster.empty() )
+        raster.push_back( cv::Mat( interleave ? 0 : tYSize, tXSize, depth ) );
     }
-    GDALTermProgress( 1.0f, NULL, NULL );
     GDALClose( (GDALDatasetH) piDataset );
   }
+
+  // single pixel interleaved matrix
+  if ( interleave )
+  {
+    if ( (int) bands.size() > CV_CN_MAX )
+    {
+      printf ("\nERROR: Interleaved layout holds at most %i bands.\n", CV_CN_MAX);
+      exit ( 1 );
+    }
+    raster[0].create( tYSize, tXSize, CV_MAKETYPE( raster[0].depth(), (int) bands.size() ) );
+    printf ("\nInterleaved Layout: [%lu] bands per pixel\n", bands.size());
+  }
+  for ( size_t r = 0; r < raster.size(); r++ )
+    FirstTouch( raster[r], 0 );
+
+  // tasks: block rows, or resampled rows spanning a source block row
+  std::vector< ROWTASK > tasks;
+  for ( size_t b = 0; b < bands.size(); b++ )
+  {
+    const BANDREAD& br = bands[b];
+    int chunk = br.bH;
+    if ( !br.native )
+      chunk = std::max( 256, (int) ceil( br.bH * br.sgt[5] / georef.transform[5] ) );
+    for ( int y0 = 0; y0 < tYSize; y0 += chunk )
+    {
+      ROWTASK task;
+      task.band = (int) b;
+      task.y0 = y0;
+      task.nrows = std::min( chunk, tYSize - y0 );
+      tasks.push_back( task );
+    }
+  }
+
+  // decoders leave room for driver side threads
+  int nthreads = omp_get_max_threads();
+  const char *gdalthreads = CPLGetConfigOption( "GDAL_NUM_THREADS", NULL );
+  if ( gdalthreads )
+  {
+    const int driver = EQUAL( gdalthreads, "ALL_CPUS" ) ? nthreads : atoi( gdalthreads );
+    if ( driver > 1 ) nthreads = std::max( 1, nthreads / driver );
+  }
+  nthreads = std::max( 1, std::min( nthreads, (int) tasks.size() ) );
+
+  printf ("\nRead [%lu] bands in [%lu] tasks using [%i] threads\n",
+          bands.size(), tasks.size(), nthreads);
+  printf ("  ");
+
+  RowQueue queue( 2 * nthreads );
+  READER reader;
+  reader.files = &InFilenames;
+  reader.bands = &bands;
+  reader.tasks = &tasks;
+  reader.raster = &raster;
+  reader.georef = &georef;
+  reader.Resample = Resample;
+  reader.next = 0;
+  reader.failed = false;
+  reader.queue = &queue;
+
+  std::vector< std::thread > pool;
+  for ( int t = 0; t < nthreads; t++ )
+    pool.push_back( std::thread( ReadRows, &reader ) );
+
+  // merge validity as rows arrive
+  int skipped = 0;
+  std::string error;
+  for ( size_t n = 0; n < tasks.size(); n++ )
+  {
+    ROWDONE done = queue.pop();
+    if ( !done.error.empty() && error.empty() )
+      error = done.error;
+    if ( !error.empty() ) continue;
+    if ( !done.valid.empty() )
+    {
+      cv::Mat region = mask.rowRange( done.y0, done.y0 + done.valid.rows );
+      cv::bitwise_and( region, done.valid, region );
+    }
+    skipped += done.skipped;
+    GDALTermProgress( (float)(n+1) / (float)tasks.size(), NULL, NULL );
+  }
+  for ( size_t t = 0; t < pool.size(); t++ )
+    pool[t].join();
+
+  // decoders are gone, fail on this thread
+  if ( !error.empty() )
+  {
+    printf ("\nERROR: %s\n", error.c_str());
+    exit( 1 );
+  }
+  GDALTermProgress( 1.0f, NULL, NULL );
+
+  if ( skipped )
+    printf ("  Skipped [%i] invalid blocks\n", skipped);
+
+  if ( !mask.empty() )
+    CropValid( raster, mask, georef );
 }
 
-void ComputeStats( const cv::Mat klabels,
+// sum band values per label, one contiguous reduction per run and channel
+template< typename T >
+static void SumBand( const cv::Mat& band, const LABELRUNS& runs,
+                     const STRIPE& stripe, const int stride, double *sum )
+{
+  const int cn = band.channels();
+  for ( int y = stripe.y0; y < stripe.y1; y++ )
+  {
+    const T *pixel = band.ptr<T>(y);
+    for ( size_t i = runs.offset[y]; i + 1 < runs.offset[y + 1]; i++ )
+    {
+      const RUN& run = runs.runs[i];
+      if ( run.label < 0 ) continue;
+      const int n = ( runs.runs[i + 1].x - run.x ) * cn;
+      const T *p = &pixel[run.x * cn];
+      double *acc = &sum[(run.label - stripe.lo) * stride];
+      for ( int c = 0; c < cn; c++ )
+      {
+        double total = 0.0f;
+        for ( int j = c; j < n; j += cn )
+          total += (double) p[j];
+        acc[c] += total;
+      }
+    }
+  }
+}
+
+// sum squared deviations per label, avg rows are per channel
+template< typename T >
+static void DevBand( const cv::Mat& band, const LABELRUNS& runs,
+                     const STRIPE& stripe, const int stride,
+                     const double *avg, const size_t avgstep, double *dev )
+{
+  const int cn = band.channels();
+  for ( int y = stripe.y0; y < stripe.y1; y++ )
+  {
+    const T *pixel = band.ptr<T>(y);
+    for ( size_t i = runs.offset[y]; i + 1 < runs.offset[y + 1]; i++ )
+    {
+      const RUN& run = runs.runs[i];
+      const int k = run.label;
+      if ( k < 0 ) continue;
+      const int n = ( runs.runs[i + 1].x - run.x ) * cn;
+      const T *p = &pixel[run.x * cn];
+      double *acc = &dev[(k - stripe.lo) * stride];
+      for ( int c = 0; c < cn; c++ )
+      {
+        const double mean = avg[c * avgstep + k];
+        double total = 0.0f;
+        for ( int j = c; j < n; j += cn )
+        {
+          const double diff = (double) p[j] - mean;
+          total += diff * diff;
+        }
+        acc[c] += total;
+      }
+    }
+  }
+}
+
+static void BandPass( const cv::Mat& band, const LABELRUNS& runs,
+                      const STRIPE& stripe, const int stride,
+                      const double *avg, const size_t avgstep, double *acc )
+{
+  switch ( band.depth() )
+  {
+    case CV_8U:
+      if ( avg ) DevBand< uchar >( band, runs, stripe, stride, avg, avgstep, acc );
+      else SumBand< uchar >( band, runs, stripe, stride, acc );
+      break;
+    case CV_8S:
+      if ( avg ) DevBand< schar >( band, runs, stripe, stride, avg, avgstep, acc );
+      else SumBand< schar >( band, runs, stripe, stride, acc );
+      break;
+    case CV_16U:
+      if ( avg ) DevBand< ushort >( band, runs, stripe, stride, avg, avgstep, acc );
+      else SumBand< ushort >( band, runs, stripe, stride, acc );
+      break;
+    case CV_16S:
+      if ( avg ) DevBand< short >( band, runs, stripe, stride, avg, avgstep, acc );
+      else SumBand< short >( band, runs, stripe, stride, acc );
+      break;
+    case CV_32S:
+      if ( avg ) DevBand< int >( band, runs, stripe, stride, avg, avgstep, acc );
+      else SumBand< int >( band, runs, stripe, stride, acc );
+      break;
+    case CV_32F:
+      if ( avg ) DevBand< float >( band, runs, stripe, stride, avg, avgstep, acc );
+      else SumBand< float >( band, runs, stripe, stride, acc );
+      break;
+    case CV_64F:
+      if ( avg ) DevBand< double >( band, runs, stripe, stride, avg, avgstep, acc );
+      else SumBand< double >( band, runs, stripe, stride, acc );
+      break;
+    default:
+      CV_Error( Error::StsInternal, "\nERROR: Invalid raster depth" );
+      break;
+  }
+}
+
+// geometric moments
+enum { MOM_X = 0, MOM_Y, MOM_XX, MOM_YY, MOM_XY, MOM_COUNT };
+
+void ComputeStats( const LABELRUNS& runs,
                    const std::vector< cv::Mat > raster,
-                   cv::Mat& labelpixels, cv::Mat& avgCH, cv::Mat& stdCH )
+                   cv::Mat& labelpixels, cv::Mat& avgCH, cv::Mat& stdCH,
+                   cv::Mat *shapes, cv::Mat *bboxes )
 {
 
   avgCH = Scalar::all(0);
   stdCH = Scalar::all(0);
   labelpixels = Scalar::all(0);
 
-  const int m_bands = (int) raster.size();
-  Mat sumCH = Mat::zeros(m_bands, klabels.cols*klabels.rows, CV_64F);
+  const int m_bands = avgCH.rows;
+  const int m_labels = labelpixels.rows;
+
+  // contours may have filled some descriptors
+  if ( shapes && ( shapes->rows != m_labels ) )
+  {
+    shapes->create( m_labels, SHAPE_COUNT, CV_64F );
+    *shapes = Scalar::all( 0 );
+  }
+
+  // contours may have traced the extents already
+  if ( bboxes && ( bboxes->rows == m_labels ) ) bboxes = NULL;
+  if ( bboxes ) bboxes->create( m_labels, 4, CV_32S );
+
+  // per thread label windows
+  std::vector< STRIPE > stripes;
+  RunStripes( runs, stripes );
+  const int nstripes = (int) stripes.size();
+
+  std::vector< std::vector< int > > stripecount( nstripes );
+  std::vector< std::vector< int > > stripeboxes( nstripes );
+  std::vector< std::vector< double > > stripesum( nstripes );
+  std::vector< std::vector< double > > stripemom( nstripes );
 
   printf ("Compute Statistics\n");
 
   printf ("       Computing CLASS polygons intensity\n");
   printf ("       ");
-  for (int y = 0; y < klabels.rows; y++)
+  #pragma omp parallel for schedule(static)
+  for ( int s = 0; s < nstripes; s++ )
   {
-      const int yklabels = y * klabels.cols;
-      for (int x = 0; x < klabels.cols; x++)
+      const STRIPE& stripe = stripes[s];
+      if ( stripe.hi < stripe.lo ) continue;
+      const int nwin = stripe.hi - stripe.lo + 1;
+
+      // gather how many pixels per class we have
+      std::vector< int >& count = stripecount[s];
+      count.assign( nwin, 0 );
+      std::vector< double >& mom = stripemom[s];
+      if ( shapes ) mom.assign( nwin * MOM_COUNT, 0.0f );
+      std::vector< int >& boxes = stripeboxes[s];
+      if ( bboxes )
+        for ( int k = 0; k < nwin; k++ )
+        {
+          boxes.push_back( INT_MAX ); boxes.push_back( INT_MAX );
+          boxes.push_back( -1 );      boxes.push_back( -1 );
+        }
+      for ( int y = stripe.y0; y < stripe.y1; y++ )
       {
-          const int i = yklabels + x;
-          const int k = klabels.at<u_int32_t>(i);
-          // gather how many pixels per class we have
-          labelpixels.at<u_int32_t>( klabels.at<u_int32_t>(i) )++;
-          // summ all pixel intensities
-          #pragma omp parallel for schedule(dynamic)
-          for (int b = 0; b < m_bands; b++)
+          for ( size_t i = runs.offset[y]; i + 1 < runs.offset[y + 1]; i++ )
           {
-            switch ( raster[b].depth() )
-            {
-              case CV_8U:
-                sumCH.at<double>(b,k) += (double) raster[b].at<uchar>(i);
-                break;
-              case CV_8S:
-                sumCH.at<double>(b,k) += (double) raster[b].at<char>(i);
-                break;
-              case CV_16U:
-                sumCH.at<double>(b,k) += (double) raster[b].at<ushort>(i);
-                break;
-              case CV_16S:
-                sumCH.at<double>(b,k) += (double) raster[b].at<short>(i);
-                break;
-              case CV_32S:
-                sumCH.at<double>(b,k) += (double) raster[b].at<u_int32_t>(i);
-                break;
-              case CV_32F:
-                sumCH.at<double>(b,k) += (double) raster[b].at<float>(i);
-                break;
-              case CV_64F:
-                sumCH.at<double>(b,k) += (double) raster[b].at<double>(i);
-                break;
-              default:
-                CV_Error( Error::StsInternal, "\nERROR: Invalid raster depth" );
-                break;
-            }
+              const RUN& run = runs.runs[i];
+              if ( run.label < 0 ) continue;
+              const int k = run.label - stripe.lo;
+              const int x0 = run.x;
+              const int x1 = runs.runs[i + 1].x;
+              const int n = x1 - x0;
+              count[k] += n;
+              if ( bboxes )
+              {
+                // pixel extent
+                int *box = &boxes[4 * k];
+                box[0] = std::min( box[0], x0 );
+                box[1] = std::min( box[1], y );
+                box[2] = std::max( box[2], x1 );
+                box[3] = std::max( box[3], y + 1 );
+              }
+              if ( shapes )
+              {
+                // closed sums of x and x^2 over the run
+                const double sx = (double) n * x0 + 0.5f * (double) n * ( n - 1 );
+                const double a = x0 - 1, b = x1 - 1;
+                const double sxx = ( b * ( b + 1 ) * ( 2 * b + 1 )
+                                   - a * ( a + 1 ) * ( 2 * a + 1 ) ) / 6.0f;
+                double *m = &mom[k * MOM_COUNT];
+                m[MOM_X] += sx; m[MOM_Y] += (double) n * y;
+                m[MOM_XX] += sxx;
+                m[MOM_YY] += (double) n * y * y;
+                m[MOM_XY] += sx * y;
+              }
           }
       }
-      GDALTermProgress( (float)(y+1) / (float)(klabels.rows), NULL, NULL );
+
+      // summ all pixel intensities
+      std::vector< double >& sum = stripesum[s];
+      sum.assign( nwin * m_bands, 0.0f );
+      for ( size_t r = 0, b = 0; r < raster.size(); b += raster[r].channels(), r++ )
+        BandPass( raster[r], runs, stripe, m_bands, NULL, 0, &sum[b] );
   }
   GDALTermProgress( 1.0f, NULL, NULL );
 
   printf ("       Computing CLASS averaged intensity\n");
   printf ("       ");
-  for (int k = 0; k < labelpixels.rows; k++)
+  std::vector< double > moments;
+  if ( shapes ) moments.assign( m_labels * MOM_COUNT, 0.0f );
+  #pragma omp parallel for schedule(dynamic, 4096)
+  for ( int k = 0; k < m_labels; k++ )
   {
-      #pragma omp parallel for schedule(dynamic)
-      for (int b = 0; b < m_bands; b++)
+      int pixels = 0;
+      std::vector< double > sum( m_bands, 0.0f );
+      int *box = bboxes ? bboxes->ptr<int>(k) : NULL;
+      if ( box )
+      {
+        box[0] = INT_MAX; box[1] = INT_MAX;
+        box[2] = -1;      box[3] = -1;
+      }
+      for ( int s = 0; s < nstripes; s++ )
       {
-          avgCH.at<double>(b,k) = sumCH.at<double>(b,k) / (double) labelpixels.at<u_int32_t>(k);
+          if ( ( k < stripes[s].lo ) || ( k > stripes[s].hi ) ) continue;
+          const int w = k - stripes[s].lo;
+          pixels += stripecount[s][w];
+          if ( box )
+          {
+            const int *sbox = &stripeboxes[s][4 * w];
+            box[0] = std::min( box[0], sbox[0] );
+            box[1] = std::min( box[1], sbox[1] );
+            box[2] = std::max( box[2], sbox[2] );
+            box[3] = std::max( box[3], sbox[3] );
+          }
+          for ( int b = 0; b < m_bands; b++ )
+            sum[b] += stripesum[s][w * m_bands + b];
+          if ( shapes )
+            for ( int m = 0; m < MOM_COUNT; m++ )
+              moments[k * MOM_COUNT + m] += stripemom[s][w * MOM_COUNT + m];
       }
-      GDALTermProgress( (float)(k+1) / (float)(labelpixels.rows), NULL, NULL );
+      labelpixels.at<int>(k) = pixels;
+      if ( pixels == 0 )
+      {
+        // no pixels
+        if ( box ) box[0] = box[1] = box[2] = box[3] = 0;
+        continue;
+      }
+      for ( int b = 0; b < m_bands; b++ )
+        avgCH.at<double>(b,k) = sum[b] / (double) pixels;
   }
+  stripecount.clear();
+  stripeboxes.clear();
+  stripemom.clear();
   GDALTermProgress( 1.0f, NULL, NULL );
 
   printf ("       Computing CLASS standard deviation\n");
   printf ("       ");
-  for (int y = 0; y < klabels.rows; y++)
+  #pragma omp parallel for schedule(static)
+  for ( int s = 0; s < nstripes; s++ )
+  {
+      const STRIPE& stripe = stripes[s];
+      if ( stripe.hi < stripe.lo ) continue;
+      // reuse sums as deviations
+      std::vector< double >& dev = stripesum[s];
+      dev.assign( dev.size(), 0.0f );
+      for ( size_t r = 0, b = 0; r < raster.size(); b += raster[r].channels(), r++ )
+        BandPass( raster[r], runs, stripe, m_bands, avgCH.ptr<double>(b),
+                  avgCH.step1(), &dev[b] );
+  }
+  GDALTermProgress( 1.0f, NULL, NULL );
+
+  printf ("       Normalize CLASS standard deviation\n");
+  printf ("       ");
+  #pragma omp parallel for schedule(dynamic, 4096)
+  for ( int k = 0; k < m_labels; k++ )
   {
-      const int yklabels = y * klabels.cols;
-      for (int x = 0; x < klabels.cols; x++)
+      const int pixels = labelpixels.at<int>(k);
+      if ( pixels == 0 ) continue;
+      for ( int s = 0; s < nstripes; s++ )
       {
-          const int i = yklabels + x;
-          const int k = klabels.at<u_int32_t>(i);
-          #pragma omp parallel for schedule(dynamic)
-          for (int b = 0; b < m_bands; b++)
+          if ( ( k < stripes[s].lo ) || ( k > stripes[s].hi ) ) continue;
+          const int w = k - stripes[s].lo;
+          for ( int b = 0; b < m_bands; b++ )
+            stdCH.at<double>(b,k) += stripesum[s][w * m_bands + b];
+      }
+      for ( int b = 0; b < m_bands; b++ )
+        stdCH.at<double>(b,k) = sqrt( stdCH.at<double>(b,k) / pixels );
+  }
+  GDALTermProgress( 1.0f, NULL, NULL );
+
+  if ( shapes )
+  {
+    printf ("       Computing CLASS shape descriptors\n");
+    printf ("       ");
+    #pragma omp parallel for schedule(static)
+    for ( int k = 0; k < m_labels; k++ )
+    {
+        const double area = labelpixels.at<int>(k);
+        if ( area == 0 ) continue;
+        const double *m = &moments[k * MOM_COUNT];
+        double *shape = shapes->ptr<double>(k);
+        // centroid of pixel centers
+        const double cx = m[MOM_X] / area;
+        const double cy = m[MOM_Y] / area;
+        shape[SHAPE_CX] = cx + 0.5f;
+        shape[SHAPE_CY] = cy + 0.5f;
+        // axes from central second moments
+        const double mxx = m[MOM_XX] / area - cx * cx;
+        const double myy = m[MOM_YY] / area - cy * cy;
+        const double mxy = m[MOM_XY] / area - cx * cy;
+        const double root = sqrt( ( mxx - myy ) * ( mxx - myy ) + 4.0f * mxy * mxy );
+        const double major = 0.5f * ( mxx + myy + root );
+        const double minor = std::max( 0.0, 0.5f * ( mxx + myy - root ) );
+        shape[SHAPE_ELONG] = ( major > 0.0f ) ? 1.0f - sqrt( minor / major ) : 0.0f;
+        // isoperimetric quotient
+        const double perimeter = shape[SHAPE_PERIMETER];
+        if ( perimeter > 0.0f )
+          shape[SHAPE_COMPACT] = 4.0f * CV_PI * area / ( perimeter * perimeter );
+    }
+    GDALTermProgress( 1.0f, NULL, NULL );
+  }
+}
+
+// zonal accumulators
+enum { ZS_SUM = 0, ZS_SQR, ZS_CNT, ZS_COUNT };
+
+// open a statistics raster onto the segmentation grid
+static GDALDataset* OpenStatRaster( const std::string& filename, const GEOREF& georef,
+                                    const int cols, const int rows, const char *Resample,
+                                    GDALDataset*& piSource, int& xoff, int& yoff )
+{
+  piSource = (GDALDataset*) GDALOpen( filename.c_str(), GA_ReadOnly );
+
+  if( piSource == NULL )
+  {
+    printf("\nERROR: Couldn't open dataset %s\n", filename.c_str());
+    exit( 1 );
+  }
+
+  // same grid within a fraction of pixel, maybe
+  // offset by whole pixels when input was cropped
+  xoff = 0; yoff = 0;
+  bool same = true;
+  double gt[6];
+  if ( piSource->GetGeoTransform( gt ) == CE_None )
+  {
+    const double *t = georef.transform;
+    const double eps = 1e-3f * fabs( t[1] );
+    for ( int i = 1; i < 6; i++ )
+      same = same && ( i == 3 || fabs( gt[i] - t[i] ) <= eps );
+    if ( same && ( t[2] == 0.0f ) && ( t[4] == 0.0f ) )
+    {
+      const double dx = ( t[0] - gt[0] ) / gt[1];
+      const double dy = ( t[3] - gt[3] ) / gt[5];
+      xoff = (int) floor( dx + 0.5f );
+      yoff = (int) floor( dy + 0.5f );
+      same = ( fabs( dx - xoff ) <= 1e-3f ) && ( fabs( dy - yoff ) <= 1e-3f );
+    }
+    else
+      same = same && ( fabs( gt[0] - t[0] ) <= eps ) && ( fabs( gt[3] - t[3] ) <= eps );
+  }
+  same = same && ( xoff >= 0 ) && ( yoff >= 0 )
+       && ( xoff + cols <= piSource->GetRasterXSize() )
+       && ( yoff + rows <= piSource->GetRasterYSize() );
+  const std::string wkt = piSource->GetProjectionRef();
+  if ( !wkt.empty() && !georef.projection.empty() )
+    same = same && ( wkt == georef.projection );
+
+  if ( same )
+    return piSource;
+
+  xoff = 0; yoff = 0;
+#if GDALVER >= 2
+  const double *t = georef.transform;
+  if ( ( t[2] != 0.0f ) || ( t[4] != 0.0f ) )
+  {
+    printf("\nERROR: Cannot resample %s onto a rotated grid.\n", filename.c_str());
+    exit( 1 );
+  }
+
+  // virtual warp onto segmentation grid
+  char **papszArgv = NULL;
+  char value[64];
+  papszArgv = CSLAddString( papszArgv, "-of" );
+  papszArgv = CSLAddString( papszArgv, "VRT" );
+  papszArgv = CSLAddString( papszArgv, "-r" );
+  papszArgv = CSLAddString( papszArgv, Resample );
+  papszArgv = CSLAddString( papszArgv, "-ot" );
+  papszArgv = CSLAddString( papszArgv, "Float64" );
+  papszArgv = CSLAddString( papszArgv, "-dstnodata" );
+  papszArgv = CSLAddString( papszArgv, "nan" );
+  papszArgv = CSLAddString( papszArgv, "-ts" );
+  snprintf( value, sizeof( value ), "%i", cols );
+  papszArgv = CSLAddString( papszArgv, value );
+  snprintf( value, sizeof( value ), "%i", rows );
+  papszArgv = CSLAddString( papszArgv, value );
+  papszArgv = CSLAddString( papszArgv, "-te" );
+  const double te[4] = { t[0], std::min( t[3], t[3] + rows * t[5] ),
+                         t[0] + cols * t[1], std::max( t[3], t[3] + rows * t[5] ) };
+  for ( int i = 0; i < 4; i++ )
+  {
+    snprintf( value, sizeof( value ), "%.17g", te[i] );
+    papszArgv = CSLAddString( papszArgv, value );
+  }
+  if ( !georef.projection.empty() && !wkt.empty() )
+  {
+    papszArgv = CSLAddString( papszArgv, "-t_srs" );
+    papszArgv = CSLAddString( papszArgv, georef.projection.c_str() );
+  }
+
+  GDALWarpAppOptions *psOptions = GDALWarpAppOptionsNew( papszArgv, NULL );
+  CSLDestroy( papszArgv );
+  if ( psOptions == NULL )
+  {
+    printf("\nERROR: Invalid resampling method [%s].\n", Resample);
+    exit( 1 );
+  }
+
+  int bUsageError = FALSE;
+  GDALDatasetH hSource = (GDALDatasetH) piSource;
+  GDALDatasetH hWarped = GDALWarp( "", NULL, 1, &hSource, psOptions, &bUsageError );
+  GDALWarpAppOptionsFree( psOptions );
+
+  if ( ( hWarped == NULL ) || bUsageError )
+  {
+    printf("\nERROR: Couldn't resample %s onto segmentation grid.\n", filename.c_str());
+    exit( 1 );
+  }
+  printf ("  Resample [%s] onto (%i Pixels x %i Lines) grid\n", Resample, cols, rows);
+
+  return (GDALDataset*) hWarped;
+#else
+  printf("\nERROR: %s differs from segmentation grid, resampling needs GDAL >= 2.\n",
+         filename.c_str());
+  exit( 1 );
+#endif
+}
+
+void ComputeZonalStats( const cv::Mat klabels, const GEOREF& georef,
+                        const std::vector< std::string > StatFilenames,
+                        const char *Resample, const size_t m_labels,
+                        std::vector< std::string >& names,
+                        cv::Mat& avgZS, cv::Mat& stdZS,
+                        const double window )
+{
+  const int cols = klabels.cols;
+  const int rows = klabels.rows;
+
+  names.clear();
+  // per band accumulators and shift against cancellation
+  std::vector< std::vector< double > > acc;
+  std::vector< double > shift;
+
+  printf ("Compute Zonal Statistics\n");
+  for ( size_t r = 0; r < StatFilenames.size(); r++ )
+  {
+    int xoff, yoff;
+    GDALDataset *piSource;
+    GDALDataset *piDataset = OpenStatRaster( StatFilenames[r], georef, cols, rows,
+                                             Resample, piSource, xoff, yoff );
+
+    const int nBands = piDataset->GetRasterCount();
+    printf ("  Stat Raster #%lu: %s [%i] bands\n", r+1, StatFilenames[r].c_str(), nBands);
+    printf ("  ");
+
+    std::vector< int > hasnodata( nBands, FALSE );
+    std::vector< double > nodata( nBands, 0.0f );
+    for ( int b = 0; b < nBands; b++ )
+      nodata[b] = piDataset->GetRasterBand(b+1)->GetNoDataValue( &hasnodata[b] );
+
+    // whole block rows per read, planned window bounds the buffer
+    int nXBlockSize, nYBlockSize;
+    piDataset->GetRasterBand(1)->GetBlockSize( &nXBlockSize, &nYBlockSize );
+    int lines = 256;
+    if ( window > 0.0f )
+      lines = (int) std::min( (double) rows, window / ( sizeof( double ) * nBands * cols ) );
+    const int chunk = nYBlockSize * std::max( 1, lines / nYBlockSize );
+    cv::Mat buffer( chunk * nBands, cols, CV_64F );
+
+    const size_t first = acc.size();
+    acc.resize( first + nBands );
+    shift.resize( first + nBands, NAN );
+    for ( int b = 0; b < nBands; b++ )
+      acc[first + b].assign( m_labels * ZS_COUNT, 0.0f );
+
+    for ( int y0 = 0; y0 < rows; y0 += chunk )
+    {
+      const int nrows = std::min( chunk, rows - y0 );
+
+      CPLErr error = piDataset->RasterIO( GF_Read, xoff, yoff + y0, cols, nrows, buffer.data,
+                                          cols, nrows, GDT_Float64, nBands, NULL,
+                                          sizeof( double ), sizeof( double ) * cols,
+                                          sizeof( double ) * cols * nrows );
+      if ( error != CE_None )
+      {
+        printf("\nERROR: RasterIO() on %s\n", StatFilenames[r].c_str());
+        exit( 1 );
+      }
+
+      // label window of the chunk
+      int lo = INT_MAX, hi = -1;
+      #pragma omp parallel for schedule(static) reduction(min:lo) reduction(max:hi)
+      for ( int y = 0; y < nrows; y++ )
+      {
+        const int *label = klabels.ptr<int>( y0 + y );
+        for ( int x = 0; x < cols; x++ )
+        {
+          if ( label[x] < 0 ) continue;
+          lo = std::min( lo, label[x] );
+          hi = std::max( hi, label[x] );
+        }
+      }
+      if ( hi < lo ) continue;
+      const int nwin = hi - lo + 1;
+
+      // first valid value as shift
+      for ( int b = 0; b < nBands; b++ )
+      {
+        if ( !std::isnan( shift[first + b] ) ) continue;
+        for ( int i = 0; i < nrows * cols; i++ )
+        {
+          const double v = buffer.ptr<double>( b * nrows )[i];
+          if ( std::isnan( v ) || ( hasnodata[b] && ( v == nodata[b] ) ) ) continue;
+          shift[first + b] = v;
+          break;
+        }
+      }
+
+      #pragma omp parallel
+      {
+        std::vector< double > local( nwin * nBands * ZS_COUNT, 0.0f );
+        #pragma omp for schedule(static)
+        for ( int y = 0; y < nrows; y++ )
+        {
+          const int *label = klabels.ptr<int>( y0 + y );
+          for ( int b = 0; b < nBands; b++ )
           {
-            switch ( raster[b].depth() )
+            const double *pixel = buffer.ptr<double>( b * nrows + y );
+            const double s = std::isnan( shift[first + b] ) ? 0.0f : shift[first + b];
+            for ( int x = 0; x < cols; x++ )
             {
-              case CV_8U:
-                stdCH.at<double>(b,k) += pow( (double) raster[b].at<uchar>(i)
-                             - avgCH.at<double>(b,klabels.at<u_int32_t>(i)), 2 );
-                break;
-              case CV_8S:
-                stdCH.at<double>(b,k) += pow( (double) raster[b].at<char>(i)
-                             - avgCH.at<double>(b,klabels.at<u_int32_t>(i)), 2 );
-                break;
-              case CV_16U:
-                stdCH.at<double>(b,k) += pow( (double) raster[b].at<ushort>(i)
-                             - avgCH.at<double>(b,klabels.at<u_int32_t>(i)), 2 );
-                break;
-              case CV_16S:
-                stdCH.at<double>(b,k) += pow( (double) raster[b].at<short>(i)
-                             - avgCH.at<double>(b,klabels.at<u_int32_t>(i)), 2 );
-                break;
-              case CV_32S:
-                stdCH.at<double>(b,k) += pow( (double) raster[b].at<u_int32_t>(i)
-                             - avgCH.at<double>(b,klabels.at<u_int32_t>(i)), 2 );
-                break;
-              case CV_32F:
-                stdCH.at<double>(b,k) += pow( (double) raster[b].at<float>(i)
-                             - avgCH.at<double>(b,klabels.at<u_int32_t>(i)), 2 );
-                break;
-              case CV_64F:
-                stdCH.at<double>(b,k) += pow( (double) raster[b].at<double>(i)
-                             - avgCH.at<double>(b,klabels.at<u_int32_t>(i)), 2 );
-                break;
-              default:
-                CV_Error( Error::StsInternal, "\nERROR: Invalid raster depth" );
-                break;
+              if ( label[x] < 0 ) continue;
+              const double v = pixel[x];
+              if ( std::isnan( v ) || ( hasnodata[b] && ( v == nodata[b] ) ) ) continue;
+              double *a = &local[ ( ( label[x] - lo ) * nBands + b ) * ZS_COUNT ];
+              a[ZS_SUM] += v - s;
+              a[ZS_SQR] += ( v - s ) * ( v - s );
+              a[ZS_CNT] += 1.0f;
             }
           }
+        }
+        #pragma omp critical
+        for ( int w = 0; w < nwin; w++ )
+          for ( int b = 0; b < nBands; b++ )
+            for ( int a = 0; a < ZS_COUNT; a++ )
+              acc[first + b][ ( lo + w ) * ZS_COUNT + a ]
+                += local[ ( w * nBands + b ) * ZS_COUNT + a ];
       }
-      GDALTermProgress( (float)(y+1) / (float)(klabels.rows), NULL, NULL );
+      GDALTermProgress( (float)(y0 + nrows) / (float)rows, NULL, NULL );
+    }
+    GDALTermProgress( 1.0f, NULL, NULL );
+
+    if ( piDataset != piSource )
+      GDALClose( (GDALDatasetH) piDataset );
+    GDALClose( (GDALDatasetH) piSource );
+
+    for ( int b = 0; b < nBands; b++ )
+    {
+      std::stringstream value; value << "S" << r+1 << "B" << b+1;
+      names.push_back( value.str() );
+    }
   }
-  GDALTermProgress( 1.0f, NULL, NULL );
 
-  printf ("       Normalize CLASS standard deviation\n");
+  // finalize averages, unseen labels stay nan
+  const int nzs = (int) acc.size();
+  avgZS.create( nzs, m_labels, CV_64F );
+  stdZS.create( nzs, m_labels, CV_64F );
+  avgZS = Scalar::all( NAN );
+  stdZS = Scalar::all( NAN );
+  for ( int z = 0; z < nzs; z++ )
+  {
+    #pragma omp parallel for schedule(static)
+    for ( int k = 0; k < (int) m_labels; k++ )
+    {
+      const double *a = &acc[z][k * ZS_COUNT];
+      if ( a[ZS_CNT] == 0.0f ) continue;
+      const double mean = a[ZS_SUM] / a[ZS_CNT];
+      avgZS.at<double>(z,k) = shift[z] + mean;
+      stdZS.at<double>(z,k) = sqrt( std::max( 0.0, a[ZS_SQR] / a[ZS_CNT] - mean * mean ) );
+    }
+  }
+}
+
+void LoadLabels( const char *InitFilename, const GEOREF& georef,
+                 const int cols, const int rows, cv::Mat& initlabels )
+{
+  // labels never interpolate
+  int xoff, yoff;
+  GDALDataset *piSource;
+  GDALDataset *piDataset = OpenStatRaster( InitFilename, georef, cols, rows,
+                                           "near", piSource, xoff, yoff );
+
+  printf ("Load Labels: %s\n", InitFilename);
   printf ("       ");
 
-  for (int k = 0; k < labelpixels.rows; k++)
+  GDALRasterBand *piBand = piDataset->GetRasterBand( 1 );
+  int hasnodata = FALSE;
+  const double nodata = piBand->GetNoDataValue( &hasnodata );
+
+  initlabels.create( rows, cols, CV_32S );
+
+  // whole block rows per read
+  int nXBlockSize, nYBlockSize;
+  piBand->GetBlockSize( &nXBlockSize, &nYBlockSize );
+  const int chunk = nYBlockSize * std::max( 1, 256 / nYBlockSize );
+  cv::Mat buffer( chunk, cols, CV_64F );
+
+  for ( int y0 = 0; y0 < rows; y0 += chunk )
   {
-      #pragma omp parallel for schedule(dynamic)
-      for (int b = 0; b < m_bands; b++)
+    const int nrows = std::min( chunk, rows - y0 );
+    CPLErr error = piBand->RasterIO( GF_Read, xoff, yoff + y0, cols, nrows, buffer.data,
+                                     cols, nrows, GDT_Float64, 0, 0 );
+    if ( error != CE_None )
+    {
+      printf("\nERROR: RasterIO() on %s\n", InitFilename);
+      exit( 1 );
+    }
+
+    // nodata and negative values label nothing
+    #pragma omp parallel for schedule(static)
+    for ( int y = 0; y < nrows; y++ )
+    {
+      const double *value = buffer.ptr<double>( y );
+      int *label = initlabels.ptr<int>( y0 + y );
+      for ( int x = 0; x < cols; x++ )
       {
-          stdCH.at<double>(b,k) = sqrt(stdCH.at<double>(b,k) / labelpixels.at<u_int32_t>(k));
+        const double v = value[x];
+        if ( std::isnan( v ) || ( hasnodata && ( v == nodata ) )
+          || ( v < 0.0f ) || ( v > INT_MAX ) )
+          label[x] = -1;
+        else
+          label[x] = (int) v;
       }
-      GDALTermProgress( (float)(k+1) / (float)(labelpixels.rows), NULL, NULL );
+    }
+    GDALTermProgress( (float)(y0 + nrows) / (float)rows, NULL, NULL );
   }
   GDALTermProgress( 1.0f, NULL, NULL );
 
+  if ( piDataset != piSource )
+    GDALClose( (GDALDatasetH) piDataset );
+  GDALClose( (GDALDatasetH) piSource );
 }
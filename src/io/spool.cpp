@@ -0,0 +1,313 @@
+/*
+ *  Copyright (c) 2015  Balint Cristian (cristian.balint@gmail.com)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+/* spool.cpp */
+/* Job spool directory service */
+
+#include <omp.h>
+#include <string.h>
+#include <map>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "gdal.h"
+#include "gdal_priv.h"
+#include "gdal_version.h"
+#include "cpl_conv.h"
+#include "cpl_string.h"
+#include "cpl_vsi.h"
+#if GDAL_VERSION_NUM >= GDAL_COMPUTE_VERSION(2,3,0)
+#include "cpl_json.h"
+#endif
+
+#include <opencv2/opencv.hpp>
+
+#include "gdal-segment.hpp"
+
+using namespace std;
+
+
+#if ( GDAL_VERSION_NUM >= GDAL_COMPUTE_VERSION(2,3,0) ) && !defined(_WIN32)
+
+// one claimed job file
+typedef struct SPOOLJOB {
+  std::string name;    // job name, file without .json
+  double memory;       // estimated bytes
+  int64 start;         // tick count at fork
+} SPOOLJOB;
+
+// scalar job value as one argument
+static bool JobValue( const CPLJSONObject& item, std::string& value )
+{
+  switch ( item.GetType() )
+  {
+    case CPLJSONObject::Type::Integer:
+      value = CPLSPrintf( "%i", item.ToInteger() );
+      return true;
+    case CPLJSONObject::Type::Long:
+    case CPLJSONObject::Type::Double:
+      value = CPLSPrintf( "%.17g", item.ToDouble() );
+      return true;
+    case CPLJSONObject::Type::String:
+      value = item.ToString( "" );
+      return true;
+    default:
+      return false;
+  }
+}
+
+// job keys become options, inputs stay positional, NULL if a key
+// would override the service's core split or memory budget; an
+// array is one option with all its values, arrays of arrays repeat it
+static char** JobArguments( CPLJSONObject root )
+{
+  char **args = CSLAddString( NULL, "gdal-segment" );
+  const std::vector< CPLJSONObject > items = root.GetChildren();
+  for ( size_t i = 0; i < items.size(); i++ )
+  {
+    const std::string key = items[i].GetName();
+    const std::string option = "-" + key;
+    const bool positional = ( key == "inputs" );
+    // thread count and budget belong to the service
+    if ( EQUAL( key.c_str(), "threads" ) || EQUAL( key.c_str(), "mem" ) )
+    {
+      printf( "Spool: job key \"%s\" is set by the service (-workers, -spoolmem)\n",
+              key.c_str() );
+      CSLDestroy( args );
+      return NULL;
+    }
+
+    // flags carry no value
+    if ( items[i].GetType() == CPLJSONObject::Type::Boolean )
+    {
+      if ( items[i].ToBool() && !positional )
+        args = CSLAddString( args, option.c_str() );
+      continue;
+    }
+
+    // occurrences of the option, each with its values
+    std::vector< std::vector< CPLJSONObject > > uses;
+    if ( items[i].GetType() != CPLJSONObject::Type::Array )
+      uses.push_back( std::vector< CPLJSONObject >( 1, items[i] ) );
+    else
+    {
+      const std::vector< CPLJSONObject > values = items[i].GetChildren();
+      if ( !values.empty() && ( values[0].GetType() == CPLJSONObject::Type::Array ) )
+        for ( size_t u = 0; u < values.size(); u++ )
+          uses.push_back( values[u].GetChildren() );
+      else
+        uses.push_back( values );
+    }
+
+    for ( size_t u = 0; u < uses.size(); u++ )
+    {
+      if ( !positional )
+        args = CSLAddString( args, option.c_str() );
+      for ( size_t v = 0; v < uses[u].size(); v++ )
+      {
+        std::string value;
+        if ( JobValue( uses[u][v], value ) )
+          args = CSLAddString( args, value.c_str() );
+      }
+    }
+  }
+  return args;
+}
+
+// raster plus label and work buffers of all inputs
+static double JobMemory( CPLJSONObject root )
+{
+  double bytes = 0.0f, grid = 0.0f;
+  const std::vector< CPLJSONObject > inputs = root.GetArray( "inputs" ).GetChildren();
+  for ( size_t i = 0; i < inputs.size(); i++ )
+  {
+    GDALDataset *piDataset = (GDALDataset*) GDALOpen( inputs[i].ToString( "" ).c_str(), GA_ReadOnly );
+    if ( piDataset == NULL ) continue;
+    const double pixels = (double) piDataset->GetRasterXSize() * piDataset->GetRasterYSize();
+    double pixbytes = 0.0f;
+    for ( int b = 0; b < piDataset->GetRasterCount(); b++ )
+      pixbytes += GDALGetDataTypeSizeBytes( piDataset->GetRasterBand(b+1)->GetRasterDataType() );
+    bytes += pixels * pixbytes;
+    grid = std::max( grid, pixels );
+    GDALClose( (GDALDatasetH) piDataset );
+  }
+  // labels, distances and masks on the finest grid
+  return bytes + grid * 16.0f;
+}
+
+// record outcome next to the job file
+static void JobResult( const std::string& dir, const SPOOLJOB& job,
+                       const int code, const double seconds )
+{
+  CPLJSONDocument doc;
+  CPLJSONObject root = doc.GetRoot();
+  root.Add( "job", job.name );
+  root.Add( "status", std::string( code == 0 ? "done" : "failed" ) );
+  root.Add( "code", code );
+  root.Add( "seconds", seconds );
+  const std::string base = CPLFormFilename( dir.c_str(), job.name.c_str(), NULL );
+  doc.Save( base + ".result.json.tmp" );
+  // readers only ever see complete results
+  VSIRename( ( base + ".result.json.tmp" ).c_str(), ( base + ".result.json" ).c_str() );
+  VSIUnlink( ( base + ".json.run" ).c_str() );
+}
+
+// exit code of a finished job, signals as 128 + number like shells
+static int JobCode( const int status )
+{
+  if ( WIFEXITED( status ) ) return WEXITSTATUS( status );
+  if ( WIFSIGNALED( status ) ) return 128 + WTERMSIG( status );
+  return 1;
+}
+
+// collect finished jobs, blocking until one ends if asked
+static void ReapJobs( const std::string& dir, std::map< pid_t, SPOOLJOB >& running,
+                      double& inflight, const bool block )
+{
+  int status;
+  pid_t pid;
+  while ( !running.empty()
+       && ( ( pid = waitpid( -1, &status, block ? 0 : WNOHANG ) ) > 0 ) )
+  {
+    std::map< pid_t, SPOOLJOB >::iterator it = running.find( pid );
+    if ( it == running.end() ) continue;
+    const SPOOLJOB& job = it->second;
+    const int code = JobCode( status );
+    const double seconds = ( cv::getTickCount() - job.start ) / cv::getTickFrequency();
+    JobResult( dir, job, code, seconds );
+    printf( "Spool: job %s %s (%.6f sec)\n", job.name.c_str(),
+            code == 0 ? "done" : "failed", seconds );
+    inflight -= job.memory;
+    running.erase( it );
+    if ( block ) break;
+  }
+}
+
+int RunSpool( const char *SpoolDir, const int workers, const double memlimit )
+{
+  VSIStatBufL sStat;
+  if ( VSIStatL( SpoolDir, &sStat ) != 0 )
+  {
+    printf( "\nERROR: Spool directory %s does not exist.\n", SpoolDir );
+    return 1;
+  }
+
+  const std::string dir = SpoolDir;
+  std::map< pid_t, SPOOLJOB > running;
+  double inflight = 0.0f;
+
+  // split cores among workers
+  const int threads = std::max( 1, omp_get_max_threads() / workers );
+
+  printf( "Spool: serving %s with %i workers of %i threads", SpoolDir, workers, threads );
+  if ( memlimit > 0.0f )
+    printf( ", %.0f MB budget", memlimit / ( 1024.0f * 1024.0f ) );
+  printf( "\nSpool: drop <name>.json jobs, a STOP file ends the service\n\n" );
+
+  const std::string stopfile = CPLFormFilename( SpoolDir, "STOP", NULL );
+  while ( VSIStatL( stopfile.c_str(), &sStat ) != 0 )
+  {
+    ReapJobs( dir, running, inflight, false );
+
+    // oldest first by name
+    char **files = VSIReadDir( SpoolDir );
+    std::vector< std::string > names;
+    for ( int f = 0; files && files[f]; f++ )
+    {
+      const std::string file = files[f];
+      if ( ( file.size() > 5 ) && ( file.compare( file.size() - 5, 5, ".json" ) == 0 )
+        && ( file.find( ".result.json" ) == std::string::npos ) )
+        names.push_back( file.substr( 0, file.size() - 5 ) );
+    }
+    CSLDestroy( files );
+    std::sort( names.begin(), names.end() );
+
+    for ( size_t n = 0; ( n < names.size() ) && ( (int) running.size() < workers ); n++ )
+    {
+      SPOOLJOB job;
+      job.name = names[n];
+      const std::string base = CPLFormFilename( SpoolDir, job.name.c_str(), NULL );
+
+      // wait for budget before claiming, oversized jobs run alone
+      CPLJSONDocument doc;
+      if ( !doc.Load( base + ".json" ) )
+        job.memory = 0.0f;
+      else
+        job.memory = JobMemory( doc.GetRoot() );
+      if ( ( memlimit > 0.0f ) && !running.empty()
+        && ( inflight + job.memory > memlimit ) )
+        break;
+
+      // claim by rename, other spoolers skip it
+      if ( VSIRename( ( base + ".json" ).c_str(), ( base + ".json.run" ).c_str() ) != 0 )
+        continue;
+
+      char **args = NULL;
+      if ( doc.Load( base + ".json.run" ) )
+        args = JobArguments( doc.GetRoot() );
+      if ( args == NULL )
+      {
+        printf( "Spool: invalid job %s\n", job.name.c_str() );
+        JobResult( dir, job, 1, 0.0f );
+        continue;
+      }
+      args = CSLAddString( args, "-threads" );
+      args = CSLAddString( args, CPLSPrintf( "%i", threads ) );
+
+      // own process, an exit or crash ends only this job
+      printf( "Spool: start job %s\n", job.name.c_str() );
+      fflush( stdout );
+      job.start = cv::getTickCount();
+      const pid_t pid = fork();
+      if ( pid == 0 )
+      {
+        // error paths inside exit() the same way
+        exit( Segment( CSLCount( args ), args ) );
+      }
+      CSLDestroy( args );
+      if ( pid < 0 )
+      {
+        printf( "Spool: cannot start job %s\n", job.name.c_str() );
+        JobResult( dir, job, 1, 0.0f );
+        continue;
+      }
+      inflight += job.memory;
+      running[pid] = job;
+    }
+
+    std::this_thread::sleep_for( std::chrono::milliseconds( 500 ) );
+  }
+
+  // drain started jobs
+  while ( !running.empty() )
+    ReapJobs( dir, running, inflight, true );
+
+  printf( "Spool: stopped.\n" );
+  return 0;
+}
+
+#else
+
+int RunSpool( const char *SpoolDir, const int workers, const double memlimit )
+{
+  printf( "\nERROR: Spool service needs GDAL >= 2.3 (JSON support) and fork().\n" );
+  return 1;
+}
+
+#endif
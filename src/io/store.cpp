@@ -0,0 +1,328 @@
+/*
+ *  Copyright (c) 2015  Balint Cristian (cristian.balint@gmail.com)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+/* store.cpp */
+/* Label store and segment extraction */
+
+#include <cfloat>
+#include <cstring>
+#include <algorithm>
+
+#include "gdal.h"
+#include "gdal_priv.h"
+#include "cpl_string.h"
+#include "cpl_vsi.h"
+
+#include <opencv2/opencv.hpp>
+
+#include "gdal-segment.hpp"
+
+using namespace std;
+using namespace cv;
+
+
+// label raster tiles
+static const int STORE_TILE = 256;
+
+// index header, fixed size records follow
+typedef struct STOREHEAD {
+  char magic[4];  // LBX1
+  int labels;
+  int bands;
+} STOREHEAD;
+
+// index record columns, band averages and deviations follow
+enum { REC_ID = 0, REC_MINX, REC_MINY, REC_MAXX, REC_MAXY, REC_PIXELS, REC_COUNT };
+
+void SaveLabelStore( const char *StoreFilename, const GEOREF& georef,
+                     const cv::Mat klabels, const cv::Mat labelpixels,
+                     const std::vector< int >& labelids,
+                     const cv::Mat avgCH, const cv::Mat stdCH, const cv::Mat bboxes )
+{
+  const int cols = klabels.cols;
+  const int rows = klabels.rows;
+  const int m_labels = labelpixels.rows;
+  const int m_bands = avgCH.rows;
+
+  GDALDriver *poDriver = GetGDALDriverManager()->GetDriverByName( "GTiff" );
+  if ( poDriver == NULL )
+  {
+    printf( "\nERROR: GTiff driver not available.\n" );
+    exit( 1 );
+  }
+
+  // square tiles, extraction reads only covering ones
+  char **papszOptions = NULL;
+  papszOptions = CSLSetNameValue( papszOptions, "TILED", "YES" );
+  papszOptions = CSLSetNameValue( papszOptions, "BLOCKXSIZE", CPLSPrintf( "%i", STORE_TILE ) );
+  papszOptions = CSLSetNameValue( papszOptions, "BLOCKYSIZE", CPLSPrintf( "%i", STORE_TILE ) );
+  papszOptions = CSLSetNameValue( papszOptions, "COMPRESS", "DEFLATE" );
+  papszOptions = CSLSetNameValue( papszOptions, "PREDICTOR", "2" );
+  papszOptions = CSLSetNameValue( papszOptions, "BIGTIFF", "IF_SAFER" );
+  GDALDataset *poDS = poDriver->Create( StoreFilename, cols, rows, 1, GDT_Int32, papszOptions );
+  CSLDestroy( papszOptions );
+  if ( poDS == NULL )
+  {
+    printf( "\nERROR: Creation of %s failed.\n", StoreFilename );
+    exit( 1 );
+  }
+  double transform[6];
+  std::copy( georef.transform, georef.transform + 6, transform );
+  poDS->SetGeoTransform( transform );
+  if ( !georef.projection.empty() )
+    poDS->SetProjection( georef.projection.c_str() );
+
+  printf ("Write File: %s (label store)\n", StoreFilename);
+  printf ("       ");
+  GDALRasterBand *poBand = poDS->GetRasterBand( 1 );
+  poBand->SetNoDataValue( -1 );
+  // one tile row per write
+  for ( int y0 = 0; y0 < rows; y0 += STORE_TILE )
+  {
+    const int nrows = std::min( STORE_TILE, rows - y0 );
+    cv::Mat part = klabels.rowRange( y0, y0 + nrows );
+    if ( !part.isContinuous() ) part = part.clone();
+    CPLErr error = poBand->RasterIO( GF_Write, 0, y0, cols, nrows, part.data,
+                                     cols, nrows, GDT_Int32, 0, 0 );
+    if ( error != CE_None )
+    {
+      printf( "\nERROR: RasterIO() on %s\n", StoreFilename );
+      exit( 1 );
+    }
+    GDALTermProgress( (float)(y0 + nrows) / (float)rows, NULL, NULL );
+  }
+  GDALTermProgress( 1.0f, NULL, NULL );
+  GDALClose( (GDALDatasetH) poDS );
+
+  // per label extent, area and stats row
+  const std::string index = CPLResetExtension( StoreFilename, "lbx" );
+  VSILFILE *fp = VSIFOpenL( index.c_str(), "wb" );
+  if ( fp == NULL )
+  {
+    printf( "\nERROR: Cannot write %s\n", index.c_str() );
+    exit( 1 );
+  }
+  STOREHEAD head;
+  memcpy( head.magic, "LBX1", 4 );
+  head.labels = m_labels;
+  head.bands = m_bands;
+  VSIFWriteL( &head, sizeof( STOREHEAD ), 1, fp );
+  std::vector< int > rec( REC_COUNT );
+  std::vector< double > values( 2 * m_bands );
+  for ( int k = 0; k < m_labels; k++ )
+  {
+    const int *box = bboxes.ptr<int>(k);
+    rec[REC_ID] = labelids.empty() ? k : labelids[k];
+    rec[REC_MINX] = box[0]; rec[REC_MINY] = box[1];
+    rec[REC_MAXX] = box[2]; rec[REC_MAXY] = box[3];
+    rec[REC_PIXELS] = labelpixels.at<int>(k);
+    for ( int b = 0; b < m_bands; b++ )
+    {
+      values[b] = avgCH.at<double>(b, k);
+      values[m_bands + b] = stdCH.at<double>(b, k);
+    }
+    VSIFWriteL( &rec[0], sizeof( int ), REC_COUNT, fp );
+    if ( m_bands > 0 )
+      VSIFWriteL( &values[0], sizeof( double ), 2 * m_bands, fp );
+  }
+  VSIFCloseL( fp );
+  printf ("Write File: %s (%i labels)\n", index.c_str(), m_labels);
+}
+
+// unit edges of one label inside its box, label on right
+static void LabelEdges( const cv::Mat window, const int k, const int x0, const int y0,
+                        std::vector< LINE >& lines )
+{
+  const int cols = window.cols;
+  const int rows = window.rows;
+  for ( int y = 0; y < rows; y++ )
+  {
+    const int *label = window.ptr<int>(y);
+    const int *above = ( y > 0 ) ? window.ptr<int>(y - 1) : NULL;
+    const int *below = ( y < rows - 1 ) ? window.ptr<int>(y + 1) : NULL;
+    for ( int x = 0; x < cols; x++ )
+    {
+      if ( label[x] != k ) continue;
+      const unsigned int gx = x0 + x, gy = y0 + y;
+      LINE line;
+      if ( ( x == cols - 1 ) || ( label[x + 1] != k ) )
+      {
+        line.sX = gx + 1; line.sY = gy; line.eX = gx + 1; line.eY = gy + 1;
+        lines.push_back( line );
+      }
+      if ( ( x == 0 ) || ( label[x - 1] != k ) )
+      {
+        line.sX = gx; line.sY = gy + 1; line.eX = gx; line.eY = gy;
+        lines.push_back( line );
+      }
+      if ( !above || ( above[x] != k ) )
+      {
+        line.sX = gx; line.sY = gy; line.eX = gx + 1; line.eY = gy;
+        lines.push_back( line );
+      }
+      if ( !below || ( below[x] != k ) )
+      {
+        line.sX = gx + 1; line.sY = gy + 1; line.eX = gx; line.eY = gy + 1;
+        lines.push_back( line );
+      }
+    }
+  }
+}
+
+int ExtractSegments( const char *StoreFilename, const char *mode, const char *list,
+                     const char *OutFilename, const char *OutFormat,
+                     const VECTOROPTS& opts )
+{
+  // index
+  const std::string index = CPLResetExtension( StoreFilename, "lbx" );
+  VSILFILE *fp = VSIFOpenL( index.c_str(), "rb" );
+  STOREHEAD head;
+  if ( ( fp == NULL ) || ( VSIFReadL( &head, sizeof( STOREHEAD ), 1, fp ) != 1 )
+    || ( memcmp( head.magic, "LBX1", 4 ) != 0 ) || ( head.labels < 0 ) || ( head.bands < 0 ) )
+  {
+    printf( "\nERROR: Invalid label store index %s\n", index.c_str() );
+    if ( fp ) VSIFCloseL( fp );
+    return 1;
+  }
+  const int m_labels = head.labels;
+  const int m_bands = head.bands;
+
+  std::vector< int > labelids( m_labels );
+  cv::Mat labelpixels( m_labels, 1, CV_32S );
+  cv::Mat bboxes( m_labels, 4, CV_32S );
+  cv::Mat avgCH( m_bands, m_labels, CV_64F );
+  cv::Mat stdCH( m_bands, m_labels, CV_64F );
+  std::vector< int > rec( REC_COUNT );
+  std::vector< double > values( 2 * m_bands + 1 );
+  for ( int k = 0; k < m_labels; k++ )
+  {
+    if ( ( VSIFReadL( &rec[0], sizeof( int ), REC_COUNT, fp ) != (size_t) REC_COUNT )
+      || ( VSIFReadL( &values[0], sizeof( double ), 2 * m_bands, fp ) != (size_t) ( 2 * m_bands ) ) )
+    {
+      printf( "\nERROR: Truncated label store index %s\n", index.c_str() );
+      VSIFCloseL( fp );
+      return 1;
+    }
+    labelids[k] = rec[REC_ID];
+    int *box = bboxes.ptr<int>(k);
+    box[0] = rec[REC_MINX]; box[1] = rec[REC_MINY];
+    box[2] = rec[REC_MAXX]; box[3] = rec[REC_MAXY];
+    labelpixels.at<int>(k) = rec[REC_PIXELS];
+    for ( int b = 0; b < m_bands; b++ )
+    {
+      avgCH.at<double>(b, k) = values[b];
+      stdCH.at<double>(b, k) = values[m_bands + b];
+    }
+  }
+  VSIFCloseL( fp );
+
+  // label raster
+  GDALDataset *piDataset = (GDALDataset *) GDALOpen( StoreFilename, GA_ReadOnly );
+  if ( piDataset == NULL )
+  {
+    printf( "\nERROR: Cannot open label store %s\n", StoreFilename );
+    return 1;
+  }
+  GEOREF georef;
+  if ( piDataset->GetGeoTransform( georef.transform ) != CE_None )
+  {
+    georef.transform[0] = 0.0f; georef.transform[1] = 1.0f; georef.transform[2] = 0.0f;
+    georef.transform[3] = 0.0f; georef.transform[4] = 0.0f; georef.transform[5] = 1.0f;
+  }
+  georef.projection = piDataset->GetProjectionRef();
+  GDALRasterBand *piBand = piDataset->GetRasterBand( 1 );
+
+  // requested labels
+  std::vector< int > selected;
+  char **items = CSLTokenizeString2( list, ",", 0 );
+  if ( EQUAL( mode, "ids" ) )
+  {
+    std::vector< int > wanted;
+    for ( int i = 0; items && items[i] != NULL; i++ )
+      wanted.push_back( atoi( items[i] ) );
+    std::sort( wanted.begin(), wanted.end() );
+    for ( int k = 0; k < m_labels; k++ )
+      if ( std::binary_search( wanted.begin(), wanted.end(), labelids[k] ) )
+        selected.push_back( k );
+  }
+  else if ( EQUAL( mode, "bbox" ) && ( CSLCount( items ) == 4 ) )
+  {
+    // map window to pixel window
+    const double *gt = georef.transform;
+    const double det = gt[1] * gt[5] - gt[2] * gt[4];
+    double px0 = DBL_MAX, py0 = DBL_MAX, px1 = -DBL_MAX, py1 = -DBL_MAX;
+    for ( int c = 0; c < 4; c++ )
+    {
+      const double mx = CPLAtof( items[ ( c & 1 ) ? 2 : 0 ] ) - gt[0];
+      const double my = CPLAtof( items[ ( c & 2 ) ? 3 : 1 ] ) - gt[3];
+      const double px = ( gt[5] * mx - gt[2] * my ) / det;
+      const double py = ( gt[1] * my - gt[4] * mx ) / det;
+      px0 = std::min( px0, px ); px1 = std::max( px1, px );
+      py0 = std::min( py0, py ); py1 = std::max( py1, py );
+    }
+    for ( int k = 0; k < m_labels; k++ )
+    {
+      const int *box = bboxes.ptr<int>(k);
+      if ( ( labelpixels.at<int>(k) > 0 )
+        && ( box[0] < px1 ) && ( box[2] > px0 ) && ( box[1] < py1 ) && ( box[3] > py0 ) )
+        selected.push_back( k );
+    }
+  }
+  else
+  {
+    printf( "\nERROR: Invalid -extract %s %s\n", mode, list );
+    CSLDestroy( items );
+    GDALClose( (GDALDatasetH) piDataset );
+    return 1;
+  }
+  CSLDestroy( items );
+  printf ("Extract %lu of %i segments from %s\n", selected.size(), m_labels, StoreFilename);
+  printf ("       ");
+
+  // read only the box of each label, tiles come from the block cache
+  std::vector< std::vector< LINE > > linelists( m_labels );
+  for ( size_t n = 0; n < selected.size(); n++ )
+  {
+    const int k = selected[n];
+    const int *box = bboxes.ptr<int>(k);
+    const int w = box[2] - box[0], h = box[3] - box[1];
+    if ( ( w <= 0 ) || ( h <= 0 ) ) continue;
+    cv::Mat window( h, w, CV_32S );
+    CPLErr error = piBand->RasterIO( GF_Read, box[0], box[1], w, h, window.data,
+                                     w, h, GDT_Int32, 0, 0 );
+    if ( error != CE_None )
+    {
+      printf( "\nERROR: RasterIO() on %s\n", StoreFilename );
+      GDALClose( (GDALDatasetH) piDataset );
+      return 1;
+    }
+    LabelEdges( window, k, box[0], box[1], linelists[k] );
+    GDALTermProgress( (float)(n + 1) / (float)selected.size(), NULL, NULL );
+  }
+  GDALTermProgress( 1.0f, NULL, NULL );
+  GDALClose( (GDALDatasetH) piDataset );
+
+  // same writer as full scenes
+  VECTOROPTS vopts = opts;
+  vopts.shapes = false;
+  const std::vector< cv::Mat > raster;
+  const std::vector< std::string > zsnames;
+  const std::vector< ADJACENCY > adjacency;
+  SavePolygons( georef, OutFilename, OutFormat, cv::Mat(), raster,
+                labelpixels, labelids, avgCH, stdCH, zsnames, cv::Mat(), cv::Mat(),
+                linelists, bboxes, cv::Mat(), adjacency, vopts );
+
+  return 0;
+}
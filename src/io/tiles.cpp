@@ -0,0 +1,543 @@
+/*
+ *  Copyright (c) 2015  Balint Cristian (cristian.balint@gmail.com)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+/* tiles.cpp */
+/* Vector tile pyramid */
+
+#include <omp.h>
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <algorithm>
+#include <unordered_map>
+
+#include "gdal.h"
+#include "gdal_priv.h"
+#include "ogrsf_frmts.h"
+#include "cpl_conv.h"
+#include "cpl_string.h"
+#include "cpl_vsi.h"
+
+#include <opencv2/opencv.hpp>
+
+#include "gdal-segment.hpp"
+
+using namespace std;
+using namespace cv;
+
+
+// level pixels per tile side, tile units and clip buffer
+static const int TILE_PIXELS = 256;
+static const int TILE_EXTENT = 4096;
+static const int TILE_BUFFER = 8;
+
+// protobuf wire format
+static void PutVarint( std::string& buf, unsigned long long value )
+{
+  while ( value >= 0x80 )
+  {
+    buf += (char) ( ( value & 0x7f ) | 0x80 );
+    value >>= 7;
+  }
+  buf += (char) value;
+}
+
+static void PutKey( std::string& buf, const int field, const int wire )
+{
+  PutVarint( buf, ( field << 3 ) | wire );
+}
+
+static void PutBytes( std::string& buf, const int field, const std::string& data )
+{
+  PutKey( buf, field, 2 );
+  PutVarint( buf, data.size() );
+  buf += data;
+}
+
+static void PutPacked( std::string& buf, const int field, const std::vector< unsigned int >& values )
+{
+  std::string packed;
+  for ( size_t i = 0; i < values.size(); i++ )
+    PutVarint( packed, values[i] );
+  PutBytes( buf, field, packed );
+}
+
+static inline unsigned int ZigZag( const int value )
+{
+  return ( (unsigned int) value << 1 ) ^ (unsigned int) ( value >> 31 );
+}
+
+// tile layer with deduplicated values
+typedef struct TILELAYER {
+  std::map< std::pair< int, unsigned long long >, unsigned int > index;
+  std::string values;
+  std::string features;
+  unsigned int nvalues;
+} TILELAYER;
+
+static unsigned int ValueIndex( TILELAYER& layer, const int type, const unsigned long long bits )
+{
+  const std::pair< int, unsigned long long > key( type, bits );
+  std::map< std::pair< int, unsigned long long >, unsigned int >::iterator it = layer.index.find( key );
+  if ( it != layer.index.end() )
+    return it->second;
+
+  std::string value;
+  if ( type == 0 )
+  {
+    // uint_value
+    PutKey( value, 5, 0 );
+    PutVarint( value, bits );
+  }
+  else
+  {
+    // double_value, little endian fixed64
+    PutKey( value, 3, 1 );
+    for ( int b = 0; b < 8; b++ )
+      value += (char) ( ( bits >> ( 8 * b ) ) & 0xff );
+  }
+  PutBytes( layer.values, 4, value );
+  layer.index[key] = layer.nvalues;
+  return layer.nvalues++;
+}
+
+static unsigned int DoubleIndex( TILELAYER& layer, const double value )
+{
+  unsigned long long bits;
+  memcpy( &bits, &value, sizeof( bits ) );
+  return ValueIndex( layer, 1, bits );
+}
+
+// doubled signed area, positive for outer rings
+static long long RingArea2( const std::vector< cv::Point >& ring )
+{
+  long long area = 0;
+  const size_t n = ring.size();
+  for ( size_t i = 0; i < n; i++ )
+  {
+    const cv::Point& p = ring[i];
+    const cv::Point& q = ring[(i + 1) % n];
+    area += (long long) p.x * q.y - (long long) q.x * p.y;
+  }
+  return area;
+}
+
+// directed boundary edges of window labels, label on the right
+static void TileEdges( const cv::Mat window, std::vector< std::vector< LINE > >& lines )
+{
+  const int cols = window.cols;
+  const int rows = window.rows;
+  for ( int y = 0; y < rows; y++ )
+  {
+    const int *row = window.ptr<int>(y);
+    for ( int x = 0; x < cols; x++ )
+    {
+      const int k = row[x];
+      if ( k < 0 ) continue;
+      std::vector< LINE >& list = lines[k];
+      LINE line;
+      if ( ( x == cols - 1 ) || ( k != row[x + 1] ) )
+      {
+        line.sX = x + 1; line.sY = y;
+        line.eX = x + 1; line.eY = y + 1;
+        list.push_back( line );
+      }
+      if ( ( x == 0 ) || ( k != row[x - 1] ) )
+      {
+        line.sX = x; line.sY = y + 1;
+        line.eX = x; line.eY = y;
+        list.push_back( line );
+      }
+      if ( ( y == 0 ) || ( k != window.at<int>(y - 1, x) ) )
+      {
+        line.sX = x;     line.sY = y;
+        line.eX = x + 1; line.eY = y;
+        list.push_back( line );
+      }
+      if ( ( y == rows - 1 ) || ( k != window.at<int>(y + 1, x) ) )
+      {
+        line.sX = x + 1; line.sY = y + 1;
+        line.eX = x;     line.eY = y + 1;
+        list.push_back( line );
+      }
+    }
+  }
+}
+
+// encode one tile, empty if no segment falls in
+static std::string EncodeTile( const cv::Mat klabels, const int zoom, const int maxzoom,
+                               const int tx, const int ty,
+                               const cv::Mat labelpixels, const std::vector< int >& labelids,
+                               const cv::Mat avgCH, const cv::Mat stdCH,
+                               const std::vector< std::string > zsnames,
+                               const cv::Mat avgZS, const cv::Mat stdZS,
+                               const std::vector< std::string >& keys,
+                               const VECTOROPTS& opts )
+{
+  // level pixel covers factor x factor raster pixels
+  const int factor = 1 << ( maxzoom - zoom );
+  const int lcols = ( klabels.cols + factor - 1 ) / factor;
+  const int lrows = ( klabels.rows + factor - 1 ) / factor;
+  const int x0 = std::max( 0, tx * TILE_PIXELS - TILE_BUFFER );
+  const int y0 = std::max( 0, ty * TILE_PIXELS - TILE_BUFFER );
+  const int x1 = std::min( lcols, ( tx + 1 ) * TILE_PIXELS + TILE_BUFFER );
+  const int y1 = std::min( lrows, ( ty + 1 ) * TILE_PIXELS + TILE_BUFFER );
+
+  // sample labels at level pixel centers, window local ids
+  cv::Mat window( y1 - y0, x1 - x0, CV_32S );
+  std::vector< int > globals;
+  std::unordered_map< int, int > locals;
+  for ( int y = 0; y < window.rows; y++ )
+  {
+    const int sy = std::min( klabels.rows - 1, ( y0 + y ) * factor + factor / 2 );
+    const int *src = klabels.ptr<int>(sy);
+    int *dst = window.ptr<int>(y);
+    for ( int x = 0; x < window.cols; x++ )
+    {
+      const int k = src[ std::min( klabels.cols - 1, ( x0 + x ) * factor + factor / 2 ) ];
+      if ( k < 0 ) { dst[x] = -1; continue; }
+      std::unordered_map< int, int >::iterator it = locals.find( k );
+      if ( it == locals.end() )
+      {
+        it = locals.insert( std::make_pair( k, (int) globals.size() ) ).first;
+        globals.push_back( k );
+      }
+      dst[x] = it->second;
+    }
+  }
+  if ( globals.empty() )
+    return std::string();
+
+  std::vector< std::vector< LINE > > lines( globals.size() );
+  TileEdges( window, lines );
+
+  // coarser levels drop steps and simplify harder
+  const bool stair = opts.stair || ( zoom < maxzoom );
+  const double tolerance = ( zoom < maxzoom ) ? std::max( 0.5, opts.dptol / factor ) : opts.dptol;
+  // window pixel to tile units
+  const int scale = TILE_EXTENT / TILE_PIXELS;
+  const int ox = x0 - tx * TILE_PIXELS;
+  const int oy = y0 - ty * TILE_PIXELS;
+
+  TILELAYER layer;
+  layer.nvalues = 0;
+  const size_t m_bands = avgCH.rows;
+  std::vector< std::vector< std::vector< cv::Point > > > polygons;
+  for ( size_t l = 0; l < globals.size(); l++ )
+  {
+    const int k = globals[l];
+    BuildPolygons( lines[l], polygons );
+    std::vector< LINE >().swap( lines[l] );
+
+    // multipolygon as outer rings each followed by holes
+    std::vector< unsigned int > geometry;
+    int cX = 0, cY = 0;
+    for ( size_t p = 0; p < polygons.size(); p++ )
+    {
+      for ( size_t r = 0; r < polygons[p].size(); r++ )
+      {
+        std::vector< cv::Point >& ring = polygons[p][r];
+        SimplifyRing( ring, stair, tolerance );
+        const long long area = RingArea2( ring );
+        if ( ( ring.size() < 3 ) || ( ( r == 0 ) ? ( area <= 0 ) : ( area >= 0 ) ) )
+        {
+          // collapsed outer ring takes its holes
+          if ( r == 0 ) break;
+          continue;
+        }
+        for ( size_t i = 0; i < ring.size(); i++ )
+        {
+          const int pX = ( ring[i].x + ox ) * scale;
+          const int pY = ( ring[i].y + oy ) * scale;
+          if ( i == 0 )
+            geometry.push_back( ( 1 << 3 ) | 1 );  // MoveTo
+          else if ( i == 1 )
+            geometry.push_back( ( (unsigned int) ( ring.size() - 1 ) << 3 ) | 2 );  // LineTo
+          geometry.push_back( ZigZag( pX - cX ) );
+          geometry.push_back( ZigZag( pY - cY ) );
+          cX = pX; cY = pY;
+        }
+        geometry.push_back( ( 1 << 3 ) | 7 );  // ClosePath
+      }
+    }
+    if ( geometry.empty() ) continue;
+
+    // properties in key order
+    std::vector< unsigned int > tags;
+    unsigned int key = 0;
+    tags.push_back( key++ );
+    tags.push_back( ValueIndex( layer, 0, labelids.empty() ? k : labelids[k] ) );
+    tags.push_back( key++ );
+    tags.push_back( ValueIndex( layer, 0, labelpixels.at<int>(k) ) );
+    for ( size_t b = 0; b < m_bands; b++ )
+    {
+      tags.push_back( key++ );
+      tags.push_back( DoubleIndex( layer, avgCH.at<double>(b,k) ) );
+    }
+    for ( size_t b = 0; b < m_bands; b++ )
+    {
+      tags.push_back( key++ );
+      tags.push_back( DoubleIndex( layer, stdCH.at<double>(b,k) ) );
+    }
+    // zonal values, unset where no valid pixel
+    for ( size_t z = 0; z < zsnames.size(); z++, key += 2 )
+    {
+      if ( std::isnan( avgZS.at<double>(z,k) ) ) continue;
+      tags.push_back( key );
+      tags.push_back( DoubleIndex( layer, avgZS.at<double>(z,k) ) );
+      tags.push_back( key + 1 );
+      tags.push_back( DoubleIndex( layer, stdZS.at<double>(z,k) ) );
+    }
+
+    std::string feature;
+    PutKey( feature, 1, 0 );
+    PutVarint( feature, labelids.empty() ? k : labelids[k] );
+    PutPacked( feature, 2, tags );
+    PutKey( feature, 3, 0 );
+    PutVarint( feature, 3 );  // POLYGON
+    PutPacked( feature, 4, geometry );
+    PutBytes( layer.features, 2, feature );
+  }
+  if ( layer.features.empty() )
+    return std::string();
+
+  std::string body;
+  PutKey( body, 15, 0 );
+  PutVarint( body, 2 );
+  PutBytes( body, 1, "segments" );
+  body += layer.features;
+  for ( size_t k = 0; k < keys.size(); k++ )
+    PutBytes( body, 3, keys[k] );
+  body += layer.values;
+  PutKey( body, 5, 0 );
+  PutVarint( body, TILE_EXTENT );
+
+  std::string tile;
+  PutBytes( tile, 3, body );
+  return tile;
+}
+
+// sql string literal
+static std::string Quote( const std::string& text )
+{
+  std::string quoted = "'";
+  for ( size_t i = 0; i < text.size(); i++ )
+  {
+    if ( text[i] == '\'' ) quoted += '\'';
+    quoted += text[i];
+  }
+  return quoted + "'";
+}
+
+void SaveTiles( const GEOREF& georef, const char *OutFilename,
+                const cv::Mat klabels, const cv::Mat labelpixels,
+                const std::vector< int >& labelids,
+                const cv::Mat avgCH, const cv::Mat stdCH,
+                const std::vector< std::string > zsnames,
+                const cv::Mat avgZS, const cv::Mat stdZS,
+                const VECTOROPTS& opts )
+{
+  CPLLocaleC oLocaleCForcer;
+  CPLErrorReset();
+
+  const bool mbtiles = EQUAL( CPLGetExtension( OutFilename ), "mbtiles" );
+  const size_t m_bands = avgCH.rows;
+
+  // raster pixels at the finest level, one tile on top
+  int maxzoom = 0;
+  while ( ( TILE_PIXELS << maxzoom ) < std::max( klabels.cols, klabels.rows ) )
+    maxzoom++;
+
+  // attribute names as SavePolygons() fields
+  std::vector< std::string > keys;
+  std::string fields;
+  keys.push_back( "CLASS" );
+  keys.push_back( "AREA" );
+  for ( size_t b = 0; b < m_bands; b++ )
+    keys.push_back( CPLSPrintf( "%lu_AVERAGE", b + 1 ) );
+  for ( size_t b = 0; b < m_bands; b++ )
+    keys.push_back( CPLSPrintf( "%lu_STDDEV", b + 1 ) );
+  for ( size_t z = 0; z < zsnames.size(); z++ )
+  {
+    keys.push_back( zsnames[z] + "_AVG" );
+    keys.push_back( zsnames[z] + "_STD" );
+  }
+  for ( size_t k = 0; k < keys.size(); k++ )
+    fields += CPLSPrintf( "%s\"%s\":\"Number\"", k ? "," : "", keys[k].c_str() );
+
+  // pyramid is aligned to the raster grid, not web mercator
+  const double *gt = georef.transform;
+  std::vector< std::pair< std::string, std::string > > metadata;
+  metadata.push_back( std::make_pair( "name", std::string( CPLGetBasename( OutFilename ) ) ) );
+  metadata.push_back( std::make_pair( "format", std::string( "pbf" ) ) );
+  metadata.push_back( std::make_pair( "type", std::string( "overlay" ) ) );
+  metadata.push_back( std::make_pair( "minzoom", std::string( "0" ) ) );
+  metadata.push_back( std::make_pair( "maxzoom", std::string( CPLSPrintf( "%i", maxzoom ) ) ) );
+  metadata.push_back( std::make_pair( "tile_pixels", std::string( CPLSPrintf( "%i", TILE_PIXELS ) ) ) );
+  metadata.push_back( std::make_pair( "geotransform", std::string(
+    CPLSPrintf( "%.17g,%.17g,%.17g,%.17g,%.17g,%.17g", gt[0], gt[1], gt[2], gt[3], gt[4], gt[5] ) ) ) );
+  metadata.push_back( std::make_pair( "projection", georef.projection ) );
+  metadata.push_back( std::make_pair( "json", std::string(
+    CPLSPrintf( "{\"vector_layers\":[{\"id\":\"segments\",\"minzoom\":0,\"maxzoom\":%i,\"fields\":{%s}}]}",
+                maxzoom, fields.c_str() ) ) ) );
+
+#if GDALVER >= 2
+  GDALDataset *liDS = NULL;
+#else
+  OGRDataSource *liDS = NULL;
+#endif
+  if ( mbtiles )
+  {
+#if GDALVER >= 2
+    GDALDriver *liDriver = GetGDALDriverManager()->GetDriverByName( "SQLite" );
+#else
+    OGRSFDriver *liDriver = OGRSFDriverRegistrar::GetRegistrar()->GetDriverByName( "SQLite" );
+#endif
+    if ( liDriver == NULL )
+    {
+      printf( "\nERROR: SQLite driver not available for MBTiles.\n" );
+      exit( 1 );
+    }
+    VSIUnlink( OutFilename );
+#if GDALVER >= 2
+    liDS = liDriver->Create( OutFilename, 0, 0, 0, GDT_Unknown, NULL );
+#else
+    liDS = liDriver->CreateDataSource( OutFilename, NULL );
+#endif
+    if ( liDS == NULL )
+    {
+      printf( "\nERROR: Creation of output file failed.\n" );
+      exit( 1 );
+    }
+    // plain sql goes straight to sqlite
+    liDS->ExecuteSQL( "CREATE TABLE metadata (name text, value text)", NULL, NULL );
+    liDS->ExecuteSQL( "CREATE TABLE tiles (zoom_level integer, tile_column integer, "
+                      "tile_row integer, tile_data blob)", NULL, NULL );
+    liDS->ExecuteSQL( "CREATE UNIQUE INDEX tile_index ON tiles "
+                      "(zoom_level, tile_column, tile_row)", NULL, NULL );
+    for ( size_t m = 0; m < metadata.size(); m++ )
+    {
+      const std::string sql = "INSERT INTO metadata VALUES (" + Quote( metadata[m].first )
+                            + "," + Quote( metadata[m].second ) + ")";
+      liDS->ExecuteSQL( sql.c_str(), NULL, NULL );
+    }
+    liDS->ExecuteSQL( "BEGIN", NULL, NULL );
+  }
+  else
+  {
+    VSIMkdir( OutFilename, 0755 );
+    VSILFILE *fp = VSIFOpenL( CPLFormFilename( OutFilename, "metadata", "json" ), "wb" );
+    if ( fp == NULL )
+    {
+      printf( "\nERROR: Creation of output directory failed.\n" );
+      exit( 1 );
+    }
+    // json values stay raw, others are strings
+    std::string json = "{\n";
+    for ( size_t m = 0; m < metadata.size(); m++ )
+    {
+      std::string value = metadata[m].second;
+      if ( metadata[m].first != "json" )
+      {
+        std::string escaped;
+        for ( size_t i = 0; i < value.size(); i++ )
+        {
+          if ( ( value[i] == '"' ) || ( value[i] == '\\' ) ) escaped += '\\';
+          escaped += value[i];
+        }
+        value = "\"" + escaped + "\"";
+      }
+      json += CPLSPrintf( "  \"%s\": ", metadata[m].first.c_str() ) + value
+            + ( ( m + 1 < metadata.size() ) ? ",\n" : "\n" );
+    }
+    json += "}\n";
+    VSIFWriteL( json.c_str(), 1, json.size(), fp );
+    VSIFCloseL( fp );
+  }
+
+  printf( "Write Tiles: %s (%s, zoom 0-%i)\n", OutFilename,
+          mbtiles ? "mbtiles" : "directory", maxzoom );
+  size_t written = 0;
+  for ( int zoom = maxzoom; zoom >= 0; zoom-- )
+  {
+    const int factor = 1 << ( maxzoom - zoom );
+    const int lcols = ( klabels.cols + factor - 1 ) / factor;
+    const int lrows = ( klabels.rows + factor - 1 ) / factor;
+    const int ntx = ( lcols + TILE_PIXELS - 1 ) / TILE_PIXELS;
+    const int nty = ( lrows + TILE_PIXELS - 1 ) / TILE_PIXELS;
+
+    // z/x/y tree made up front
+    const std::string zdir = CPLFormFilename( OutFilename, CPLSPrintf( "%i", zoom ), NULL );
+    if ( !mbtiles )
+    {
+      VSIMkdir( zdir.c_str(), 0755 );
+      for ( int tx = 0; tx < ntx; tx++ )
+        VSIMkdir( CPLFormFilename( zdir.c_str(), CPLSPrintf( "%i", tx ), NULL ), 0755 );
+    }
+
+    #pragma omp parallel for schedule(dynamic, 1) reduction(+:written)
+    for ( int t = 0; t < ntx * nty; t++ )
+    {
+      const int tx = t % ntx;
+      const int ty = t / ntx;
+      const std::string tile = EncodeTile( klabels, zoom, maxzoom, tx, ty,
+                                           labelpixels, labelids, avgCH, stdCH,
+                                           zsnames, avgZS, stdZS, keys, opts );
+      if ( tile.empty() ) continue;
+      written++;
+
+      if ( mbtiles )
+      {
+        // hex blob literal, rows count from bottom
+        std::string sql = CPLSPrintf( "INSERT INTO tiles VALUES (%i,%i,%i,X'", zoom, tx,
+                                      ( 1 << zoom ) - 1 - ty );
+        static const char hex[] = "0123456789ABCDEF";
+        sql.reserve( sql.size() + 2 * tile.size() + 3 );
+        for ( size_t i = 0; i < tile.size(); i++ )
+        {
+          sql += hex[ ( (unsigned char) tile[i] ) >> 4 ];
+          sql += hex[ ( (unsigned char) tile[i] ) & 0x0f ];
+        }
+        sql += "')";
+        #pragma omp critical (mbtiles)
+        liDS->ExecuteSQL( sql.c_str(), NULL, NULL );
+      }
+      else
+      {
+        const std::string xdir = CPLFormFilename( zdir.c_str(), CPLSPrintf( "%i", tx ), NULL );
+        VSILFILE *fp = VSIFOpenL( CPLFormFilename( xdir.c_str(), CPLSPrintf( "%i", ty ), "pbf" ), "wb" );
+        if ( fp == NULL )
+        {
+          printf( "\nERROR: Failed to write tile %i/%i/%i.\n", zoom, tx, ty );
+          exit( 1 );
+        }
+        VSIFWriteL( tile.data(), 1, tile.size(), fp );
+        VSIFCloseL( fp );
+      }
+    }
+    GDALTermProgress( (float)(maxzoom - zoom + 1) / (float)(maxzoom + 1), NULL, NULL );
+  }
+  printf( "       wrote %lu tiles\n", written );
+
+  if ( mbtiles )
+  {
+    liDS->ExecuteSQL( "COMMIT", NULL, NULL );
+#if GDALVER >= 2
+    GDALClose( liDS );
+#else
+    OGRDataSource::DestroyDataSource( liDS );
+#endif
+  }
+}
@@ -0,0 +1,549 @@
+/*
+ *  Copyright (c) 2015  Balint Cristian (cristian.balint@gmail.com)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+/* topology.cpp */
+/* Arc-node boundary topology */
+
+#include <omp.h>
+#include <algorithm>
+#include <unordered_map>
+
+#include "gdal.h"
+#include "gdal_priv.h"
+#include "ogrsf_frmts.h"
+#include "cpl_string.h"
+
+#include <opencv2/opencv.hpp>
+
+#include "gdal-segment.hpp"
+
+using namespace std;
+using namespace cv;
+
+
+// unit steps: east, south, west, north
+static const int STEPX[4] = { 1, 0, -1, 0 };
+static const int STEPY[4] = { 0, 1, 0, -1 };
+
+// pixel edges of a label raster, outside is -1
+typedef struct EDGES {
+  const cv::Mat *klabels;
+  int cols, rows;
+  std::vector< unsigned char > hseen;  // (x,y)-(x+1,y), cols x (rows+1)
+  std::vector< unsigned char > vseen;  // (x,y)-(x,y+1), (cols+1) x rows
+} EDGES;
+
+static inline int Pixel( const EDGES& e, const int x, const int y )
+{
+  if ( ( x < 0 ) || ( y < 0 ) || ( x >= e.cols ) || ( y >= e.rows ) ) return -1;
+  return e.klabels->at<int>(y, x);
+}
+
+// labels right and left of step d leaving vertex (x,y)
+static inline void Sides( const EDGES& e, const int x, const int y, const int d,
+                          int& right, int& left )
+{
+  switch ( d )
+  {
+    case 0: right = Pixel( e, x, y );         left = Pixel( e, x, y - 1 );     break;
+    case 1: right = Pixel( e, x - 1, y );     left = Pixel( e, x, y );         break;
+    case 2: right = Pixel( e, x - 1, y - 1 ); left = Pixel( e, x - 1, y );     break;
+    default: right = Pixel( e, x, y - 1 );    left = Pixel( e, x - 1, y - 1 ); break;
+  }
+}
+
+// step d leaving (x,y) exists and separates labels
+static inline bool Boundary( const EDGES& e, const int x, const int y, const int d )
+{
+  const int nx = x + STEPX[d], ny = y + STEPY[d];
+  if ( ( nx < 0 ) || ( ny < 0 ) || ( nx > e.cols ) || ( ny > e.rows ) ) return false;
+  int right, left;
+  Sides( e, x, y, d, right, left );
+  return right != left;
+}
+
+// visited flag of step d leaving (x,y)
+static inline unsigned char& Seen( EDGES& e, const int x, const int y, const int d )
+{
+  switch ( d )
+  {
+    case 0: return e.hseen[ (size_t) y * e.cols + x ];
+    case 1: return e.vseen[ (size_t) y * ( e.cols + 1 ) + x ];
+    case 2: return e.hseen[ (size_t) y * e.cols + x - 1 ];
+    default: return e.vseen[ (size_t) ( y - 1 ) * ( e.cols + 1 ) + x ];
+  }
+}
+
+static inline int Degree( const EDGES& e, const int x, const int y )
+{
+  int n = 0;
+  for ( int d = 0; d < 4; d++ )
+    n += Boundary( e, x, y, d );
+  return n;
+}
+
+// stripe owns vertical steps of its rows and horizontal steps on its vertex rows
+static inline bool Owned( const int y, const int d, const int y0, const int y1, const int vy1 )
+{
+  if ( d == 1 ) return ( y >= y0 ) && ( y < y1 );
+  if ( d == 3 ) return ( y > y0 ) && ( y <= y1 );
+  return ( y >= y0 ) && ( y < vy1 );
+}
+
+static inline long long VertexKey( const cv::Point& p )
+{
+  return ( (long long) p.y << 32 ) | (unsigned int) p.x;
+}
+
+static void ReverseArc( ARC& arc )
+{
+  std::reverse( arc.points.begin(), arc.points.end() );
+  std::swap( arc.left, arc.right );
+  const unsigned char first = arc.first;
+  arc.first = ( arc.last + 2 ) % 4;
+  arc.last = ( first + 2 ) % 4;
+}
+
+// follow degree two vertices until a node, a stripe cut or the start
+static void TraceArc( EDGES& e, int x, int y, int d,
+                      const int y0, const int y1, const int vy1, ARC& arc )
+{
+  Sides( e, x, y, d, arc.right, arc.left );
+  arc.first = d;
+  arc.length = 0;
+  arc.closed = false;
+  arc.points.clear();
+  arc.points.push_back( cv::Point( x, y ) );
+  for ( ; ; )
+  {
+    Seen( e, x, y, d ) = 1;
+    x += STEPX[d]; y += STEPY[d];
+    arc.length++;
+    arc.last = d;
+    if ( Degree( e, x, y ) != 2 ) break;
+    // the other step, never back
+    int n = -1;
+    for ( int c = 0; c < 4; c++ )
+      if ( ( c != ( d + 2 ) % 4 ) && Boundary( e, x, y, c ) ) n = c;
+    if ( !Owned( y, n, y0, y1, vy1 ) || Seen( e, x, y, n ) ) break;
+    // corners only
+    if ( n != d ) arc.points.push_back( cv::Point( x, y ) );
+    d = n;
+  }
+  arc.points.push_back( cv::Point( x, y ) );
+}
+
+// join arc b at the end of arc a
+static void AppendArc( ARC& a, ARC& b )
+{
+  if ( b.points.front() != a.points.back() ) ReverseArc( b );
+  b.points.erase( b.points.begin() );
+  // joint is no corner on a straight run
+  if ( a.last == b.first ) a.points.pop_back();
+  a.points.insert( a.points.end(), b.points.begin(), b.points.end() );
+  a.length += b.length;
+  a.last = b.last;
+  std::vector< cv::Point >().swap( b.points );
+}
+
+// douglas-peucker with fixed ends, split when both ends meet
+static void SimplifyArc( std::vector< cv::Point >& points, const double tolerance )
+{
+  size_t split = points.size() - 1;
+  if ( points.front() == points.back() )
+  {
+    double far = -1.0f;
+    for ( size_t i = 1; i + 1 < points.size(); i++ )
+    {
+      const double dx = points[i].x - points[0].x;
+      const double dy = points[i].y - points[0].y;
+      if ( dx * dx + dy * dy > far ) { far = dx * dx + dy * dy; split = i; }
+    }
+  }
+  std::vector< cv::Point > head( points.begin(), points.begin() + split + 1 );
+  std::vector< cv::Point > tail( points.begin() + split, points.end() );
+  std::vector< cv::Point > approx;
+  cv::approxPolyDP( head, approx, tolerance, false );
+  points.swap( approx );
+  if ( tail.size() > 1 )
+  {
+    cv::approxPolyDP( tail, approx, tolerance, false );
+    points.insert( points.end(), approx.begin() + 1, approx.end() );
+  }
+}
+
+void BuildTopology( const cv::Mat klabels, const size_t m_labels,
+                    const double tolerance, TOPOLOGY& topology,
+                    std::vector< ADJACENCY > *adjacency )
+{
+  EDGES e;
+  e.klabels = &klabels;
+  e.cols = klabels.cols;
+  e.rows = klabels.rows;
+  e.hseen.assign( (size_t) e.cols * ( e.rows + 1 ), 0 );
+  e.vseen.assign( (size_t) ( e.cols + 1 ) * e.rows, 0 );
+
+  // one stripe per thread, vertex rows [y0,vy1)
+  const int nstripes = std::max( 1, std::min( e.rows, omp_get_max_threads() ) );
+  const int srows = ( e.rows + nstripes - 1 ) / nstripes;
+  std::vector< std::vector< ARC > > stripearcs( nstripes );
+
+  printf ("Build arc-node topology\n");
+  printf ("       ");
+  #pragma omp parallel for schedule(static)
+  for ( int s = 0; s < nstripes; s++ )
+  {
+    const int y0 = std::min( e.rows, s * srows );
+    const int y1 = std::min( e.rows, y0 + srows );
+    if ( y0 >= y1 ) continue;
+    const int vy1 = ( y1 == e.rows ) ? y1 + 1 : y1;
+    std::vector< ARC >& arcs = stripearcs[s];
+
+    // arcs leaving nodes and stripe cuts, the last vertex row
+    // still owns the north steps into this stripe
+    for ( int y = y0; y <= y1; y++ )
+      for ( int x = 0; x <= e.cols; x++ )
+      {
+        const int degree = Degree( e, x, y );
+        if ( degree == 0 ) continue;
+        bool start = ( degree != 2 );
+        for ( int d = 0; d < 4 && !start; d++ )
+          if ( Boundary( e, x, y, d ) && !Owned( y, d, y0, y1, vy1 ) ) start = true;
+        if ( !start ) continue;
+        for ( int d = 0; d < 4; d++ )
+        {
+          if ( !Boundary( e, x, y, d ) || !Owned( y, d, y0, y1, vy1 )
+            || Seen( e, x, y, d ) ) continue;
+          arcs.push_back( ARC() );
+          TraceArc( e, x, y, d, y0, y1, vy1, arcs.back() );
+        }
+      }
+
+    // rings without any node, start at their top left corner
+    for ( int y = y0; y < vy1; y++ )
+      for ( int x = 0; x < e.cols; x++ )
+      {
+        if ( !Boundary( e, x, y, 0 ) || Seen( e, x, y, 0 ) ) continue;
+        arcs.push_back( ARC() );
+        TraceArc( e, x, y, 0, y0, y1, vy1, arcs.back() );
+        arcs.back().closed = true;
+        arcs.back().points.pop_back();
+      }
+  }
+  GDALTermProgress( 0.3f, NULL, NULL );
+
+  // gather, remember arc ends on stripe cuts
+  std::vector< ARC >& arcs = topology.arcs;
+  arcs.clear();
+  for ( int s = 0; s < nstripes; s++ )
+  {
+    for ( size_t a = 0; a < stripearcs[s].size(); a++ )
+    {
+      arcs.push_back( ARC() );
+      std::swap( arcs.back(), stripearcs[s][a] );
+    }
+    std::vector< ARC >().swap( stripearcs[s] );
+  }
+  std::unordered_map< long long, std::vector< int > > cuts;
+  for ( size_t a = 0; a < arcs.size(); a++ )
+  {
+    if ( arcs[a].closed ) continue;
+    const cv::Point& p = arcs[a].points.front();
+    const cv::Point& q = arcs[a].points.back();
+    if ( Degree( e, p.x, p.y ) == 2 ) cuts[ VertexKey( p ) ].push_back( (int) a );
+    if ( Degree( e, q.x, q.y ) == 2 ) cuts[ VertexKey( q ) ].push_back( (int) a );
+  }
+  std::vector< unsigned char >().swap( e.hseen );
+  std::vector< unsigned char >().swap( e.vseen );
+
+  // stitch pieces split by stripes, from nodes first then pure rings
+  std::vector< char > merged( arcs.size(), 0 );
+  for ( int pass = 0; pass < 2; pass++ )
+    for ( size_t a = 0; a < arcs.size(); a++ )
+    {
+      if ( merged[a] || arcs[a].closed ) continue;
+      if ( cuts.count( VertexKey( arcs[a].points.front() ) ) )
+      {
+        // rings crossing stripes wait for the second pass
+        if ( cuts.count( VertexKey( arcs[a].points.back() ) ) )
+        {
+          if ( !pass ) continue;
+        }
+        else
+          ReverseArc( arcs[a] );
+      }
+      merged[a] = 2;
+      const cv::Point start = arcs[a].points.front();
+      int at = (int) a;
+      for ( ; ; )
+      {
+        const cv::Point end = arcs[a].points.back();
+        std::unordered_map< long long, std::vector< int > >::iterator it = cuts.find( VertexKey( end ) );
+        if ( it == cuts.end() ) break;
+        // the other piece ending at this cut
+        const std::vector< int >& ends = it->second;
+        const int b = ( ends[0] == at ) ? ends[1] : ends[0];
+        if ( merged[b] )
+        {
+          // back at the start
+          if ( end == start )
+          {
+            arcs[a].closed = true;
+            arcs[a].points.pop_back();
+          }
+          break;
+        }
+        merged[b] = 1;
+        AppendArc( arcs[a], arcs[b] );
+        at = b;
+      }
+    }
+  size_t n = 0;
+  for ( size_t a = 0; a < arcs.size(); a++ )
+    if ( merged[a] != 1 )
+    {
+      if ( n != a ) std::swap( arcs[n], arcs[a] );
+      n++;
+    }
+  arcs.resize( n );
+  GDALTermProgress( 0.6f, NULL, NULL );
+
+  // simplify each shared arc once, nodes stay
+  #pragma omp parallel for schedule(dynamic, 4096)
+  for ( int a = 0; a < (int) arcs.size(); a++ )
+  {
+    if ( arcs[a].closed )
+      SimplifyRing( arcs[a].points, false, tolerance );
+    else if ( ( tolerance > 0.0f ) && ( arcs[a].points.size() > 2 ) )
+      SimplifyArc( arcs[a].points, tolerance );
+  }
+
+  // arcs per label, negative when label is on the left
+  topology.offset.assign( m_labels + 1, 0 );
+  for ( size_t a = 0; a < arcs.size(); a++ )
+  {
+    if ( arcs[a].right >= 0 ) topology.offset[ arcs[a].right + 1 ]++;
+    if ( arcs[a].left >= 0 ) topology.offset[ arcs[a].left + 1 ]++;
+  }
+  for ( size_t k = 0; k < m_labels; k++ )
+    topology.offset[k + 1] += topology.offset[k];
+  topology.refs.resize( topology.offset[m_labels] );
+  std::vector< int > fill( topology.offset.begin(), topology.offset.end() - 1 );
+  for ( size_t a = 0; a < arcs.size(); a++ )
+  {
+    if ( arcs[a].right >= 0 ) topology.refs[ fill[ arcs[a].right ]++ ] = (int) a + 1;
+    if ( arcs[a].left >= 0 ) topology.refs[ fill[ arcs[a].left ]++ ] = - (int) a - 1;
+  }
+
+  // neighbours are arcs with labels on both sides
+  if ( adjacency )
+  {
+    std::unordered_map< unsigned long long, unsigned int > shared;
+    for ( size_t a = 0; a < arcs.size(); a++ )
+    {
+      if ( ( arcs[a].left < 0 ) || ( arcs[a].right < 0 ) ) continue;
+      const unsigned long long lA = std::min( arcs[a].left, arcs[a].right );
+      const unsigned long long lB = std::max( arcs[a].left, arcs[a].right );
+      shared[ ( lA << 32 ) | lB ] += arcs[a].length;
+    }
+    adjacency->clear();
+    adjacency->reserve( shared.size() );
+    for ( auto it = shared.begin(); it != shared.end(); ++it )
+    {
+      ADJACENCY pair;
+      pair.lA = (unsigned int) ( it->first >> 32 );
+      pair.lB = (unsigned int) ( it->first & 0xffffffffULL );
+      pair.length = it->second;
+      adjacency->push_back( pair );
+    }
+    std::sort( adjacency->begin(), adjacency->end(),
+               []( const ADJACENCY& a, const ADJACENCY& b )
+               { return ( a.lA != b.lA ) ? ( a.lA < b.lA ) : ( a.lB < b.lB ); } );
+  }
+  GDALTermProgress( 1.0f, NULL, NULL );
+  printf ("       %lu arcs\n", arcs.size());
+}
+
+void ArcPolygons( const TOPOLOGY& topology, const int label,
+                  std::vector< std::vector< std::vector< cv::Point > > >& polygons )
+{
+  const std::vector< ARC >& arcs = topology.arcs;
+  std::vector< std::vector< cv::Point > > rings;
+
+  // open arcs oriented with the label on the right
+  std::vector< ARC > pieces;
+  for ( int r = topology.offset[label]; r < topology.offset[label + 1]; r++ )
+  {
+    const int ref = topology.refs[r];
+    const ARC& arc = arcs[ std::abs( ref ) - 1 ];
+    if ( arc.closed )
+    {
+      rings.push_back( arc.points );
+      if ( ref < 0 ) std::reverse( rings.back().begin(), rings.back().end() );
+      continue;
+    }
+    pieces.push_back( arc );
+    if ( ref < 0 ) ReverseArc( pieces.back() );
+  }
+
+  // successor piece, prefer right turns on pinch nodes
+  const size_t n = pieces.size();
+  std::vector< int > next( n, -1 );
+  for ( size_t i = 0; i < n; i++ )
+  {
+    int rank = 3;
+    for ( size_t j = 0; j < n; j++ )
+    {
+      if ( pieces[j].points.front() != pieces[i].points.back() ) continue;
+      const int turn = ( pieces[j].first - pieces[i].last + 4 ) % 4;
+      const int r = ( turn == 1 ) ? 0 : ( turn == 0 ) ? 1 : 2;
+      if ( r < rank )
+      {
+        rank = r;
+        next[i] = (int) j;
+      }
+    }
+  }
+
+  // chain pieces into rings
+  std::vector< char > used( n, 0 );
+  for ( size_t i = 0; i < n; i++ )
+  {
+    if ( used[i] ) continue;
+    std::vector< cv::Point > ring;
+    int j = (int) i;
+    while ( ( j >= 0 ) && ( ! used[j] ) )
+    {
+      used[j] = 1;
+      ring.insert( ring.end(), pieces[j].points.begin(), pieces[j].points.end() - 1 );
+      j = next[j];
+    }
+    rings.push_back( ring );
+  }
+
+  NestRings( rings, polygons );
+}
+
+void SaveArcs( const GEOREF& georef,
+               const char *OutFilename, const char *OutFormat,
+               const TOPOLOGY& topology,
+               const std::vector< int >& labelids )
+{
+  CPLLocaleC oLocaleCForcer;
+  CPLErrorReset();
+
+#if GDALVER >= 2
+  GDALDriver *liDriver;
+  liDriver = GetGDALDriverManager()->GetDriverByName( OutFormat );
+#else
+  OGRSFDriver *liDriver;
+  liDriver = OGRSFDriverRegistrar::GetRegistrar()
+           ->GetDriverByName( OutFormat );
+#endif
+
+  if( liDriver == NULL )
+  {
+      printf( "\nERROR: %s driver not available.\n", OutFormat );
+      exit( 1 );
+  }
+
+#if GDALVER >= 2
+  GDALDataset *liDS;
+  liDS = liDriver->Create( OutFilename, 0, 0, 0, GDT_Unknown, NULL );
+#else
+  OGRDataSource *liDS;
+  liDS = liDriver->CreateDataSource( OutFilename, NULL );
+#endif
+
+  if( liDS == NULL )
+  {
+      printf( "\nERROR: Creation of output file failed.\n" );
+      exit( 1 );
+  }
+
+  OGRSpatialReference oSRS( georef.projection.c_str() );
+
+  OGRLayer *liLayer;
+  liLayer = liDS->CreateLayer( "arcs", georef.projection.empty() ? NULL : &oSRS,
+                               wkbLineString, NULL );
+
+  if( liLayer == NULL )
+  {
+      printf( "\nERROR: Layer creation failed.\n" );
+      exit( 1 );
+  }
+
+  // outside and nodata sides stay unset
+  OGRFieldDefn *leftField = new OGRFieldDefn( "LEFT", OFTInteger );
+  liLayer->CreateField( leftField );
+
+  OGRFieldDefn *rightField = new OGRFieldDefn( "RIGHT", OFTInteger );
+  liLayer->CreateField( rightField );
+
+  OGRFieldDefn *lengthField = new OGRFieldDefn( "LENGTH", OFTInteger );
+  liLayer->CreateField( lengthField );
+
+  const bool transact = liLayer->TestCapability( OLCTransactions );
+  if ( transact ) liLayer->StartTransaction();
+
+  const double *gt = georef.transform;
+  const std::vector< ARC >& arcs = topology.arcs;
+  printf ("Write File: %s (arcs)\n", OutFilename);
+  for ( size_t a = 0; a < arcs.size(); a++ )
+  {
+    const ARC& arc = arcs[a];
+    OGRFeature *liFeature;
+    liFeature = OGRFeature::CreateFeature( liLayer->GetLayerDefn() );
+    if ( arc.left >= 0 )
+      liFeature->SetField( "LEFT", labelids.empty() ? arc.left : labelids[arc.left] );
+    if ( arc.right >= 0 )
+      liFeature->SetField( "RIGHT", labelids.empty() ? arc.right : labelids[arc.right] );
+    liFeature->SetField( "LENGTH", (int) arc.length );
+
+    // rings repeat their first vertex
+    OGRLineString line;
+    const size_t n = arc.points.size();
+    for ( size_t i = 0; i < n + ( arc.closed ? 1 : 0 ); i++ )
+    {
+      const double x = arc.points[i % n].x;
+      const double y = arc.points[i % n].y;
+      line.addPoint( gt[0] + x * gt[1] + y * gt[2], gt[3] + x * gt[4] + y * gt[5] );
+    }
+    liFeature->SetGeometry( &line );
+
+    if( liLayer->CreateFeature( liFeature ) != OGRERR_NONE )
+    {
+       printf( "\nERROR: Failed to create feature in vector layer.\n" );
+       exit( 1 );
+    }
+    OGRFeature::DestroyFeature( liFeature );
+
+    if ( transact && ( ( ( a + 1 ) % 65536 ) == 0 ) )
+    {
+      liLayer->CommitTransaction();
+      liLayer->StartTransaction();
+    }
+    if ( ( a % 65536 ) == 0 )
+      GDALTermProgress( (float)(a+1) / (float)(arcs.size()), NULL, NULL );
+  }
+  if ( transact ) liLayer->CommitTransaction();
+  GDALTermProgress( 1.0f, NULL, NULL );
+
+#if GDALVER >= 2
+  GDALClose( liDS );
+#else
+  OGRDataSource::DestroyDataSource( liDS );
+#endif
+}
@@ -17,6 +17,11 @@
 /* Vector I/O */
 
 #include <omp.h>
+#include <climits>
+#include <cmath>
+#include <cfloat>
+#include <algorithm>
+#include <unordered_map>
 
 #include "gdal.h"
 #include "gdal_priv.h"
@@ -32,107 +37,610 @@ using namespace std;
 using namespace cv;
 
 
-void LabelContours( const cv::Mat klabels, std::vector< std::vector< LINE > >& linelists )
+// unordered label pair key
+static inline unsigned long long AdjacencyKey( int a, int b )
 {
-  // iterate through pixels and check edges
+  if ( a > b ) std::swap( a, b );
+  return ( (unsigned long long) a << 32 ) | (unsigned int) b;
+}
+
+static bool AdjacencyLess( const ADJACENCY& a, const ADJACENCY& b )
+{
+  if ( a.lA != b.lA ) return a.lA < b.lA;
+  return a.lB < b.lB;
+}
+
+// advance a row cursor to the run covering x
+static inline size_t RunAt( const LABELRUNS& runs, size_t j, const int x )
+{
+  while ( runs.runs[j + 1].x <= x ) j++;
+  return j;
+}
+
+// label at x of a row cursor, -1 outside
+static inline int RunLabel( const LABELRUNS& runs, size_t& j, const int x )
+{
+  if ( ( x < 0 ) || ( x >= runs.cols ) ) return -1;
+  j = RunAt( runs, j, x );
+  return runs.runs[j].label;
+}
+
+void LabelContours( const LABELRUNS& runs,
+                    std::vector< std::vector< LINE > >& linelists,
+                    cv::Mat& bboxes,
+                    std::vector< ADJACENCY > *adjacency,
+                    cv::Mat *shapes )
+{
+  const int rows = runs.rows;
+
+  // split in horizontal stripes
+  std::vector< STRIPE > stripes;
+  RunStripes( runs, stripes );
+  const int nstripes = (int) stripes.size();
+
+  // per stripe results
+  std::vector< std::vector< std::vector< LINE > > > stripelines( nstripes );
+  std::vector< std::vector< int > > stripeboxes( nstripes );
+  std::vector< std::vector< int > > stripequads( nstripes );
+  std::vector< std::unordered_map< unsigned long long, unsigned int > > stripeadj( nstripes );
+
+  // vertical edges sit on run ends, horizontal edges where
+  // runs of adjacent rows differ, edges have the label on right
   printf ("Parse edges in segmented image\n");
-  for (int y = 0; y < klabels.rows; y++)
+  printf ("       ");
+  #pragma omp parallel for schedule(static)
+  for ( int s = 0; s < nstripes; s++ )
   {
-      const int yklabels = y*klabels.cols;
-      for (int x = 0; x < klabels.cols; x++)
-      {
-          const int i = yklabels + x;
+    const int y0 = stripes[s].y0;
+    const int y1 = stripes[s].y1;
+    const int lo = stripes[s].lo;
+    const int hi = stripes[s].hi;
+    if ( hi < lo ) continue;
 
-          LINE line;
-          // check right pixel
-          if ( x == klabels.cols - 1 )
-          {
-            line.sX = x + 1; line.sY = y;
-            line.eX = x + 1; line.eY = y + 1;
-            {
-              linelists[klabels.at<u_int32_t>(i)].push_back(line);
-            }
+    std::vector< std::vector< LINE > >& lines = stripelines[s];
+    std::unordered_map< unsigned long long, unsigned int >& adj = stripeadj[s];
+    std::vector< int >& boxes = stripeboxes[s];
+    lines.resize( hi - lo + 1 );
+    boxes.resize( 4 * ( hi - lo + 1 ) );
+    for ( int k = 0; k <= hi - lo; k++ )
+    {
+      boxes[4*k + 0] = INT_MAX; boxes[4*k + 1] = INT_MAX;
+      boxes[4*k + 2] = -1;      boxes[4*k + 3] = -1;
+    }
 
-          } else if ( klabels.at<u_int32_t>(i)
-                   != klabels.at<u_int32_t>(i + 1) )
-          {
-            line.sX = x + 1; line.sY = y;
-            line.eX = x + 1; line.eY = y + 1;
-            {
-              linelists[klabels.at<u_int32_t>(i)].push_back(line);
-            }
-          }
-          // check left pixel
-          if ( x == 0 )
-          {
-            line.sX = x; line.sY = y;
-            line.eX = x, line.eY = y + 1;
-            {
-              linelists[klabels.at<u_int32_t>(i)].push_back(line);
-            }
-          } else if ( klabels.at<u_int32_t>(i)
-                   != klabels.at<u_int32_t>(i - 1) )
-          {
-            line.sX = x; line.sY = y;
-            line.eX = x, line.eY = y + 1;
-            {
-              linelists[klabels.at<u_int32_t>(i)].push_back(line);
-            }
-          }
-          // check top pixel
-          if ( y == 0 )
-          {
-            line.sX = x;     line.sY = y;
-            line.eX = x + 1; line.eY = y;
-            {
-              linelists[klabels.at<u_int32_t>(i)].push_back(line);
-            }
-          } else if ( klabels.at<u_int32_t>(i)
-                   != klabels.at<u_int32_t>((y-1)*klabels.cols + x) )
-          {
-            line.sX = x; line.sY = y;
-            line.eX = x + 1; line.eY = y;
+    for (int y = y0; y < y1; y++)
+    {
+        // cursors into the rows above and below
+        size_t up = ( y > 0 ) ? runs.offset[y - 1] : 0;
+        size_t down = ( y < rows - 1 ) ? runs.offset[y + 1] : 0;
+        for ( size_t i = runs.offset[y]; i + 1 < runs.offset[y + 1]; i++ )
+        {
+            const int k = runs.runs[i].label;
+            if ( k < 0 ) continue;
+            const int x0 = runs.runs[i].x;
+            const int x1 = runs.runs[i + 1].x;
+            const int next = runs.runs[i + 1].label;
+            std::vector< LINE >& list = lines[k - lo];
+
+            // pixel extent
+            int *box = &boxes[4 * (k - lo)];
+            box[0] = std::min( box[0], x0 );
+            box[1] = std::min( box[1], y );
+            box[2] = std::max( box[2], x1 );
+            box[3] = std::max( box[3], y + 1 );
+
+            LINE line;
+            // right end of run
+            line.sX = x1; line.sY = y;
+            line.eX = x1; line.eY = y + 1;
+            list.push_back(line);
+            if ( adjacency && ( next >= 0 ) )
+              adj[ AdjacencyKey( k, next ) ] += 1;
+            // left end of run
+            line.sX = x0; line.sY = y + 1;
+            line.eX = x0; line.eY = y;
+            list.push_back(line);
+
+            // top edges where the row above differs
+            for ( int x = x0; x < x1; )
             {
-              linelists[klabels.at<u_int32_t>(i)].push_back(line);
+              int end = x1, above = -1;
+              if ( y > 0 )
+              {
+                up = RunAt( runs, up, x );
+                end = std::min( x1, runs.runs[up + 1].x );
+                above = runs.runs[up].label;
+              }
+              if ( above != k )
+                for ( ; x < end; x++ )
+                {
+                  line.sX = x;     line.sY = y;
+                  line.eX = x + 1; line.eY = y;
+                  list.push_back(line);
+                }
+              x = end;
             }
-          }
-          // check bottom pixel
-          if ( y == klabels.rows - 1 )
-          {
-            line.sX = x;     line.sY = y + 1;
-            line.eX = x + 1; line.eY = y + 1;
+
+            // bottom edges where the row below differs
+            for ( int x = x0; x < x1; )
             {
-              linelists[klabels.at<u_int32_t>(i)].push_back(line);
+              int end = x1, below = -1;
+              if ( y < rows - 1 )
+              {
+                down = RunAt( runs, down, x );
+                end = std::min( x1, runs.runs[down + 1].x );
+                below = runs.runs[down].label;
+              }
+              if ( below != k )
+              {
+                if ( adjacency && ( below >= 0 ) )
+                  adj[ AdjacencyKey( k, below ) ] += end - x;
+                for ( ; x < end; x++ )
+                {
+                  line.sX = x + 1; line.sY = y + 1;
+                  line.eX = x;     line.eY = y + 1;
+                  list.push_back(line);
+                }
+              }
+              x = end;
             }
+        }
+    }
+
+    // euler number by bit-quads on grid vertices, only
+    // vertices on run ends of either row can score
+    if ( shapes )
+    {
+      std::vector< int >& quads = stripequads[s];
+      quads.assign( hi - lo + 1, 0 );
+      const int v1 = ( y1 == rows ) ? rows + 1 : y1;
+      for ( int y = y0; y < v1; y++ )
+      {
+        const bool top = ( y > 0 ), bottom = ( y < rows );
+        size_t a = top ? runs.offset[y - 1] : 0, ae = top ? runs.offset[y] : 0;
+        size_t b = bottom ? runs.offset[y] : 0, be = bottom ? runs.offset[y + 1] : 0;
+        size_t ua = a, ub = a, la = b, lb = b;
+        while ( ( a < ae ) || ( b < be ) )
+        {
+          // next run end in either row
+          int x;
+          if ( ( b >= be ) || ( ( a < ae ) && ( runs.runs[a].x <= runs.runs[b].x ) ) )
+            x = runs.runs[a].x;
+          else
+            x = runs.runs[b].x;
+          while ( ( a < ae ) && ( runs.runs[a].x == x ) ) a++;
+          while ( ( b < be ) && ( runs.runs[b].x == x ) ) b++;
 
-          } else if ( klabels.at<u_int32_t>(i)
-                   != klabels.at<u_int32_t>((y+1)*klabels.cols + x) )
+          // 2x2 pixels around vertex (x,y)
+          int q[4];
+          q[0] = top ? RunLabel( runs, ua, x - 1 ) : -1;
+          q[1] = top ? RunLabel( runs, ub, x ) : -1;
+          q[2] = bottom ? RunLabel( runs, la, x - 1 ) : -1;
+          q[3] = bottom ? RunLabel( runs, lb, x ) : -1;
+          for ( int j = 0; j < 4; j++ )
           {
-            line.sX = x;     line.sY = y + 1;
-            line.eX = x + 1; line.eY = y + 1;
-            {
-              linelists[klabels.at<u_int32_t>(i)].push_back(line);
-            }
+            const int l = q[j];
+            if ( l < 0 ) continue;
+            // count each label once
+            bool seen = false;
+            for ( int p = 0; p < j; p++ )
+              if ( q[p] == l ) seen = true;
+            if ( seen ) continue;
+            const int n = ( q[0] == l ) + ( q[1] == l ) + ( q[2] == l ) + ( q[3] == l );
+            if ( n == 1 ) quads[l - lo] += 1;
+            else if ( n == 3 ) quads[l - lo] -= 1;
+            else if ( ( n == 2 )
+                   && ( ( ( q[0] == l ) && ( q[3] == l ) )
+                     || ( ( q[1] == l ) && ( q[2] == l ) ) ) ) quads[l - lo] += 2;
           }
-       }
-       GDALTermProgress( (float)(y) / (float)(klabels.rows), NULL, NULL );
+        }
+      }
+    }
+  }
+  GDALTermProgress( 0.5f, NULL, NULL );
+
+  // gather stripes in raster order
+  const int m_labels = (int) linelists.size();
+  bboxes.create( m_labels, 4, CV_32S );
+  if ( shapes )
+  {
+    shapes->create( m_labels, SHAPE_COUNT, CV_64F );
+    *shapes = Scalar::all( 0 );
+  }
+  #pragma omp parallel for schedule(dynamic, 4096)
+  for ( int k = 0; k < m_labels; k++ )
+  {
+    int quads = 0;
+    int *box = bboxes.ptr<int>(k);
+    box[0] = INT_MAX; box[1] = INT_MAX;
+    box[2] = -1;      box[3] = -1;
+    for ( int s = 0; s < nstripes; s++ )
+    {
+      if ( ( k < stripes[s].lo ) || ( k > stripes[s].hi ) ) continue;
+      const int *sbox = &stripeboxes[s][4 * (k - stripes[s].lo)];
+      box[0] = std::min( box[0], sbox[0] );
+      box[1] = std::min( box[1], sbox[1] );
+      box[2] = std::max( box[2], sbox[2] );
+      box[3] = std::max( box[3], sbox[3] );
+      if ( shapes )
+        quads += stripequads[s][k - stripes[s].lo];
+      std::vector< LINE >& list = stripelines[s][k - stripes[s].lo];
+      if ( linelists[k].empty() )
+        linelists[k].swap( list );
+      else
+        linelists[k].insert( linelists[k].end(), list.begin(), list.end() );
+      std::vector< LINE >().swap( list );
+    }
+    // no pixels
+    if ( box[2] < 0 )
+      box[0] = box[1] = box[2] = box[3] = 0;
+    // perimeter and holes of 4-connected label
+    if ( shapes && ( box[2] > 0 ) )
+    {
+      shapes->at<double>(k, SHAPE_PERIMETER) = (double) linelists[k].size();
+      shapes->at<double>(k, SHAPE_HOLES) = (double) std::max( 0, 1 - quads / 4 );
     }
-    GDALTermProgress( 1.0f, NULL, NULL );
+  }
+  stripelines.clear();
+  stripeboxes.clear();
+  stripequads.clear();
+
+  // label neighbours with shared boundary
+  if ( adjacency )
+  {
+    for ( int s = 1; s < nstripes; s++ )
+    {
+      for ( auto it = stripeadj[s].begin(); it != stripeadj[s].end(); ++it )
+        stripeadj[0][it->first] += it->second;
+      stripeadj[s].clear();
+    }
+    adjacency->clear();
+    adjacency->reserve( stripeadj[0].size() );
+    for ( auto it = stripeadj[0].begin(); it != stripeadj[0].end(); ++it )
+    {
+      ADJACENCY pair;
+      pair.lA = (unsigned int) ( it->first >> 32 );
+      pair.lB = (unsigned int) ( it->first & 0xffffffffULL );
+      pair.length = it->second;
+      adjacency->push_back( pair );
+    }
+    std::sort( adjacency->begin(), adjacency->end(), AdjacencyLess );
+    printf ("       found %lu neighbour pairs\n", adjacency->size());
+    printf ("       ");
+  }
+  GDALTermProgress( 1.0f, NULL, NULL );
 }
 
 
-void SavePolygons( const std::vector< std::string > InFilenames,
-                   const char *OutFilename, const char *OutFormat,
-                   const cv::Mat klabels,
-                   const std::vector< cv::Mat > raster,
-                   const Mat labelpixels,
-                   const Mat avgCH, const Mat stdCH,
-                   std::vector< std::vector< LINE > >& linelists )
+// order directed edges by start vertex
+static bool LineStartLess( const LINE& a, const LINE& b )
 {
+  if ( a.sY != b.sY ) return a.sY < b.sY;
+  return a.sX < b.sX;
+}
 
-  CPLLocaleC oLocaleCForcer();
-  CPLErrorReset();
+// doubled signed area
+static long long RingArea2( const std::vector< cv::Point >& ring )
+{
+  long long area = 0;
+  const size_t n = ring.size();
+  for ( size_t i = 0; i < n; i++ )
+  {
+    const cv::Point& p = ring[i];
+    const cv::Point& q = ring[(i + 1) % n];
+    area += (long long) p.x * q.y - (long long) q.x * p.y;
+  }
+  return area;
+}
+
+// even-odd point in ring
+static bool RingContains( const std::vector< cv::Point >& ring, const double px, const double py )
+{
+  bool inside = false;
+  const size_t n = ring.size();
+  for ( size_t i = 0, j = n - 1; i < n; j = i++ )
+  {
+    const cv::Point& a = ring[i];
+    const cv::Point& b = ring[j];
+    if ( ( ( a.y > py ) != ( b.y > py ) )
+      && ( px < (double)( b.x - a.x ) * ( py - a.y ) / (double)( b.y - a.y ) + a.x ) )
+      inside = !inside;
+  }
+  return inside;
+}
+
+void BuildPolygons( std::vector< LINE >& lines,
+                    std::vector< std::vector< std::vector< cv::Point > > >& polygons )
+{
+  polygons.clear();
 
+  const size_t n = lines.size();
+  if ( n == 0 ) return;
+
+  std::sort( lines.begin(), lines.end(), LineStartLess );
+
+  // successor edge, prefer right turns on pinch vertices
+  std::vector< int > next( n, -1 );
+  for ( size_t i = 0; i < n; i++ )
+  {
+    LINE key;
+    key.sX = lines[i].eX; key.sY = lines[i].eY;
+    const int hX = (int) lines[i].eX - (int) lines[i].sX;
+    const int hY = (int) lines[i].eY - (int) lines[i].sY;
+
+    int rank = 3;
+    std::vector< LINE >::const_iterator it;
+    it = std::lower_bound( lines.begin(), lines.end(), key, LineStartLess );
+    for ( ; ( it != lines.end() ) && ( it->sX == key.sX ) && ( it->sY == key.sY ); ++it )
+    {
+      const int dX = (int) it->eX - (int) it->sX;
+      const int dY = (int) it->eY - (int) it->sY;
+      int r;
+      if ( ( dX == -hY ) && ( dY == hX ) ) r = 0;
+      else if ( ( dX == hX ) && ( dY == hY ) ) r = 1;
+      else r = 2;
+      if ( r < rank )
+      {
+        rank = r;
+        next[i] = (int) ( it - lines.begin() );
+      }
+    }
+  }
+
+  // trace closed rings
+  std::vector< char > used( n, 0 );
+  std::vector< std::vector< cv::Point > > rings;
+  for ( size_t i = 0; i < n; i++ )
+  {
+    if ( used[i] ) continue;
+    std::vector< cv::Point > ring;
+    int j = (int) i;
+    while ( ( j >= 0 ) && ( ! used[j] ) )
+    {
+      used[j] = 1;
+      ring.push_back( cv::Point( lines[j].sX, lines[j].sY ) );
+      j = next[j];
+    }
+    if ( ring.size() < 4 ) continue;
+    rings.push_back( ring );
+  }
+
+  NestRings( rings, polygons );
+}
+
+void NestRings( std::vector< std::vector< cv::Point > >& rings,
+                std::vector< std::vector< std::vector< cv::Point > > >& polygons )
+{
+  polygons.clear();
+
+  // outer rings are clockwise in pixel space
+  std::vector< std::vector< cv::Point > > outers, holes;
+  std::vector< long long > areas;
+  for ( size_t r = 0; r < rings.size(); r++ )
+  {
+    if ( rings[r].size() < 3 ) continue;
+    const long long area = RingArea2( rings[r] );
+    if ( area > 0 )
+    {
+      outers.push_back( std::vector< cv::Point >() );
+      outers.back().swap( rings[r] );
+      areas.push_back( area );
+    }
+    else if ( area < 0 )
+    {
+      holes.push_back( std::vector< cv::Point >() );
+      holes.back().swap( rings[r] );
+    }
+  }
+
+  polygons.resize( outers.size() );
+  for ( size_t o = 0; o < outers.size(); o++ )
+    polygons[o].push_back( outers[o] );
+
+  // holes go in the smallest enclosing outer ring
+  for ( size_t h = 0; h < holes.size(); h++ )
+  {
+    int owner = -1;
+    if ( outers.size() == 1 )
+      owner = 0;
+    else
+    {
+      const double px = 0.5 * ( holes[h][0].x + holes[h][1].x );
+      const double py = 0.5 * ( holes[h][0].y + holes[h][1].y );
+      for ( size_t o = 0; o < outers.size(); o++ )
+        if ( ( ( owner < 0 ) || ( areas[o] < areas[owner] ) )
+           && RingContains( outers[o], px, py ) )
+          owner = (int) o;
+    }
+    if ( owner >= 0 )
+      polygons[owner].push_back( holes[h] );
+  }
+}
+
+// cross product of turn at b
+static inline long long Turn( const cv::Point& a, const cv::Point& b, const cv::Point& c )
+{
+  return (long long)( b.x - a.x ) * ( c.y - b.y )
+       - (long long)( b.y - a.y ) * ( c.x - b.x );
+}
+
+// remove colinear vertices of closed ring
+static void RemoveColinear( std::vector< cv::Point >& ring )
+{
+  const size_t n = ring.size();
+  if ( n < 4 ) return;
+
+  // start from a true corner
+  size_t start = n;
+  for ( size_t i = 0; i < n; i++ )
+    if ( Turn( ring[(i + n - 1) % n], ring[i], ring[(i + 1) % n] ) != 0 )
+    {
+      start = i;
+      break;
+    }
+  if ( start == n ) return;
+
+  std::vector< cv::Point > simple;
+  simple.reserve( n );
+  simple.push_back( ring[start] );
+  for ( size_t k = 1; k < n; k++ )
+  {
+    const cv::Point& point = ring[(start + k) % n];
+    const cv::Point& pointNext = ring[(start + k + 1) % n];
+    // only if not colinear with previous and next
+    if ( Turn( simple.back(), point, pointNext ) != 0 )
+      simple.push_back( point );
+  }
+  if ( simple.size() >= 3 )
+    ring.swap( simple );
+}
+
+void SimplifyRing( std::vector< cv::Point >& ring, const bool stair, const double tolerance )
+{
+  RemoveColinear( ring );
+
+  // drop corners of single pixel zig-zags
+  if ( stair && ( ring.size() > 4 ) )
+  {
+    const size_t n = ring.size();
+    std::vector< int > sign( n );
+    for ( size_t i = 0; i < n; i++ )
+    {
+      const long long t = Turn( ring[(i + n - 1) % n], ring[i], ring[(i + 1) % n] );
+      sign[i] = ( t > 0 ) - ( t < 0 );
+    }
+    std::vector< cv::Point > smooth;
+    smooth.reserve( n );
+    for ( size_t i = 0; i < n; i++ )
+    {
+      const cv::Point& a = ring[(i + n - 1) % n];
+      const cv::Point& b = ring[i];
+      const cv::Point& c = ring[(i + 1) % n];
+      const bool step = ( abs( b.x - a.x ) + abs( b.y - a.y ) == 1 )
+                     || ( abs( c.x - b.x ) + abs( c.y - b.y ) == 1 );
+      const bool zigzag = ( sign[i] != sign[(i + n - 1) % n] )
+                       || ( sign[i] != sign[(i + 1) % n] );
+      if ( ! ( step && zigzag ) )
+        smooth.push_back( b );
+    }
+    if ( ( smooth.size() >= 3 ) && ( RingArea2( smooth ) != 0 ) )
+    {
+      ring.swap( smooth );
+      RemoveColinear( ring );
+    }
+  }
+
+  // douglas-peucker in pixel units
+  if ( tolerance > 0.0f )
+  {
+    std::vector< cv::Point > approx;
+    cv::approxPolyDP( ring, approx, tolerance, true );
+    if ( ( approx.size() >= 3 ) && ( RingArea2( approx ) != 0 ) )
+      ring.swap( approx );
+  }
+}
+
+// map pixel ring through full affine transform
+static OGRLinearRing *GeoRing( const std::vector< cv::Point >& ring, const double *gt,
+                               std::vector< double >& pX, std::vector< double >& pY )
+{
+  const int n = (int) ring.size();
+  pX.resize( n + 1 );
+  pY.resize( n + 1 );
+  for ( int i = 0; i < n; i++ )
+  {
+    const double x = ring[i].x;
+    const double y = ring[i].y;
+    pX[i] = gt[0] + x * gt[1] + y * gt[2];
+    pY[i] = gt[3] + x * gt[4] + y * gt[5];
+  }
+  // close ring
+  pX[n] = pX[0];
+  pY[n] = pY[0];
+
+  OGRLinearRing *linestring = new OGRLinearRing();
+  linestring->setPoints( n + 1, &pX[0], &pY[0] );
+  return linestring;
+}
+
+
+// hilbert curve distance of (x,y) on n x n grid
+static unsigned long long HilbertKey( const unsigned long long n,
+                                      unsigned long long x, unsigned long long y )
+{
+  unsigned long long d = 0;
+  for ( unsigned long long s = n / 2; s > 0; s /= 2 )
+  {
+    const unsigned long long rx = ( x & s ) > 0;
+    const unsigned long long ry = ( y & s ) > 0;
+    d += s * s * ( ( 3 * rx ) ^ ry );
+    // rotate quadrant
+    if ( ry == 0 )
+    {
+      if ( rx == 1 )
+      {
+        x = n - 1 - x;
+        y = n - 1 - y;
+      }
+      std::swap( x, y );
+    }
+  }
+  return d;
+}
+
+void HilbertOrder( const cv::Mat bboxes, std::vector< int >& order )
+{
+  // grid of doubled bbox centers
+  int extent = 1;
+  for ( int k = 0; k < bboxes.rows; k++ )
+    extent = std::max( extent, std::max( bboxes.at<int>(k,2), bboxes.at<int>(k,3) ) );
+  unsigned long long n = 1;
+  while ( n < 2ULL * (unsigned long long) extent + 1 ) n <<= 1;
+
+  std::vector< std::pair< unsigned long long, int > > keys( bboxes.rows );
+  #pragma omp parallel for schedule(static)
+  for ( int k = 0; k < bboxes.rows; k++ )
+  {
+    const int *box = bboxes.ptr<int>(k);
+    keys[k].first = HilbertKey( n, box[0] + box[2], box[1] + box[3] );
+    keys[k].second = k;
+  }
+  std::sort( keys.begin(), keys.end() );
+
+  order.resize( keys.size() );
+  for ( size_t k = 0; k < keys.size(); k++ )
+    order[k] = keys[k].second;
+}
+
+// single quoted sql string
+static std::string SqlLiteral( const char *value )
+{
+  std::string quoted = "'";
+  for ( const char *c = value; c && *c; c++ )
+  {
+    if ( *c == '\'' ) quoted += '\'';
+    quoted += *c;
+  }
+  return quoted + "'";
+}
+
+// one datasource with the segments in order[n0,n1)
+static void SaveShard( const GEOREF& georef,
+                       const char *OutFilename, const char *OutFormat,
+                       const Mat labelpixels,
+                       const std::vector< int >& labelids,
+                       const Mat avgCH, const Mat stdCH,
+                       const std::vector< std::string >& zsnames,
+                       const Mat avgZS, const Mat stdZS,
+                       std::vector< std::vector< LINE > >& linelists,
+                       const cv::Mat bboxes, const cv::Mat shapes,
+                       const std::vector< ADJACENCY >& adjacency,
+                       const VECTOROPTS& opts,
+                       const TOPOLOGY *topology,
+                       const std::vector< int >& order,
+                       const size_t n0, const size_t n1,
+                       size_t *done, std::string& layername )
+{
 #if GDALVER >= 2
   GDALDriver *liDriver;
   liDriver = GetGDALDriverManager()->GetDriverByName( OutFormat );
@@ -145,13 +653,7 @@ void SavePolygons( const std::vector< std::string > InFilenames,
   // speed up SQLite
   CPLSetThreadLocalConfigOption("OGR_SQLITE_SYNCHRONOUS", "OFF");
 
-  if( liDriver == NULL )
-  {
-      printf( "\nERROR: %s driver not available.\n", OutFormat );
-      exit( 1 );
-  }
-
-  const size_t m_bands = raster.size();
+  const size_t m_bands = avgCH.rows;
   const size_t m_labels = labelpixels.rows;
 
 #if GDALVER >= 2
@@ -168,31 +670,30 @@ void SavePolygons( const std::vector< std::string > InFilenames,
       exit( 1 );
   }
 
-  // dataset
-  GDALDataset* piDataset;
-  piDataset = (GDALDataset*) GDALOpen(InFilenames[0].c_str(), GA_ReadOnly);
-
   // spatialref
-  OGRSpatialReference oSRS;
-  oSRS.SetProjCS( piDataset->GetProjectionRef() );
+  OGRSpatialReference oSRS( georef.projection.c_str() );
+
+  // spatial index once at end
+  char **papszLCO = NULL;
+  const bool gpkg = EQUAL( OutFormat, "GPKG" );
+  const bool shape = EQUAL( OutFormat, "ESRI Shapefile" );
+  if ( opts.hilbert && gpkg )
+    papszLCO = CSLSetNameValue( papszLCO, "SPATIAL_INDEX", "NO" );
 
   OGRLayer *liLayer;
-  liLayer = liDS->CreateLayer( "segments", &oSRS, wkbPolygon, NULL );
+  liLayer = liDS->CreateLayer( "segments", georef.projection.empty() ? NULL : &oSRS,
+                               wkbPolygon, papszLCO );
+  CSLDestroy( papszLCO );
 
   if( liLayer == NULL )
   {
       printf( "\nERROR: Layer creation failed.\n" );
       exit( 1 );
   }
+  // drivers may rename it, shapefile uses the file name
+  layername = liLayer->GetName();
   // spatial transform
-  double adfGeoTransform[6];
-  double oX = 0.0f; double oY = 0.0f;
-  double mX = 1.0f; double mY = -1.0f;
-  if( piDataset->GetGeoTransform( adfGeoTransform ) == CE_None ) {
-      oX = adfGeoTransform[0]; oY = adfGeoTransform[3];
-      mX = adfGeoTransform[1]; mY = adfGeoTransform[5];
-  }
-  GDALClose( (GDALDatasetH) piDataset );
+  const double *adfGeoTransform = georef.transform;
 
   OGRFieldDefn *clsIdField = new OGRFieldDefn( "CLASS", OFTInteger );
   liLayer->CreateField( clsIdField );
@@ -216,134 +717,234 @@ void SavePolygons( const std::vector< std::string > InFilenames,
      liLayer->CreateField( lavrgField );
   }
 
-  int multiring = 0;
-  printf ("Write File: %s (polygon)\n", OutFilename);
-  for (size_t k = 0; k < m_labels; k++)
+  for ( size_t z = 0; z < zsnames.size(); z++ )
   {
+     std::string FieldName = zsnames[z] + "_AVG";
+     OGRFieldDefn *zavrgField = new OGRFieldDefn( FieldName.c_str(), OFTReal );
+     liLayer->CreateField( zavrgField );
+     FieldName = zsnames[z] + "_STD";
+     OGRFieldDefn *zstdvField = new OGRFieldDefn( FieldName.c_str(), OFTReal );
+     liLayer->CreateField( zstdvField );
+  }
 
-      if ( multiring == 1 )
-      {
-        k = k - 1;
-        multiring = 0;
-      }
+  if ( opts.shapes )
+  {
+    const char *ShapeFields[] = { "PERIMETER", "CENTER_X", "CENTER_Y",
+                                  "MIN_X", "MIN_Y", "MAX_X", "MAX_Y",
+                                  "COMPACT", "ELONGATE" };
+    for ( size_t f = 0; f < sizeof( ShapeFields ) / sizeof( ShapeFields[0] ); f++ )
+    {
+      OGRFieldDefn *shapeField = new OGRFieldDefn( ShapeFields[f], OFTReal );
+      liLayer->CreateField( shapeField );
+    }
+    OGRFieldDefn *holesField = new OGRFieldDefn( "HOLES", OFTInteger );
+    liLayer->CreateField( holesField );
+  }
 
-      if ( linelists[k].size() == 0 )
-        continue;
+  // write in spatially coherent batches
+  const bool transact = opts.hilbert && liLayer->TestCapability( OLCTransactions );
+  const size_t batch = 65536;
+  size_t written = 0;
+  if ( transact ) liLayer->StartTransaction();
 
-      // insert field data
-      OGRFeature *liFeature;
-      liFeature = OGRFeature::CreateFeature( liLayer->GetLayerDefn() );
-      liFeature->SetField( "CLASS", (int) k );
-      liFeature->SetField( "AREA", (int) labelpixels.at<int>(k) );
+  std::vector< double > pX, pY;
+  std::vector< std::vector< std::vector< cv::Point > > > polygons;
+  printf ("Write File: %s (polygon)\n", OutFilename);
+  for (size_t n = n0; n < n1; n++)
+  {
+      const size_t k = order[n];
 
-      for ( size_t b = 0; b < m_bands; b++ )
+      if ( topology )
       {
-        stringstream value; value << b+1;
-        std::string FieldName = value.str() + "_AVERAGE";
-        liFeature->SetField( FieldName.c_str(), (double) avgCH.at<double>(b,k) );
+        // rings from shared, already simplified arcs
+        if ( topology->offset[k] == topology->offset[k + 1] )
+          continue;
+        ArcPolygons( *topology, (int) k, polygons );
       }
-      for ( size_t b = 0; b < m_bands; b++ )
+      else
       {
-        stringstream value; value << b+1;
-        std::string FieldName = value.str() + "_STDDEV";
-        liFeature->SetField( FieldName.c_str(), (double) stdCH.at<double>(b,k) );
+        if ( linelists[k].size() == 0 )
+          continue;
+
+        // assemble rings in pixel space
+        BuildPolygons( linelists[k], polygons );
+        std::vector< LINE >().swap( linelists[k] );
       }
-      // initiate polygon start
-      OGRLinearRing linestring;
-      linestring.setCoordinateDimension(2);
-      linestring.addPoint( oX + (double) linelists[k][0].sX * mX, oY + mY * (double) linelists[k][0].sY );
-      linestring.addPoint( oX + (double) linelists[k][0].eX * mX, oY + mY * (double) linelists[k][0].eY );
-      linelists[k].erase( linelists[k].begin() );
-
-      // construct polygon from lines
-      while ( linelists[k].size() > 0 )
+
+      for ( size_t p = 0; p < polygons.size(); p++ )
       {
-        if ( multiring == 1 ) break;
+        // insert field data
+        OGRFeature *liFeature;
+        liFeature = OGRFeature::CreateFeature( liLayer->GetLayerDefn() );
+        // stable ids when seeded from previous labels
+        liFeature->SetField( "CLASS", labelids.empty() ? (int) k : labelids[k] );
+        liFeature->SetField( "AREA", (int) labelpixels.at<int>(k) );
 
-        vector<LINE>::iterator it = linelists[k].begin();
-        for (; it != linelists[k].end(); ++it)
+        for ( size_t b = 0; b < m_bands; b++ )
         {
-          double ltX = linestring.getX(linestring.getNumPoints()-1);
-          double ltY = linestring.getY(linestring.getNumPoints()-1);
-          double csX = oX + (double) it->sX * mX;
-          double csY = oY + mY * (double) it->sY;
-          double ceX = oX + (double) it->eX * mX;
-          double ceY = oY + mY * (double) it->eY;
-
-          if ( ( csX == ltX  ) && ( csY == ltY ) ) {
-              linestring.addPoint(ceX, ceY);
-              linelists[k].erase(it);
-              break;
-          }
-          if ( ( ceX == ltX  ) && ( ceY == ltY ) ) {
-              linestring.addPoint(csX, csY);
-              linelists[k].erase(it);
-              break;
-          }
-          if (it == linelists[k].end()-1) {
-              multiring = 1;
-              break;
-          }
+          stringstream value; value << b+1;
+          std::string FieldName = value.str() + "_AVERAGE";
+          liFeature->SetField( FieldName.c_str(), (double) avgCH.at<double>(b,k) );
+        }
+        for ( size_t b = 0; b < m_bands; b++ )
+        {
+          stringstream value; value << b+1;
+          std::string FieldName = value.str() + "_STDDEV";
+          liFeature->SetField( FieldName.c_str(), (double) stdCH.at<double>(b,k) );
         }
-      }
 
-      OGRPolygon polygon;
-      linestring.closeRings();
+        // zonal values, unset where no valid pixel
+        for ( size_t z = 0; z < zsnames.size(); z++ )
+        {
+          if ( std::isnan( avgZS.at<double>(z,k) ) ) continue;
+          std::string FieldName = zsnames[z] + "_AVG";
+          liFeature->SetField( FieldName.c_str(), avgZS.at<double>(z,k) );
+          FieldName = zsnames[z] + "_STD";
+          liFeature->SetField( FieldName.c_str(), stdZS.at<double>(z,k) );
+        }
 
-      // simplify poligons
-      // remove colinear vertices
-      OGRLinearRing linesimple;
-      float pointPrevX = 0, pointPrevY = 0;
-      for (int i = 0; i < linestring.getNumPoints(); i++)
-      {
-        OGRPoint point;
-        linestring.getPoint(i, &point);
+        if ( opts.shapes )
+        {
+          const double *shape = shapes.ptr<double>(k);
+          const int *box = bboxes.ptr<int>(k);
+          const double *gt = adfGeoTransform;
+          // bounds of mapped pixel box corners
+          double minX = DBL_MAX, minY = DBL_MAX, maxX = -DBL_MAX, maxY = -DBL_MAX;
+          for ( int c = 0; c < 4; c++ )
+          {
+            const double px = box[ ( c & 1 ) ? 2 : 0 ];
+            const double py = box[ ( c & 2 ) ? 3 : 1 ];
+            const double mx = gt[0] + px * gt[1] + py * gt[2];
+            const double my = gt[3] + px * gt[4] + py * gt[5];
+            minX = std::min( minX, mx ); maxX = std::max( maxX, mx );
+            minY = std::min( minY, my ); maxY = std::max( maxY, my );
+          }
+          const double cx = shape[SHAPE_CX], cy = shape[SHAPE_CY];
+          liFeature->SetField( "PERIMETER", shape[SHAPE_PERIMETER] );
+          liFeature->SetField( "CENTER_X", gt[0] + cx * gt[1] + cy * gt[2] );
+          liFeature->SetField( "CENTER_Y", gt[3] + cx * gt[4] + cy * gt[5] );
+          liFeature->SetField( "MIN_X", minX );
+          liFeature->SetField( "MIN_Y", minY );
+          liFeature->SetField( "MAX_X", maxX );
+          liFeature->SetField( "MAX_Y", maxY );
+          liFeature->SetField( "COMPACT", shape[SHAPE_COMPACT] );
+          liFeature->SetField( "ELONGATE", shape[SHAPE_ELONG] );
+          liFeature->SetField( "HOLES", (int) shape[SHAPE_HOLES] );
+        }
 
-        // start
-        if ( i == 0)
+        // simplify and georeference rings
+        OGRPolygon polygon;
+        for ( size_t r = 0; r < polygons[p].size(); r++ )
         {
-          linesimple.addPoint( &point );
-          pointPrevX = point.getX();
-          pointPrevY = point.getY();
-          continue;
+          if ( !topology )
+            SimplifyRing( polygons[p][r], opts.stair, opts.dptol );
+          polygon.addRingDirectly( GeoRing( polygons[p][r], adfGeoTransform, pX, pY ) );
         }
-        // end vertex
-        if ( i == linestring.getNumPoints() - 1 )
+        liFeature->SetGeometry( &polygon );
+
+        if( liLayer->CreateFeature( liFeature ) != OGRERR_NONE )
         {
-          linesimple.addPoint( &point );
-          continue;
+           printf( "\nERROR: Failed to create feature in vector layer.\n" );
+           exit( 1 );
         }
+        OGRFeature::DestroyFeature( liFeature );
 
-        OGRPoint pointNext;
-        linestring.getPoint(i+1, &pointNext);
-        //     | x1 y1 1 |
-        // det | x2 y2 1 | = 0 => p1,p2,p3 are colinear
-        //     | x3 y3 1 |
-        // x1*(y2-y3) + x2*(y3-y1) + x3*(y1-y2) == 0
-        // only if not colinear with previous and next
-        if ( pointPrevX*(point.getY()-pointNext.getY()) +
-             point.getX()*(pointNext.getY()-pointPrevY) +
-             pointNext.getX()*(pointPrevY-point.getY()) != 0 )
+        written++;
+        if ( transact && ( ( written % batch ) == 0 ) )
         {
-          linesimple.addPoint( &point );
-          pointPrevX = point.getX();
-          pointPrevY = point.getY();
+          liLayer->CommitTransaction();
+          liLayer->StartTransaction();
         }
       }
+      // shards share one progress line
+      #pragma omp critical (progress)
+      {
+        (*done)++;
+        if ( ( ( *done % 1024 ) == 0 ) || ( *done == m_labels ) )
+          GDALTermProgress( (float)(*done) / (float)(m_labels), NULL, NULL );
+      }
+  }
+  if ( transact ) liLayer->CommitTransaction();
+
+  // build spatial index
+  if ( opts.hilbert && ( gpkg || shape ) )
+  {
+    // shapefile layers are named after the file
+    const std::string layer = liLayer->GetName();
+    std::string sql;
+    if ( gpkg )
+      sql = std::string( "SELECT CreateSpatialIndex(" ) + SqlLiteral( layer.c_str() )
+          + ", " + SqlLiteral( liLayer->GetGeometryColumn() ) + ")";
+    else
+      sql = std::string( "CREATE SPATIAL INDEX ON \"" ) + layer + "\"";
+    printf ("Build spatial index\n");
+    CPLErrorReset();
+    bool indexed = true;
+    OGRLayer *result = liDS->ExecuteSQL( sql.c_str(), NULL, NULL );
+    if ( result )
+    {
+      // geopackage returns 1 on success
+      OGRFeature *row = result->GetNextFeature();
+      indexed = ( row != NULL ) && ( row->GetFieldAsInteger( 0 ) == 1 );
+      if ( row ) OGRFeature::DestroyFeature( row );
+      liDS->ReleaseResultSet( result );
+    }
+    else if ( gpkg )
+      indexed = false;
+    if ( !indexed || ( CPLGetLastErrorType() >= CE_Failure ) )
+      printf( "\nWARNING: Spatial index on %s failed: %s\n",
+              layer.c_str(), CPLGetLastErrorMsg() );
+  }
+
+  // neighbours table
+  if ( adjacency.size() > 0 )
+  {
+    printf ("\n");
+    OGRLayer *adLayer;
+    adLayer = liDS->CreateLayer( "adjacency", NULL, wkbNone, NULL );
+
+    if( adLayer == NULL )
+    {
+      printf( "\nWARNING: Output format cannot hold adjacency table, use -h5stat.\n" );
+    }
+    else
+    {
+      OGRFieldDefn *clsAField = new OGRFieldDefn( "CLASS_A", OFTInteger );
+      adLayer->CreateField( clsAField );
+
+      OGRFieldDefn *clsBField = new OGRFieldDefn( "CLASS_B", OFTInteger );
+      adLayer->CreateField( clsBField );
+
+      OGRFieldDefn *lengthField = new OGRFieldDefn( "LENGTH", OFTInteger );
+      adLayer->CreateField( lengthField );
 
-      // as polygon geometry
-      polygon.addRing( &linesimple );
-      liFeature->SetGeometry( &polygon );
+      const bool transact = adLayer->TestCapability( OLCTransactions );
+      if ( transact ) adLayer->StartTransaction();
 
-      if( liLayer->CreateFeature( liFeature ) != OGRERR_NONE )
+      printf ("Write File: %s (adjacency)\n", OutFilename);
+      for ( size_t n = 0; n < adjacency.size(); n++ )
       {
-         printf( "\nERROR: Failed to create feature in vector layer.\n" );
-         exit( 1 );
+        OGRFeature *adFeature;
+        adFeature = OGRFeature::CreateFeature( adLayer->GetLayerDefn() );
+        const unsigned int lA = adjacency[n].lA;
+        const unsigned int lB = adjacency[n].lB;
+        adFeature->SetField( "CLASS_A", labelids.empty() ? (int) lA : labelids[lA] );
+        adFeature->SetField( "CLASS_B", labelids.empty() ? (int) lB : labelids[lB] );
+        adFeature->SetField( "LENGTH", (int) adjacency[n].length );
+
+        if( adLayer->CreateFeature( adFeature ) != OGRERR_NONE )
+        {
+           printf( "\nERROR: Failed to create feature in adjacency layer.\n" );
+           exit( 1 );
+        }
+        OGRFeature::DestroyFeature( adFeature );
+        if ( ( n % 65536 ) == 0 )
+          GDALTermProgress( (float)(n+1) / (float)(adjacency.size()), NULL, NULL );
       }
-      OGRFeature::DestroyFeature( liFeature );
-      GDALTermProgress( (float)(k+1) / (float)(m_labels), NULL, NULL );
+      if ( transact ) adLayer->CommitTransaction();
+      GDALTermProgress( 1.0f, NULL, NULL );
+    }
   }
-  GDALTermProgress( 1.0f, NULL, NULL );
 
 #if GDALVER >= 2
   GDALClose( liDS );
@@ -353,3 +954,108 @@ void SavePolygons( const std::vector< std::string > InFilenames,
 
 
 }
+
+void SavePolygons( const GEOREF& georef,
+                   const char *OutFilename, const char *OutFormat,
+                   const cv::Mat klabels,
+                   const std::vector< cv::Mat > raster,
+                   const Mat labelpixels,
+                   const std::vector< int >& labelids,
+                   const Mat avgCH, const Mat stdCH,
+                   const std::vector< std::string > zsnames,
+                   const Mat avgZS, const Mat stdZS,
+                   std::vector< std::vector< LINE > >& linelists,
+                   const cv::Mat bboxes, const cv::Mat shapes,
+                   const std::vector< ADJACENCY >& adjacency,
+                   const VECTOROPTS& opts,
+                   const TOPOLOGY *topology )
+{
+
+  CPLLocaleC oLocaleCForcer;
+  CPLErrorReset();
+
+#if GDALVER >= 2
+  GDALDriver *liDriver;
+  liDriver = GetGDALDriverManager()->GetDriverByName( OutFormat );
+#else
+  OGRSFDriver *liDriver;
+  liDriver = OGRSFDriverRegistrar::GetRegistrar()
+           ->GetDriverByName( OutFormat );
+#endif
+
+  if( liDriver == NULL )
+  {
+      printf( "\nERROR: %s driver not available.\n", OutFormat );
+      exit( 1 );
+  }
+
+  const size_t m_labels = labelpixels.rows;
+
+  // write order
+  std::vector< int > order;
+  if ( opts.hilbert )
+  {
+    printf ("Sort segments along hilbert curve\n");
+    HilbertOrder( bboxes, order );
+  }
+  else
+  {
+    order.resize( m_labels );
+    for ( size_t k = 0; k < m_labels; k++ )
+      order[k] = (int) k;
+  }
+
+  // hilbert slices are spatial shards, label order gives id ranges
+  const int shards = (int) std::max( (size_t) 1, std::min( (size_t) opts.shards, m_labels ) );
+  std::vector< std::string > names( shards );
+  for ( int i = 0; i < shards; i++ )
+    names[i] = ( shards == 1 ) ? std::string( OutFilename )
+             : std::string( CPLFormFilename( CPLGetPath( OutFilename ),
+                 CPLSPrintf( "%s_%i", CPLGetBasename( OutFilename ), i ),
+                 CPLGetExtension( OutFilename ) ) );
+
+  // one writer and datasource per shard
+  size_t done = 0;
+  std::vector< std::string > layers( shards );
+  #pragma omp parallel for schedule(dynamic, 1) num_threads(shards)
+  for ( int i = 0; i < shards; i++ )
+  {
+    const size_t n0 = m_labels * i / shards;
+    const size_t n1 = m_labels * ( i + 1 ) / shards;
+    // neighbours table goes with the first shard
+    SaveShard( georef, names[i].c_str(), OutFormat, labelpixels, labelids,
+               avgCH, stdCH, zsnames, avgZS, stdZS, linelists, bboxes, shapes,
+               ( i == 0 ) ? adjacency : std::vector< ADJACENCY >(),
+               opts, topology, order, n0, n1, &done, layers[i] );
+  }
+  GDALTermProgress( 1.0f, NULL, NULL );
+
+  // union of shards as one layer
+  if ( shards > 1 )
+  {
+    const std::string vrtname = CPLResetExtension( OutFilename, "vrt" );
+    VSILFILE *fp = VSIFOpenL( vrtname.c_str(), "wb" );
+    if ( fp == NULL )
+    {
+      printf( "\nERROR: Cannot write %s\n", vrtname.c_str() );
+      exit( 1 );
+    }
+    VSIFPrintfL( fp, "<OGRVRTDataSource>\n" );
+    VSIFPrintfL( fp, "  <OGRVRTUnionLayer name=\"segments\">\n" );
+    for ( int i = 0; i < shards; i++ )
+    {
+      VSIFPrintfL( fp, "    <OGRVRTLayer name=\"segments_%i\">\n", i );
+      char *source = CPLEscapeString( CPLGetFilename( names[i].c_str() ), -1, CPLES_XML );
+      char *layer = CPLEscapeString( layers[i].c_str(), -1, CPLES_XML );
+      VSIFPrintfL( fp, "      <SrcDataSource relativeToVRT=\"1\">%s</SrcDataSource>\n", source );
+      VSIFPrintfL( fp, "      <SrcLayer>%s</SrcLayer>\n", layer );
+      CPLFree( source );
+      CPLFree( layer );
+      VSIFPrintfL( fp, "    </OGRVRTLayer>\n" );
+    }
+    VSIFPrintfL( fp, "  </OGRVRTUnionLayer>\n" );
+    VSIFPrintfL( fp, "</OGRVRTDataSource>\n" );
+    VSIFCloseL( fp );
+    printf ("Write File: %s (%i shards)\n", vrtname.c_str(), shards);
+  }
+}
@@ -0,0 +1,190 @@
+/*
+ *  Copyright (c) 2015  Balint Cristian (cristian.balint@gmail.com)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+/* plan.cpp */
+/* Memory budget planner */
+
+#include <omp.h>
+#include <math.h>
+#include <algorithm>
+
+#include "gdal.h"
+#include "gdal_priv.h"
+#include "cpl_string.h"
+
+#include <opencv2/opencv.hpp>
+
+#include "gdal-segment.hpp"
+
+using namespace std;
+
+
+static const double MB = 1024.0f * 1024.0f;
+
+// human readable size
+static const char* Bytes( const double bytes )
+{
+  if ( bytes >= 1024.0f * MB )
+    return CPLSPrintf( "%.1f GB", bytes / ( 1024.0f * MB ) );
+  return CPLSPrintf( "%.0f MB", bytes / MB );
+}
+
+double ParseMemory( const char *value )
+{
+  char *end = NULL;
+  double bytes = strtod( value, &end );
+  switch ( end ? toupper( *end ) : 0 )
+  {
+    // suffixes scale through
+    case 'T': bytes *= 1024.0f;
+    case 'G': bytes *= 1024.0f;
+    case 'M': bytes *= 1024.0f;
+    case 'K': bytes *= 1024.0f;
+      break;
+    default:
+      // plain numbers are megabytes
+      bytes *= MB;
+      break;
+  }
+  return bytes;
+}
+
+// engine buffers beside the raster
+static double EngineBytes( const char *algo, const double pixels,
+                           const int nbands, const double pixbytes )
+{
+  if ( EQUAL( algo, "FH" ) )
+    // parent, size, threshold and two radix sorted edges per pixel
+    return pixels * ( 12.0f + 2.0f * 20.0f );
+  if ( EQUAL( algo, "SEEDS" ) )
+    // merged copy and block level labels
+    return pixels * ( pixbytes + 16.0f );
+  if ( EQUAL( algo, "LSC" ) )
+    // feature space and weights in float
+    return pixels * 4.0f * ( 2.0f * nbands + 6.0f );
+  // slic family: float channels, distances and labels
+  return pixels * 4.0f * ( nbands + 2.0f );
+}
+
+bool PlanMemory( const std::vector< std::string > InFilenames,
+                 const std::vector< std::string > StatFilenames,
+                 const std::vector< std::string > algos,
+                 const std::vector< int > regions,
+                 const double tres, const bool labcol, const bool warmstart,
+                 const double memlimit, PLAN& plan )
+{
+  // target grid as LoadRaster() will build it
+  double pixels = 0.0f, pixbytes = 0.0f, cols = 0.0f;
+  double resX = tres, resY = tres;
+  int nbands = 0;
+  for ( size_t i = 0; i < InFilenames.size(); i++ )
+  {
+    GDALDataset *piDataset = (GDALDataset*) GDALOpen( InFilenames[i].c_str(), GA_ReadOnly );
+    if ( piDataset == NULL )
+    {
+      printf( "\nERROR: Couldn't open dataset %s\n", InFilenames[i].c_str() );
+      return false;
+    }
+    double gt[6] = { 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, -1.0f };
+    piDataset->GetGeoTransform( gt );
+    if ( i == 0 )
+    {
+      cols = piDataset->GetRasterXSize() * fabs( gt[1] );
+      pixels = (double) piDataset->GetRasterXSize() * fabs( gt[1] )
+             * piDataset->GetRasterYSize() * fabs( gt[5] );
+      if ( tres <= 0.0f ) { resX = fabs( gt[1] ); resY = fabs( gt[5] ); }
+    }
+    if ( tres <= 0.0f )
+    {
+      resX = std::min( resX, fabs( gt[1] ) );
+      resY = std::min( resY, fabs( gt[5] ) );
+    }
+    for ( int b = 0; b < piDataset->GetRasterCount(); b++ )
+    {
+      const GDALDataType type = piDataset->GetRasterBand(b+1)->GetRasterDataType();
+      // byte and 16 bit stay, others load as float or double
+      const int size = GDALGetDataTypeSizeBytes( type );
+      pixbytes += ( size <= 2 ) ? size : std::max( 4, size );
+      nbands++;
+    }
+    GDALClose( (GDALDatasetH) piDataset );
+  }
+  pixels /= resX * resY;
+  cols /= resX;
+
+  // data shared by all runs
+  plan.pixels = pixels;
+  plan.shared = pixels * ( pixbytes + 1.0f );
+  if ( labcol ) plan.shared += pixels * pixbytes;
+  if ( warmstart ) plan.shared += pixels * 4.0f;
+  // transient while loading: lab conversion in float
+  const double loading = labcol ? pixels * 3.0f * 4.0f * 2.0f : 0.0f;
+
+  // one run: labels plus its largest stage
+  plan.run = 0.0f;
+  for ( size_t j = 0; j < algos.size(); j++ )
+  {
+    const double region = std::max( 1, regions[j] );
+    const double engine = EngineBytes( algos[j].c_str(), pixels, nbands, pixbytes );
+    // two pixel index maps, 64 bit beyond 2^31 pixels
+    const double merge = pixels * ( ( pixels > 2147483647.0f ) ? 16.0f : 8.0f );
+    // edge lists then per label statistics
+    const double contour = pixels * 64.0f / region
+                         + pixels / ( region * region ) * ( nbands * 16.0f + 64.0f );
+    plan.run = std::max( plan.run, pixels * 4.0f
+             + std::max( engine, std::max( merge, contour ) ) );
+  }
+
+  const int cores = omp_get_max_threads();
+  const double minimal = 16.0f * MB;
+  plan.threads = cores;
+  plan.runs = std::max( 1, (int) algos.size() );
+  plan.cache = GDALGetCacheMax64();
+  plan.window = 0.0f;
+
+  printf( "\nMemory Plan: %s budget\n", Bytes( memlimit ) );
+  printf( "  grid    : %.0f x %.0f pixels, %i bands (%.0f bytes/pixel)\n",
+          cols, pixels / std::max( 1.0, cols ), nbands, pixbytes );
+  printf( "  shared  : %s (raster, mask, copies)\n", Bytes( plan.shared ) );
+  printf( "  per run : %s peak\n", Bytes( plan.run ) );
+
+  const double need = plan.shared + std::max( loading, plan.run ) + 2.0f * minimal;
+  if ( need > memlimit )
+  {
+    printf( "\nERROR: Needs at least %s, use a coarser -tr or fewer bands.\n", Bytes( need ) );
+    return false;
+  }
+
+  // concurrent sweep runs that fit
+  const double room = memlimit - plan.shared - 2.0f * minimal;
+  plan.runs = std::max( 1, std::min( plan.runs, (int) ( room / plan.run ) ) );
+  plan.runs = std::min( plan.runs, cores );
+  const double left = room - std::max( loading, plan.runs * plan.run );
+
+  // leftover split between block cache and zonal read window
+  plan.cache = minimal + std::min( 0.5f * left, 2048.0f * MB );
+  plan.window = minimal + std::min( 0.25f * left, 512.0f * MB );
+  GDALSetCacheMax64( (GIntBig) plan.cache );
+
+  printf( "  parallel: %i runs x %i threads\n", plan.runs,
+          std::max( 1, plan.threads / plan.runs ) );
+  printf( "  gdal    : %s block cache\n", Bytes( plan.cache ) );
+  if ( !StatFilenames.empty() )
+    printf( "  window  : %s zonal read window\n", Bytes( plan.window ) );
+  if ( StatFilenames.empty() ) plan.window = 0.0f;
+  printf( "  total   : %s\n\n", Bytes( plan.shared + std::max( loading, plan.runs * plan.run )
+                                         + plan.cache + plan.window ) );
+  return true;
+}
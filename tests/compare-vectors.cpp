@@ -0,0 +1,212 @@
+/*
+ *  Copyright (c) 2015  Balint Cristian (cristian.balint@gmail.com)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+/* compare-vectors.cpp */
+/* Golden polygon output comparison */
+
+#include <math.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "gdal.h"
+#include "gdal_priv.h"
+#include "ogrsf_frmts.h"
+#include "ogr_api.h"
+#include "cpl_string.h"
+
+using namespace std;
+
+
+// one polygon feature, matched by extent and area
+typedef struct SEGMENT {
+  OGREnvelope env;
+  double area;
+  int rings;                     // outer rings and holes
+  OGRGeometry *geom;
+  std::vector< double > values;  // golden numeric fields
+} SEGMENT;
+
+static bool SegmentLess( const SEGMENT& a, const SEGMENT& b )
+{
+  if ( a.env.MaxY != b.env.MaxY ) return a.env.MaxY > b.env.MaxY;
+  if ( a.env.MinX != b.env.MinX ) return a.env.MinX < b.env.MinX;
+  if ( a.env.MinY != b.env.MinY ) return a.env.MinY > b.env.MinY;
+  if ( a.env.MaxX != b.env.MaxX ) return a.env.MaxX < b.env.MaxX;
+  return a.area < b.area;
+}
+
+// rings of a polygon or multipolygon
+static int CountRings( OGRGeometryH hGeom )
+{
+  if ( wkbFlatten( OGR_G_GetGeometryType( hGeom ) ) == wkbPolygon )
+    return OGR_G_GetGeometryCount( hGeom );
+  int rings = 0;
+  for ( int i = 0; i < OGR_G_GetGeometryCount( hGeom ); i++ )
+    rings += CountRings( OGR_G_GetGeometryRef( hGeom, i ) );
+  return rings;
+}
+
+// first layer of a file, numeric fields named by the golden file
+static bool LoadSegments( const char *filename, std::vector< std::string >& fields,
+                          std::vector< SEGMENT >& segments )
+{
+#if GDALVER >= 2
+  GDALDataset *poDS = (GDALDataset *) GDALOpenEx( filename, GDAL_OF_VECTOR, NULL, NULL, NULL );
+#else
+  OGRDataSource *poDS = OGRSFDriverRegistrar::Open( filename, FALSE );
+#endif
+  if ( ( poDS == NULL ) || ( poDS->GetLayerCount() < 1 ) )
+  {
+    printf( "ERROR: Cannot read %s\n", filename );
+    return false;
+  }
+  OGRLayer *poLayer = poDS->GetLayer( 0 );
+  OGRFeatureDefn *poDefn = poLayer->GetLayerDefn();
+
+  // golden file picks the fields, label numbering may differ
+  if ( fields.empty() )
+    for ( int f = 0; f < poDefn->GetFieldCount(); f++ )
+    {
+      OGRFieldDefn *poField = poDefn->GetFieldDefn( f );
+      if ( EQUAL( poField->GetNameRef(), "CLASS" ) ) continue;
+      if ( ( poField->GetType() == OFTInteger ) || ( poField->GetType() == OFTReal ) )
+        fields.push_back( poField->GetNameRef() );
+    }
+  std::vector< int > index( fields.size() );
+  for ( size_t f = 0; f < fields.size(); f++ )
+  {
+    index[f] = poDefn->GetFieldIndex( fields[f].c_str() );
+    if ( index[f] < 0 )
+    {
+      printf( "ERROR: %s has no field %s\n", filename, fields[f].c_str() );
+      return false;
+    }
+  }
+
+  OGRFeature *poFeature;
+  poLayer->ResetReading();
+  while ( ( poFeature = poLayer->GetNextFeature() ) != NULL )
+  {
+    SEGMENT segment;
+    segment.geom = poFeature->StealGeometry();
+    if ( segment.geom == NULL )
+    {
+      OGRFeature::DestroyFeature( poFeature );
+      continue;
+    }
+    segment.geom->getEnvelope( &segment.env );
+    segment.area = OGR_G_Area( (OGRGeometryH) segment.geom );
+    segment.rings = CountRings( (OGRGeometryH) segment.geom );
+    for ( size_t f = 0; f < fields.size(); f++ )
+      segment.values.push_back( poFeature->GetFieldAsDouble( index[f] ) );
+    segments.push_back( segment );
+    OGRFeature::DestroyFeature( poFeature );
+  }
+#if GDALVER >= 2
+  GDALClose( (GDALDatasetH) poDS );
+#else
+  OGRDataSource::DestroyDataSource( poDS );
+#endif
+
+  std::sort( segments.begin(), segments.end(), SegmentLess );
+  return true;
+}
+
+static inline bool Close( const double a, const double b, const double tol )
+{
+  return fabs( a - b ) <= tol * std::max( 1.0, std::max( fabs( a ), fabs( b ) ) );
+}
+
+int main( int argc, char ** argv )
+{
+  if ( argc != 3 )
+  {
+    printf( "Usage: compare-vectors <golden vector> <output vector>\n" );
+    return 2;
+  }
+
+  GDALAllRegister();
+#if GDALVER < 2
+  OGRRegisterAll();
+#endif
+
+  std::vector< std::string > fields;
+  std::vector< SEGMENT > golden, output;
+  if ( !LoadSegments( argv[1], fields, golden )
+    || !LoadSegments( argv[2], fields, output ) )
+    return 1;
+
+  int failures = 0;
+  if ( golden.size() != output.size() )
+  {
+    printf( "DIFF: %lu segments, golden has %lu\n", output.size(), golden.size() );
+    failures++;
+  }
+
+  // pairs in extent order, area and shape must agree
+  const bool geos = OGRGeometryFactory::haveGEOS();
+  double total = 0.0f, diff = 0.0f;
+  const size_t n = std::min( golden.size(), output.size() );
+  for ( size_t i = 0; ( i < n ) && ( failures < 20 ); i++ )
+  {
+    const SEGMENT& g = golden[i];
+    const SEGMENT& o = output[i];
+    total += g.area;
+    bool same = Close( g.area, o.area, 1e-9 )
+             && Close( g.env.MinX, o.env.MinX, 1e-12 ) && Close( g.env.MaxX, o.env.MaxX, 1e-12 )
+             && Close( g.env.MinY, o.env.MinY, 1e-12 ) && Close( g.env.MaxY, o.env.MaxY, 1e-12 )
+             && ( g.rings == o.rings );
+    if ( same && geos )
+    {
+      // same footprint, not just same extent and area
+      OGRGeometry *poDiff = g.geom->SymDifference( o.geom );
+      const double area = poDiff ? OGR_G_Area( (OGRGeometryH) poDiff ) : g.area;
+      diff += area;
+      same = ( area <= 1e-9 * std::max( 1.0, g.area ) ) && o.geom->IsValid();
+      if ( poDiff ) OGRGeometryFactory::destroyGeometry( poDiff );
+    }
+    if ( !same )
+    {
+      printf( "DIFF: segment at (%.3f %.3f) area %.3f rings %i, golden area %.3f rings %i\n",
+              o.env.MinX, o.env.MaxY, o.area, o.rings, g.area, g.rings );
+      failures++;
+      continue;
+    }
+    // statistics up to summation order
+    for ( size_t f = 0; f < fields.size(); f++ )
+      if ( !Close( g.values[f], o.values[f], 1e-6 ) )
+      {
+        printf( "DIFF: segment at (%.3f %.3f) %s %.17g, golden %.17g\n",
+                o.env.MinX, o.env.MaxY, fields[f].c_str(), o.values[f], g.values[f] );
+        failures++;
+        break;
+      }
+  }
+
+  for ( size_t i = 0; i < golden.size(); i++ )
+    OGRGeometryFactory::destroyGeometry( golden[i].geom );
+  for ( size_t i = 0; i < output.size(); i++ )
+    OGRGeometryFactory::destroyGeometry( output[i].geom );
+
+  printf( "%s: %lu segments, %lu fields, area %.3f%s",
+          failures ? "FAILED" : "SAME", output.size(), fields.size(), total,
+          geos ? "" : " (no GEOS, footprints by extent and area)" );
+  if ( geos ) printf( ", footprint difference %.3g", diff );
+  printf( "\n" );
+
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,48 @@
+#!/usr/bin/env python3
+
+# synthetic 3 band rasters in every input type of the loader,
+# fixed seed so goldens stay valid: python3 make-rasters.py
+
+import os
+import numpy
+import rasterio
+from rasterio.transform import from_origin
+
+SIZE = 64
+TYPES = {
+    'byte':    ( 'uint8',   0.0,    255.0 ),
+    'uint16':  ( 'uint16',  0.0,    4000.0 ),
+    'int16':   ( 'int16',   -2000.0, 2000.0 ),
+    'float32': ( 'float32', 0.0,    1.0 ),
+    'float64': ( 'float64', -1.0,   1.0 ),
+}
+
+def scene():
+    rng = numpy.random.RandomState( 42 )
+    yy, xx = numpy.mgrid[0:SIZE, 0:SIZE].astype( 'float64' )
+    # flat patches from nearest of random sites
+    sites = rng.uniform( 0, SIZE, ( 16, 2 ) )
+    dist = ( yy[..., None] - sites[:, 0] ) ** 2 + ( xx[..., None] - sites[:, 1] ) ** 2
+    patch = numpy.argmin( dist, axis=2 )
+    colors = rng.uniform( 0.1, 0.9, ( len( sites ), 3 ) )
+    bands = colors[patch].transpose( 2, 0, 1 )
+    # gentle gradient and texture
+    bands += 0.05 * numpy.sin( xx / 9.0 )[None] * numpy.cos( yy / 13.0 )[None]
+    bands += rng.normal( 0.0, 0.02, bands.shape )
+    return numpy.clip( bands, 0.0, 1.0 )
+
+def main():
+    here = os.path.dirname( os.path.abspath( __file__ ) )
+    bands = scene()
+    for name, ( dtype, lo, hi ) in sorted( TYPES.items() ):
+        data = lo + bands * ( hi - lo )
+        if numpy.dtype( dtype ).kind in 'iu':
+            data = numpy.round( data )
+        profile = dict( driver='GTiff', width=SIZE, height=SIZE, count=3,
+                        dtype=dtype, crs='EPSG:32633', compress='deflate',
+                        transform=from_origin( 500000.0, 4100000.0, 2.0, 2.0 ) )
+        with rasterio.open( os.path.join( here, name + '.tif' ), 'w', **profile ) as dst:
+            dst.write( data.astype( dtype ) )
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,55 @@
+#!/bin/bash
+
+# golden outputs and timing baselines from a reference revision:
+# make-golden.sh [revision], default is the checked out commit; the
+# revision is built clean in a worktree and recorded in tests/golden/REVISION.
+# Rerun it whenever a change is meant to alter segmentation output.
+# needs the same OpenCV and GDAL as the build under test
+
+set -e
+
+src=$(cd $(dirname $0)/.. && pwd)
+rev=$(git -C $src rev-parse --verify "${1:-HEAD}^{commit}")
+work=$(mktemp -d)
+trap "git -C $src worktree remove --force $work/tree 2> /dev/null || true" EXIT
+
+git -C $src worktree add --detach $work/tree $rev
+cmake -S $work/tree -B $work/build -DCMAKE_BUILD_TYPE=Release -DWITH_TESTS=OFF
+cmake --build $work/build -j$(nproc)
+tool=$work/tree/bin/gdal-segment
+
+mkdir -p $src/tests/golden
+grep -v -E "^#|^[[:space:]]*$" $src/tests/cases.txt | \
+while read -r name algo region niter input options; do
+  out=$src/tests/golden/$name.geojson
+  rm -f $out
+  if $tool -algo $algo -region $region -niter $niter $src/$input $options \
+           -of GeoJSON -out $out > $work/$name.log 2>&1; then
+    echo "$name: written"
+  else
+    rm -f $out
+    echo "$name: reference run failed, see $work/$name.log"
+    exit 1
+  fi
+done
+
+# machine specific, a warm run first so the baseline has warm caches
+grep -v -E "^#|^[[:space:]]*$" $src/tests/timing.txt | \
+while read -r name algo region niter input options; do
+  csv=$src/tests/golden/timing-$name.csv
+  rm -f $csv
+  for pass in warm baseline; do
+    check=""
+    if [ $pass = baseline ]; then check="-check $csv"; fi
+    rm -f $work/timing-$name.geojson
+    if ! $tool -algo $algo -region $region -niter $niter $src/$input $options \
+               -of GeoJSON -out $work/timing-$name.geojson $check > $work/timing-$name.log 2>&1; then
+      echo "timing-$name: reference run failed, see $work/timing-$name.log"
+      exit 1
+    fi
+  done
+  echo "timing-$name: written"
+done
+
+git -C $src rev-parse $rev > $src/tests/golden/REVISION
+echo "golden outputs from $(git -C $src rev-parse --short $rev) in $src/tests/golden"
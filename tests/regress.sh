@@ -0,0 +1,44 @@
+#!/bin/bash
+
+# one test case: regress.sh <golden|timing> <gdal-segment> <compare-vectors> <source dir> <case>
+# golden compares polygons with tests/golden/<case>.geojson, timing compares
+# labels and run time with tests/golden/timing-<case>.csv by REGRESS_SLACK percent
+
+mode=$1; tool=$2; compare=$3; src=$4; name=$5
+
+if [ "$mode" = "timing" ]; then list=$src/tests/timing.txt; else list=$src/tests/cases.txt; fi
+line=$(grep -E "^$name[[:space:]]" $list)
+if [ -z "$line" ]; then
+  echo "no case $name in $list"
+  exit 1
+fi
+read -r name algo region niter input options <<< "$line"
+
+if [ -f $src/tests/golden/REVISION ]; then
+  echo "reference revision $(cat $src/tests/golden/REVISION)"
+fi
+
+if [ "$mode" = "timing" ]; then
+  # baseline only from the reference build, never from the run under test
+  baseline=$src/tests/golden/timing-$name.csv
+  if [ ! -f $baseline ]; then
+    echo "no timing baseline for $name, run tests/make-golden.sh"
+    exit 77
+  fi
+  rm -f timing-$name.geojson
+  exec $tool -algo $algo -region $region -niter $niter $src/$input $options \
+             -of GeoJSON -out timing-$name.geojson \
+             -check $baseline -slack ${REGRESS_SLACK:-25}
+fi
+
+golden=$src/tests/golden/$name.geojson
+if [ ! -f $golden ]; then
+  echo "no golden output for $name, run tests/make-golden.sh"
+  exit 77
+fi
+
+rm -f output-$name.geojson
+$tool -algo $algo -region $region -niter $niter $src/$input $options \
+      -of GeoJSON -out output-$name.geojson || exit 1
+
+$compare $golden output-$name.geojson